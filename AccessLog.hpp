@@ -0,0 +1,234 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <new>
+#include <cstdio>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "Metrics.hpp"
+
+/**
+ *  Structured access log
+ *
+ *  Workers push one fixed size entry per request into a bounded
+ *  lock-free ring in a shared anonymous mapping, a background
+ *  process drains it and appends the entries as JSON lines with
+ *  one write() per batch. When the ring is full entries are
+ *  dropped and counted, a worker never waits for the log.
+ */
+class AccessLog
+{
+public:
+    static constexpr size_t METHOD_LEN = 8;
+    static constexpr size_t PATH_LEN = 256;
+
+    AccessLog(const std::string &path, size_t capacity = 8192) : m_path(path), m_capacity(capacity), m_shared(nullptr), m_entries(nullptr), m_fd(-1)
+    {
+        if ((m_capacity & (m_capacity - 1)) != 0)
+            throw std::runtime_error("Access Log Capacity Must Be A Power Of 2");
+
+        size_t size = sizeof(Shared) + m_capacity * sizeof(Entry);
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Access Log");
+
+        m_shared = new (mem) Shared();
+        m_entries = reinterpret_cast<Entry *>(static_cast<char *>(mem) + sizeof(Shared));
+        for (size_t i = 0; i < m_capacity; i++)
+            new (&m_entries[i]) Entry(i);
+    }
+
+    ~AccessLog()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+        munmap(m_shared, sizeof(Shared) + m_capacity * sizeof(Entry));
+    }
+
+    AccessLog(const AccessLog &) = delete;
+    AccessLog &operator=(const AccessLog &) = delete;
+
+    /**
+     *  Add the entry for a completed request
+     *
+     *  Return false if the ring was full and the entry dropped.
+     */
+    bool push(const RequestRecord &record, const char *client, std::string_view method, std::string_view path)
+    {
+        uint64_t pos = m_shared->enqueue.load(std::memory_order_relaxed);
+        Entry *entry;
+        while (true)
+        {
+            entry = &m_entries[pos & (m_capacity - 1)];
+            uint64_t seq = entry->sequence.load(std::memory_order_acquire);
+            int64_t diff = int64_t(seq) - int64_t(pos);
+            if (diff == 0)
+            {
+                if (m_shared->enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                m_shared->dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else
+            {
+                pos = m_shared->enqueue.load(std::memory_order_relaxed);
+            }
+        }
+
+        clock_gettime(CLOCK_REALTIME, &entry->time);
+        strncpy(entry->client, client, sizeof(entry->client) - 1);
+        entry->client[sizeof(entry->client) - 1] = '\0';
+        size_t method_len = method.copy(entry->method, METHOD_LEN - 1);
+        entry->method[method_len] = '\0';
+        size_t path_len = path.copy(entry->path, PATH_LEN - 1);
+        entry->path[path_len] = '\0';
+        entry->status = record.status;
+        entry->bytes_in = record.bytes_in;
+        entry->bytes_out = record.bytes_out;
+        entry->duration_us = record.elapsed_us();
+
+        entry->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     *  Append every published entry to the log file
+     *
+     *  Called only from the single drain process.
+     *  Return the number of entries written.
+     */
+    size_t drain()
+    {
+        if (m_fd < 0)
+        {
+            m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (m_fd < 0)
+            {
+                BOOST_LOG_TRIVIAL(error) << "Cannot Open Access Log: " << m_path;
+                return 0;
+            }
+        }
+
+        std::string batch;
+        size_t count = 0;
+        uint64_t pos = m_shared->dequeue.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Entry &entry = m_entries[pos & (m_capacity - 1)];
+            if (entry.sequence.load(std::memory_order_acquire) != pos + 1)
+                break;
+
+            format(entry, batch);
+            entry.sequence.store(pos + m_capacity, std::memory_order_release);
+            pos++;
+            count++;
+        }
+        m_shared->dequeue.store(pos, std::memory_order_relaxed);
+
+        uint64_t dropped = m_shared->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0)
+            batch += "{\"dropped\":" + std::to_string(dropped) + "}\n";
+
+        if (!batch.empty() && write(m_fd, batch.data(), batch.size()) < 0)
+            BOOST_LOG_TRIVIAL(error) << "Cannot Write Access Log: " << strerror(errno);
+
+        return count;
+    }
+
+    /**
+     *  Append value as the inside of a JSON string
+     *
+     */
+    static void escape(std::string_view value, std::string &out)
+    {
+        for (const char *c = value.data(); c != value.data() + value.size(); c++)
+        {
+            if (*c == '"' || *c == '\\')
+            {
+                out += '\\';
+                out += *c;
+            }
+            else if (static_cast<unsigned char>(*c) < 0x20)
+            {
+                char hex[8];
+                snprintf(hex, sizeof(hex), "\\u%04x", *c);
+                out += hex;
+            }
+            else
+            {
+                out += *c;
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        Entry(uint64_t seq) : sequence(seq) {}
+
+        std::atomic<uint64_t> sequence;
+        struct timespec time;
+        char client[INET6_ADDRSTRLEN];
+        char method[METHOD_LEN];
+        char path[PATH_LEN];
+        int status;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+        uint64_t duration_us;
+    };
+
+    struct Shared
+    {
+        alignas(64) std::atomic<uint64_t> enqueue{0};
+        alignas(64) std::atomic<uint64_t> dequeue{0};
+        alignas(64) std::atomic<uint64_t> dropped{0};
+    };
+
+    static void format(const Entry &entry, std::string &out)
+    {
+        char time_buf[32];
+        struct tm tm;
+        gmtime_r(&entry.time.tv_sec, &tm);
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+
+        char ms_buf[16];
+        snprintf(ms_buf, sizeof(ms_buf), ".%03dZ", int(entry.time.tv_nsec / 1000000));
+
+        out += "{\"time\":\"";
+        out += time_buf;
+        out += ms_buf;
+        out += "\",\"client\":\"";
+        out += entry.client;
+        out += "\",\"method\":\"";
+        escape(entry.method, out);
+        out += "\",\"path\":\"";
+        escape(entry.path, out);
+        out += "\",\"status\":" + std::to_string(entry.status);
+        out += ",\"bytes_in\":" + std::to_string(entry.bytes_in);
+        out += ",\"bytes_out\":" + std::to_string(entry.bytes_out);
+        out += ",\"duration_us\":" + std::to_string(entry.duration_us);
+        out += "}\n";
+    }
+
+    std::string m_path;
+    size_t m_capacity;
+    Shared *m_shared;
+    Entry *m_entries;
+    int m_fd;
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <stdexcept>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+
+/**
+ *  Admission limits
+ *
+ *  Requests over a limit are answered 503 Slow Down with Retry-After.
+ */
+struct Limits
+{
+    size_t connections = 512;                   // concurrent connections, one worker each
+    uint64_t queued_bytes = uint64_t(1) << 30;  // request bodies being received
+    unsigned int retry_after = 1;               // seconds
+};
+
+/**
+ *  In flight request counters per class of request
+ *
+ *  The counters live in a shared anonymous mapping so every worker
+ *  sees the same totals. Classes and their limits are set up in the
+ *  parent before it forks, a class without a limit is not counted.
+ */
+class Admission
+{
+public:
+    static constexpr size_t MAX_CLASSES = 16;
+    static constexpr uint32_t NO_CLASS = ~uint32_t(0);
+
+    Admission() : m_shared(nullptr), m_classes(), m_queued_limit(0)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Admission Counters");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~Admission()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    Admission(const Admission &) = delete;
+    Admission &operator=(const Admission &) = delete;
+
+    /**
+     *  Limit the requests of a class in flight at once, 0 removes the limit
+     *
+     */
+    void setLimit(const std::string &name, unsigned int limit)
+    {
+        for (auto &c : m_classes)
+        {
+            if (c.first == name)
+            {
+                c.second = limit;
+                return;
+            }
+        }
+        if (m_classes.size() >= MAX_CLASSES)
+            throw std::runtime_error("Too Many Admission Classes");
+        m_classes.emplace_back(name, limit);
+    }
+
+    inline void setQueuedLimit(uint64_t bytes) { m_queued_limit = bytes; }
+
+    /**
+     *  Return the index of a limited class, or NO_CLASS
+     *
+     */
+    uint32_t find(std::string_view name) const
+    {
+        for (size_t i = 0; i < m_classes.size(); i++)
+        {
+            if ((m_classes[i].second > 0) && (m_classes[i].first == name))
+                return i;
+        }
+        return NO_CLASS;
+    }
+
+    /**
+     *  Take a place for a request of a class with a body of bytes
+     *
+     *  Return false, taking nothing, if either limit would be passed.
+     */
+    bool admit(uint32_t index, uint64_t bytes)
+    {
+        if (bytes > 0)
+        {
+            uint64_t queued = m_shared->queued_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+            if ((m_queued_limit > 0) && (queued > m_queued_limit))
+            {
+                m_shared->queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+                m_shared->rejected_bytes.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        if (index != NO_CLASS)
+        {
+            Class &c = m_shared->classes[index];
+            if (c.in_flight.fetch_add(1, std::memory_order_relaxed) >= int64_t(m_classes[index].second))
+            {
+                c.in_flight.fetch_sub(1, std::memory_order_relaxed);
+                c.rejected.fetch_add(1, std::memory_order_relaxed);
+                if (bytes > 0)
+                    m_shared->queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void release(uint32_t index, uint64_t bytes)
+    {
+        if (bytes > 0)
+            m_shared->queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        if (index != NO_CLASS)
+            m_shared->classes[index].in_flight.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    inline void rejectConnection()
+    {
+        m_shared->rejected_connections.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        out << "# HELP http_in_flight_requests Requests in flight per admission class.\n";
+        out << "# TYPE http_in_flight_requests gauge\n";
+        for (size_t i = 0; i < m_classes.size(); i++)
+            out << "http_in_flight_requests{class=\"" << m_classes[i].first << "\"} " << m_shared->classes[i].in_flight.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_in_flight_limit Limit on requests in flight per admission class.\n";
+        out << "# TYPE http_in_flight_limit gauge\n";
+        for (size_t i = 0; i < m_classes.size(); i++)
+            out << "http_in_flight_limit{class=\"" << m_classes[i].first << "\"} " << m_classes[i].second << "\n";
+
+        out << "# HELP http_rejected_requests_total Requests answered 503 Slow Down.\n";
+        out << "# TYPE http_rejected_requests_total counter\n";
+        for (size_t i = 0; i < m_classes.size(); i++)
+            out << "http_rejected_requests_total{reason=\"class\",class=\"" << m_classes[i].first << "\"} " << m_shared->classes[i].rejected.load(std::memory_order_relaxed) << "\n";
+        out << "http_rejected_requests_total{reason=\"queued_bytes\"} " << m_shared->rejected_bytes.load(std::memory_order_relaxed) << "\n";
+        out << "http_rejected_requests_total{reason=\"connections\"} " << m_shared->rejected_connections.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_queued_bytes Request body bytes admitted and not yet handled.\n";
+        out << "# TYPE http_queued_bytes gauge\n";
+        out << "http_queued_bytes " << m_shared->queued_bytes.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    struct alignas(64) Class
+    {
+        std::atomic<int64_t> in_flight{0};
+        std::atomic<uint64_t> rejected{0};
+    };
+
+    struct Shared
+    {
+        Class classes[MAX_CLASSES];
+        alignas(64) std::atomic<uint64_t> queued_bytes{0};
+        std::atomic<uint64_t> rejected_bytes{0};
+        std::atomic<uint64_t> rejected_connections{0};
+    };
+
+    Shared *m_shared;
+    // set before the server forks
+    std::vector<std::pair<std::string, unsigned int>> m_classes;
+    uint64_t m_queued_limit;
+};
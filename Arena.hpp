@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+/**
+ *  Per connection memory for the request being handled
+ *
+ *  A monotonic buffer over one block allocated up front. Everything
+ *  a request allocates from it is freed at once by reset(), a request
+ *  which outgrows the block carries on from the heap.
+ */
+class Arena
+{
+public:
+    Arena(size_t size = 64 * 1024) : m_buffer(new std::byte[size]), m_resource(m_buffer.get(), size, std::pmr::new_delete_resource())
+    {
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    inline std::pmr::memory_resource *resource() { return &m_resource; }
+
+    /**
+     *  Free everything, nothing allocated from the arena may be used after
+     *
+     */
+    inline void reset() { m_resource.release(); }
+
+private:
+    std::unique_ptr<std::byte[]> m_buffer;
+    std::pmr::monotonic_buffer_resource m_resource;
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "StorageRoots.hpp"
+
+/**
+ *  Exclusive lock on a bucket directory
+ *
+ *  Shared by every worker process, held while the
+ *  bucket contents and its statistics are changed together.
+ */
+class BucketLock
+{
+public:
+    BucketLock(const std::filesystem::path &bucket_path) : m_fd(open(bucket_path.c_str(), O_RDONLY | O_DIRECTORY))
+    {
+        if (m_fd >= 0)
+            flock(m_fd, LOCK_EX);
+    }
+
+    ~BucketLock()
+    {
+        if (m_fd >= 0)
+        {
+            flock(m_fd, LOCK_UN);
+            close(m_fd);
+        }
+    }
+
+    BucketLock(const BucketLock &) = delete;
+    BucketLock &operator=(const BucketLock &) = delete;
+
+    inline bool locked() const { return m_fd >= 0; }
+    inline int fd() const { return m_fd; }
+
+private:
+    int m_fd;
+};
+
+/**
+ *  Per bucket counters
+ *
+ *  Kept as extended attributes on the bucket directory
+ *  so they persist, updated under the BucketLock.
+ */
+struct BucketStats
+{
+    BucketStats() : object_count(0), total_bytes(0), last_modified(0) {}
+
+    long object_count;
+    long total_bytes;
+    time_t last_modified;
+
+    static constexpr const char *XATT_OBJECT_COUNT = "user.S3.ObjectCount";
+    static constexpr const char *XATT_TOTAL_BYTES = "user.S3.TotalBytes";
+    static constexpr const char *XATT_LAST_MODIFIED = "user.S3.LastModified";
+
+    // last_modified only ever rises, a delete of the newest object leaves it behind
+    inline bool operator==(const BucketStats &other) const
+    {
+        return object_count == other.object_count && total_bytes == other.total_bytes;
+    }
+
+    /**
+     *  Read the counters of a bucket
+     *
+     *  Return false if the bucket has no counters yet.
+     */
+    static bool read(const std::filesystem::path &bucket_path, BucketStats &stats)
+    {
+        int fd = open(bucket_path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+            return false;
+        bool ok = read(fd, stats);
+        close(fd);
+        return ok;
+    }
+
+    static bool read(int fd, BucketStats &stats)
+    {
+        long last_modified = 0;
+        bool ok = getValue(fd, XATT_OBJECT_COUNT, stats.object_count) &&
+                  getValue(fd, XATT_TOTAL_BYTES, stats.total_bytes) &&
+                  getValue(fd, XATT_LAST_MODIFIED, last_modified);
+        stats.last_modified = last_modified;
+        return ok;
+    }
+
+    static bool write(int fd, const BucketStats &stats)
+    {
+        return setValue(fd, XATT_OBJECT_COUNT, stats.object_count) &&
+               setValue(fd, XATT_TOTAL_BYTES, stats.total_bytes) &&
+               setValue(fd, XATT_LAST_MODIFIED, stats.last_modified);
+    }
+
+    /**
+     *  Apply a change to the counters, the caller holds the BucketLock
+     *
+     */
+    static bool update(const BucketLock &lock, long count_delta, long bytes_delta, time_t modified)
+    {
+        if (!lock.locked())
+            return false;
+
+        BucketStats stats;
+        read(lock.fd(), stats);
+        stats.object_count += count_delta;
+        stats.total_bytes += bytes_delta;
+        if (modified > stats.last_modified)
+            stats.last_modified = modified;
+        return write(lock.fd(), stats);
+    }
+
+    /**
+     *  Count the objects in every copy of the bucket directory
+     *
+     */
+    static BucketStats scan(const std::vector<std::filesystem::path> &bucket_paths)
+    {
+        BucketStats stats;
+        for (auto &bucket_path : bucket_paths)
+        {
+            std::error_code ec;
+            for (const auto &entry : std::filesystem::directory_iterator(bucket_path, ec))
+            {
+                if (StorageRoots::isHidden(entry.path()))
+                    continue;
+
+                struct stat struct_stat;
+                if (stat(entry.path().c_str(), &struct_stat) == 0 && S_ISREG(struct_stat.st_mode))
+                {
+                    stats.object_count++;
+                    stats.total_bytes += struct_stat.st_size;
+                    if (struct_stat.st_mtim.tv_sec > stats.last_modified)
+                        stats.last_modified = struct_stat.st_mtim.tv_sec;
+                }
+            }
+        }
+        return stats;
+    }
+
+    /**
+     *  Rebuild the counters of a bucket from its contents
+     *
+     *  The scan runs without the lock so writes to a large bucket are
+     *  not held up by it. A write during the scan changes the stored
+     *  counters, and the bucket is left for the next run.
+     *  Return true if the stored counters had drifted.
+     */
+    static bool reconcile(const std::filesystem::path &bucket_path, const std::vector<std::filesystem::path> &bucket_paths)
+    {
+        BucketStats before;
+        bool found;
+        {
+            BucketLock lock{bucket_path};
+            if (!lock.locked())
+                return false;
+            found = read(lock.fd(), before);
+        }
+
+        BucketStats actual = scan(bucket_paths);
+        if (found && before == actual)
+            return false;
+
+        BucketLock lock{bucket_path};
+        if (!lock.locked())
+            return false;
+        BucketStats after;
+        if (read(lock.fd(), after) != found || (found && !(after == before && after.last_modified == before.last_modified)))
+            return false;
+
+        write(lock.fd(), actual);
+        return true;
+    }
+
+private:
+    static bool getValue(int fd, const char *name, long &value)
+    {
+        char buf[32];
+        ssize_t sz = fgetxattr(fd, name, buf, sizeof(buf) - 1);
+        if (sz <= 0)
+            return false;
+        buf[sz] = '\0';
+        value = atol(buf);
+        return true;
+    }
+
+    static bool setValue(int fd, const char *name, long value)
+    {
+        std::string str = std::to_string(value);
+        return fsetxattr(fd, name, str.c_str(), str.size(), 0) == 0;
+    }
+};
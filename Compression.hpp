@@ -0,0 +1,749 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <string_view>
+#include <streambuf>
+#include <ostream>
+#include <memory_resource>
+#include <stdexcept>
+#include <new>
+#include <vector>
+
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "BucketStats.hpp"
+
+/**
+ *  Content-Encoding of response bodies
+ *
+ *  What a client accepts is read from Accept-Encoding, what is worth
+ *  compressing is decided by content type and size.
+ */
+class ContentCoding
+{
+public:
+    enum class CODING
+    {
+        IDENTITY,
+        GZIP,
+        BROTLI,
+        COUNT
+    };
+
+    // smaller bodies are sent as they are
+    static constexpr uint64_t MIN_SIZE = 1024;
+
+    static inline unsigned int bit(CODING coding) { return 1u << unsigned(coding); }
+
+    /**
+     *  The codings an Accept-Encoding header allows, as bit()s
+     *
+     *  A coding is accepted when it, or *, is listed with q above 0.
+     *  IDENTITY is always allowed, it is what is sent otherwise.
+     */
+    static unsigned int accepted(std::string_view accept_encoding)
+    {
+        unsigned int codings = bit(CODING::IDENTITY);
+        unsigned int refused = 0;
+        bool any = false;
+
+        while (!accept_encoding.empty())
+        {
+            size_t comma = accept_encoding.find(',');
+            std::string_view item = accept_encoding.substr(0, comma);
+            accept_encoding.remove_prefix((comma == std::string_view::npos) ? accept_encoding.size() : comma + 1);
+
+            bool allowed = true;
+            size_t semi = item.find(';');
+            if (semi != std::string_view::npos)
+            {
+                std::string_view q = trim(item.substr(semi + 1));
+                if ((q.size() > 2) && ((q[0] == 'q') || (q[0] == 'Q')) && (q[1] == '='))
+                    allowed = (q.substr(2).find_first_not_of("0.") != std::string_view::npos);
+                item = item.substr(0, semi);
+            }
+            item = trim(item);
+
+            unsigned int coding = 0;
+            if (equals(item, "gzip") || equals(item, "x-gzip"))
+                coding = bit(CODING::GZIP);
+            else if (equals(item, "br"))
+                coding = bit(CODING::BROTLI);
+            else if (item == "*")
+                any = allowed;
+
+            if (allowed)
+                codings |= coding;
+            else
+                refused |= coding;
+        }
+
+        if (any)
+            codings |= (bit(CODING::GZIP) | bit(CODING::BROTLI)) & ~refused;
+        return codings;
+    }
+
+    /**
+     *  Text, JSON, XML and scripts compress well, images, audio,
+     *  video and archives are already compressed
+     */
+    static bool compressible(std::string_view content_type)
+    {
+        content_type = trim(content_type.substr(0, content_type.find(';')));
+
+        if (content_type.rfind("text/", 0) == 0)
+            return true;
+        if ((content_type.size() > 5) && ((content_type.compare(content_type.size() - 4, 4, "+xml") == 0) || (content_type.compare(content_type.size() - 5, 5, "+json") == 0)))
+            return true;
+
+        static constexpr std::string_view types[] = {
+            "application/json",
+            "application/xml",
+            "application/javascript",
+            "application/x-javascript",
+            "application/x-ndjson",
+            "application/wasm"};
+        for (auto &type : types)
+        {
+            if (content_type == type)
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     *  The Content-Encoding value and variant file suffix of a coding
+     *
+     */
+    static inline std::string_view name(CODING coding)
+    {
+        return (coding == CODING::GZIP) ? "gzip" : (coding == CODING::BROTLI) ? "br" : "identity";
+    }
+
+    static inline std::string_view suffix(CODING coding)
+    {
+        return (coding == CODING::GZIP) ? ".gz" : (coding == CODING::BROTLI) ? ".br" : "";
+    }
+
+private:
+    static std::string_view trim(std::string_view value)
+    {
+        size_t start = value.find_first_not_of(" \t");
+        if (start == std::string_view::npos)
+            return std::string_view();
+        return value.substr(start, value.find_last_not_of(" \t") - start + 1);
+    }
+
+    static bool equals(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            if (tolower(a[i]) != b[i])
+                return false;
+        }
+        return true;
+    }
+};
+
+/**
+ *  A generated response body, gzipped as it is written
+ *
+ *  Written through a std::ostream. Output is held in a small buffer
+ *  and a body which outgrows it is deflated from then on, so only the
+ *  compressed body is kept. A body which fits is compressed when it
+ *  is finished, if it reached MIN_SIZE. The deflate state is made on
+ *  first use and reset between bodies, one writer per connection.
+ */
+class GzipWriter : public std::streambuf
+{
+public:
+    static constexpr size_t BUFFER_SIZE = 16384;
+    // generated per request, the fastest level is most of the saving
+    static constexpr int LEVEL = 1;
+
+    GzipWriter() : m_stream(), m_ready(false), m_allowed(false), m_gzip(false), m_body(nullptr), m_raw_size(0)
+    {
+    }
+
+    ~GzipWriter()
+    {
+        if (m_ready)
+            deflateEnd(&m_stream);
+    }
+
+    GzipWriter(const GzipWriter &) = delete;
+    GzipWriter &operator=(const GzipWriter &) = delete;
+
+    /**
+     *  Write the next body into body, gzipped only if gzip is set
+     *
+     */
+    std::streambuf *start(std::pmr::string &body, bool gzip)
+    {
+        body.clear();
+        m_body = &body;
+        m_allowed = gzip;
+        m_gzip = false;
+        m_raw_size = 0;
+        setp(m_buffer, m_buffer + BUFFER_SIZE);
+        return this;
+    }
+
+    /**
+     *  Complete the body, true if it was gzipped
+     *
+     */
+    bool finish()
+    {
+        if (!m_gzip && m_allowed && (m_raw_size + size_t(pptr() - pbase()) >= ContentCoding::MIN_SIZE))
+            begin();
+
+        if (m_gzip)
+            deflateBuffer(Z_FINISH);
+        else
+            m_body->append(pbase(), pptr() - pbase());
+
+        m_raw_size += pptr() - pbase();
+        setp(m_buffer, m_buffer + BUFFER_SIZE);
+        return m_gzip;
+    }
+
+    // the size of the body before it was compressed
+    inline uint64_t rawSize() const { return m_raw_size; }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (!m_gzip && m_allowed)
+            begin();
+
+        if (m_gzip)
+            deflateBuffer(Z_NO_FLUSH);
+        else
+            m_body->append(pbase(), pptr() - pbase());
+
+        m_raw_size += pptr() - pbase();
+        setp(m_buffer, m_buffer + BUFFER_SIZE);
+
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    void begin()
+    {
+        if (!m_ready)
+        {
+            // 15 window bits + 16 writes the gzip wrapper
+            if (deflateInit2(&m_stream, LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                m_allowed = false;
+                return;
+            }
+            m_ready = true;
+        }
+        else
+            deflateReset(&m_stream);
+        m_gzip = true;
+    }
+
+    void deflateBuffer(int flush)
+    {
+        m_stream.next_in = reinterpret_cast<Bytef *>(pbase());
+        m_stream.avail_in = pptr() - pbase();
+
+        int result;
+        do
+        {
+            size_t used = m_body->size();
+            m_body->resize(used + BUFFER_SIZE);
+            m_stream.next_out = reinterpret_cast<Bytef *>(m_body->data() + used);
+            m_stream.avail_out = BUFFER_SIZE;
+            result = deflate(&m_stream, flush);
+            m_body->resize(used + BUFFER_SIZE - m_stream.avail_out);
+        } while ((m_stream.avail_out == 0) || ((flush == Z_FINISH) && (result == Z_OK)));
+    }
+
+    z_stream m_stream;
+    bool m_ready;
+    bool m_allowed;
+    bool m_gzip;
+    std::pmr::string *m_body;
+    uint64_t m_raw_size;
+    char m_buffer[BUFFER_SIZE];
+};
+
+/**
+ *  Compressed response counters
+ *
+ *  Lives in a shared anonymous mapping created before the server
+ *  forks, like the Metrics.
+ */
+class Compression
+{
+public:
+    enum class SOURCE
+    {
+        STREAM,   // compressed as it was generated
+        VARIANT,  // a precompressed variant was sent
+        COUNT
+    };
+
+    Compression() : m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Compression Counters");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~Compression()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    Compression(const Compression &) = delete;
+    Compression &operator=(const Compression &) = delete;
+
+    void sent(ContentCoding::CODING coding, SOURCE source, uint64_t raw_bytes, uint64_t sent_bytes)
+    {
+        Counters &counters = m_shared->counters[size_t(coding)][size_t(source)];
+        counters.responses.fetch_add(1, std::memory_order_relaxed);
+        counters.raw_bytes.fetch_add(raw_bytes, std::memory_order_relaxed);
+        counters.sent_bytes.fetch_add(sent_bytes, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        static constexpr const char *sources[] = {"stream", "variant"};
+
+        out << "# HELP http_compressed_responses_total Responses sent with a Content-Encoding.\n";
+        out << "# TYPE http_compressed_responses_total counter\n";
+        each(out, "http_compressed_responses_total", sources, [](const Counters &c) { return c.responses.load(std::memory_order_relaxed); });
+
+        out << "# HELP http_compressed_raw_bytes_total Body bytes before compression.\n";
+        out << "# TYPE http_compressed_raw_bytes_total counter\n";
+        each(out, "http_compressed_raw_bytes_total", sources, [](const Counters &c) { return c.raw_bytes.load(std::memory_order_relaxed); });
+
+        out << "# HELP http_compressed_sent_bytes_total Body bytes sent after compression.\n";
+        out << "# TYPE http_compressed_sent_bytes_total counter\n";
+        each(out, "http_compressed_sent_bytes_total", sources, [](const Counters &c) { return c.sent_bytes.load(std::memory_order_relaxed); });
+    }
+
+private:
+    struct Counters
+    {
+        std::atomic<uint64_t> responses{0};
+        std::atomic<uint64_t> raw_bytes{0};
+        std::atomic<uint64_t> sent_bytes{0};
+    };
+
+    struct Shared
+    {
+        Counters counters[size_t(ContentCoding::CODING::COUNT)][size_t(SOURCE::COUNT)];
+    };
+
+    template <typename F>
+    void each(std::ostream &out, const char *metric, const char *const *sources, F value) const
+    {
+        for (size_t c = size_t(ContentCoding::CODING::GZIP); c < size_t(ContentCoding::CODING::COUNT); c++)
+        {
+            for (size_t s = 0; s < size_t(SOURCE::COUNT); s++)
+                out << metric << "{coding=\"" << ContentCoding::name(ContentCoding::CODING(c)) << "\",source=\"" << sources[s] << "\"} " << value(m_shared->counters[c][s]) << "\n";
+        }
+    }
+
+    Shared *m_shared;
+};
+
+/**
+ *  Precompressed variants of stored files
+ *
+ *  A variant is a hidden sibling of the file, .name.gz or .name.br,
+ *  tagged with the ETag of the file it was made from so a variant of
+ *  an older version is never sent. Workers queue files without a
+ *  current variant and a background task builds them. The queue lives
+ *  in a shared anonymous mapping created before the server forks,
+ *  a slot is claimed with a compare and swap so a worker killed while
+ *  queueing cannot block the others.
+ */
+class VariantCache
+{
+public:
+    static constexpr size_t QUEUE_SLOTS = 64;
+    static constexpr uint64_t MAX_SIZE = uint64_t(64) << 20;  // larger files are always sent as they are
+    static constexpr const char *XATT_SOURCE = "user.Variant.Source";
+    static constexpr int GZIP_LEVEL = 9;
+    static constexpr int BROTLI_QUALITY = 9;
+
+    VariantCache() : m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Variant Queue");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~VariantCache()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    VariantCache(const VariantCache &) = delete;
+    VariantCache &operator=(const VariantCache &) = delete;
+
+    /**
+     *  The variant file of a file for a coding
+     *
+     */
+    static std::string path(std::string_view file, ContentCoding::CODING coding)
+    {
+        size_t slash = file.find_last_of('/');
+        size_t start = (slash == std::string_view::npos) ? 0 : slash + 1;
+
+        std::string variant;
+        variant.reserve(file.size() + 4);
+        variant.append(file.substr(0, start)).append(".").append(file.substr(start)).append(ContentCoding::suffix(coding));
+        return variant;
+    }
+
+    /**
+     *  Open the variant of file made from the version with etag
+     *
+     *  Returns -1 if there is none. A variant no smaller than the file
+     *  is kept so it is not built again, the caller sends the file.
+     */
+    static int open(std::string_view file, ContentCoding::CODING coding, std::string_view etag, struct stat &details)
+    {
+        std::string variant = path(file, coding);
+        int fd = ::open(variant.c_str(), O_RDONLY);
+        if (fd < 0)
+            return -1;
+
+        char source[64];
+        ssize_t sz = fgetxattr(fd, XATT_SOURCE, source, sizeof(source));
+        if ((sz < 0) || (std::string_view(source, sz) != etag) || (fstat(fd, &details) != 0))
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /**
+     *  Queue a file to have its variants built, dropped if the queue is full
+     *
+     *  The directory in lock_path is locked while a variant is put in
+     *  place, the one held by whatever removes or replaces the file.
+     */
+    void request(std::string_view file, std::string_view lock_path)
+    {
+        if ((file.size() >= PATH_MAX) || (lock_path.size() >= PATH_MAX))
+            return;
+
+        for (auto &slot : m_shared->slots)
+        {
+            if ((slot.state.load(std::memory_order_acquire) == READY) && (file == slot.path))
+                return;
+        }
+
+        for (auto &slot : m_shared->slots)
+        {
+            uint32_t state = EMPTY;
+            if (slot.state.compare_exchange_strong(state, WRITING, std::memory_order_acq_rel))
+            {
+                memcpy(slot.path, file.data(), file.size());
+                slot.path[file.size()] = '\0';
+                memcpy(slot.lock_path, lock_path.data(), lock_path.size());
+                slot.lock_path[lock_path.size()] = '\0';
+                slot.state.store(READY, std::memory_order_release);
+                m_shared->queued.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        m_shared->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Build the variants of the queued files, run by a background task
+     *
+     */
+    void build()
+    {
+        for (auto &slot : m_shared->slots)
+        {
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+            if (state == WRITING)
+            {
+                // a worker died between claiming and filling the slot
+                if (slot.stale++ > 0)
+                    slot.state.store(EMPTY, std::memory_order_release);
+                continue;
+            }
+            slot.stale = 0;
+            if (state != READY)
+                continue;
+
+            std::string file(slot.path);
+            std::string lock_path(slot.lock_path);
+            slot.state.store(EMPTY, std::memory_order_release);
+
+            for (auto coding : {ContentCoding::CODING::GZIP, ContentCoding::CODING::BROTLI})
+            {
+                RESULT result = make(file, lock_path, coding);
+                if (result == RESULT::BUILT)
+                    m_shared->built.fetch_add(1, std::memory_order_relaxed);
+                else if (result == RESULT::FAILED)
+                    m_shared->failed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     *  Remove the variants of a file which is deleted or replaced
+     *
+     */
+    static void remove(std::string_view file)
+    {
+        unlink(path(file, ContentCoding::CODING::GZIP).c_str());
+        unlink(path(file, ContentCoding::CODING::BROTLI).c_str());
+    }
+
+    /**
+     *  The ETag of a version of a file, as sent with it
+     *
+     */
+    static std::string_view etag(const struct stat &details, char (&buf)[64])
+    {
+        int len = snprintf(buf, sizeof(buf), "%lu-%ld-%ld", (unsigned long)details.st_ino, (long)details.st_size, (long)details.st_mtim.tv_sec);
+        return std::string_view(buf, len);
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        out << "# HELP compressed_variants_queued_total Files queued to have compressed variants built.\n";
+        out << "# TYPE compressed_variants_queued_total counter\n";
+        out << "compressed_variants_queued_total " << m_shared->queued.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP compressed_variants_dropped_total Files not queued as the queue was full.\n";
+        out << "# TYPE compressed_variants_dropped_total counter\n";
+        out << "compressed_variants_dropped_total " << m_shared->dropped.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP compressed_variants_built_total Compressed variants written.\n";
+        out << "# TYPE compressed_variants_built_total counter\n";
+        out << "compressed_variants_built_total " << m_shared->built.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP compressed_variants_failed_total Compressed variants which could not be written.\n";
+        out << "# TYPE compressed_variants_failed_total counter\n";
+        out << "compressed_variants_failed_total " << m_shared->failed.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    static constexpr uint32_t EMPTY = 0;
+    static constexpr uint32_t WRITING = 1;
+    static constexpr uint32_t READY = 2;
+
+    enum class RESULT
+    {
+        BUILT,
+        CURRENT,  // already made from this version
+        STALE,    // the file was removed or replaced while it was compressed
+        FAILED
+    };
+
+    struct Slot
+    {
+        std::atomic<uint32_t> state{EMPTY};
+        uint32_t stale = 0;  // builds which saw the slot WRITING, only touched by the builder
+        char path[PATH_MAX];
+        char lock_path[PATH_MAX];
+    };
+
+    struct Shared
+    {
+        Slot slots[QUEUE_SLOTS];
+        std::atomic<uint64_t> queued{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> built{0};
+        std::atomic<uint64_t> failed{0};
+    };
+
+    /**
+     *  Compress file into a temporary sibling and rename it over the variant
+     *
+     *  The rename is made under the lock a delete or overwrite of the
+     *  file takes to remove its variants, and only if the file is still
+     *  the version compressed, or a variant could outlive its file.
+     */
+    static RESULT make(const std::string &file, const std::string &lock_path, ContentCoding::CODING coding)
+    {
+        int in_fd = ::open(file.c_str(), O_RDONLY);
+        if (in_fd < 0)
+            return RESULT::FAILED;
+
+        // the version read is the one the variant is tagged with
+        struct stat details, existing;
+        char buf[64];
+        if ((fstat(in_fd, &details) != 0) || (uint64_t(details.st_size) > MAX_SIZE))
+        {
+            close(in_fd);
+            return RESULT::FAILED;
+        }
+        std::string_view tag = etag(details, buf);
+
+        int current = open(file, coding, tag, existing);
+        if (current >= 0)
+        {
+            close(current);
+            close(in_fd);
+            return RESULT::CURRENT;
+        }
+
+        std::string variant = path(file, coding);
+        std::string tmp = variant + "." + std::to_string(getpid());
+        int out_fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0)
+        {
+            close(in_fd);
+            return RESULT::FAILED;
+        }
+
+        bool ok = (coding == ContentCoding::CODING::GZIP) ? gzip(in_fd, out_fd) : brotli(in_fd, out_fd);
+        ok = ok && (fsetxattr(out_fd, XATT_SOURCE, tag.data(), tag.size(), 0) == 0);
+        close(out_fd);
+        close(in_fd);
+        if (!ok)
+        {
+            unlink(tmp.c_str());
+            return RESULT::FAILED;
+        }
+
+        BucketLock lock{lock_path};
+        struct stat now;
+        char now_buf[64];
+        if ((stat(file.c_str(), &now) != 0) || (etag(now, now_buf) != tag))
+        {
+            unlink(tmp.c_str());
+            return RESULT::STALE;
+        }
+        if (rename(tmp.c_str(), variant.c_str()) != 0)
+        {
+            unlink(tmp.c_str());
+            return RESULT::FAILED;
+        }
+        return RESULT::BUILT;
+    }
+
+    static bool gzip(int in_fd, int out_fd)
+    {
+        z_stream stream{};
+        if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+
+        std::vector<char> in(65536), out(65536);
+        bool ok = true;
+        int flush;
+        do
+        {
+            ssize_t nread = read(in_fd, in.data(), in.size());
+            if (nread < 0)
+            {
+                ok = false;
+                break;
+            }
+            flush = (nread == 0) ? Z_FINISH : Z_NO_FLUSH;
+            stream.next_in = reinterpret_cast<Bytef *>(in.data());
+            stream.avail_in = nread;
+            do
+            {
+                stream.next_out = reinterpret_cast<Bytef *>(out.data());
+                stream.avail_out = out.size();
+                deflate(&stream, flush);
+                ok = writeAll(out_fd, out.data(), out.size() - stream.avail_out);
+            } while (ok && (stream.avail_out == 0));
+        } while (ok && (flush != Z_FINISH));
+
+        deflateEnd(&stream);
+        return ok;
+    }
+
+    static bool brotli(int in_fd, int out_fd)
+    {
+        BrotliEncoderState *state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+        if (state == nullptr)
+            return false;
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, BROTLI_QUALITY);
+
+        std::vector<uint8_t> in(65536), out(65536);
+        bool ok = true;
+        bool finished = false;
+        while (ok && !finished)
+        {
+            ssize_t nread = read(in_fd, in.data(), in.size());
+            if (nread < 0)
+            {
+                ok = false;
+                break;
+            }
+            BrotliEncoderOperation op = (nread == 0) ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+            size_t avail_in = nread;
+            const uint8_t *next_in = in.data();
+            do
+            {
+                size_t avail_out = out.size();
+                uint8_t *next_out = out.data();
+                if (!BrotliEncoderCompressStream(state, op, &avail_in, &next_in, &avail_out, &next_out, nullptr))
+                {
+                    ok = false;
+                    break;
+                }
+                ok = writeAll(out_fd, reinterpret_cast<char *>(out.data()), out.size() - avail_out);
+            } while (ok && ((avail_in > 0) || BrotliEncoderHasMoreOutput(state)));
+            finished = (op == BROTLI_OPERATION_FINISH) && BrotliEncoderIsFinished(state);
+        }
+
+        BrotliEncoderDestroyInstance(state);
+        return ok;
+    }
+
+    static bool writeAll(int fd, const char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            ssize_t nwritten = ::write(fd, data, len);
+            if (nwritten <= 0)
+                return false;
+            data += nwritten;
+            len -= nwritten;
+        }
+        return true;
+    }
+
+    Shared *m_shared;
+};
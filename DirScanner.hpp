@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+// getxattrat() is new in Linux 6.13, numbered the same on every architecture
+#ifndef SYS_getxattrat
+#define SYS_getxattrat 464
+#endif
+
+/**
+ *  Reads a directory in large getdents64() batches and looks at its
+ *  entries relative to the open directory
+ *
+ *  statx() asks only for the fields wanted and, like the extended
+ *  attribute reads, starts from the directory rather than walking
+ *  the full path of every entry again.
+ */
+class DirScanner
+{
+public:
+    static constexpr size_t BATCH_SIZE = 64 * 1024;
+
+    struct Entry
+    {
+        const char *name;
+        unsigned char type;  // DT_UNKNOWN on file systems which do not say
+    };
+
+    DirScanner(const char *path) : m_fd(open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)), m_size(0), m_pos(0), m_offset(0)
+    {
+    }
+
+    ~DirScanner()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    DirScanner(const DirScanner &) = delete;
+    DirScanner &operator=(const DirScanner &) = delete;
+
+    inline bool opened() const { return m_fd >= 0; }
+    inline int fd() const { return m_fd; }
+
+    /**
+     *  The next entry other than . and .., false at the end
+     *
+     *  The name is valid until the next call.
+     */
+    bool next(Entry &entry)
+    {
+        while (true)
+        {
+            if (m_pos >= m_size)
+            {
+                long nread = syscall(SYS_getdents64, m_fd, m_buffer, BATCH_SIZE);
+                if (nread <= 0)
+                    return false;
+                m_size = nread;
+                m_pos = 0;
+            }
+
+            const Dirent *dirent = reinterpret_cast<const Dirent *>(m_buffer + m_pos);
+            m_pos += dirent->d_reclen;
+            m_offset = dirent->d_off;
+
+            const char *name = dirent->d_name;
+            if ((name[0] == '.') && ((name[1] == '\0') || ((name[1] == '.') && (name[2] == '\0'))))
+                continue;
+
+            entry.name = name;
+            entry.type = dirent->d_type;
+            return true;
+        }
+    }
+
+    /**
+     *  Where the scan is, after the entry last returned
+     *
+     *  A cookie of the file system, valid for seek() on the same
+     *  directory, a new scanner included.
+     */
+    inline int64_t offset() const { return m_offset; }
+
+    /**
+     *  Carry on from an offset() of an earlier scan
+     *
+     */
+    bool seek(int64_t offset)
+    {
+        m_size = 0;
+        m_pos = 0;
+        m_offset = offset;
+        return lseek(m_fd, offset, SEEK_SET) == offset;
+    }
+
+    /**
+     *  statx() an entry for the fields in mask
+     *
+     */
+    inline bool stat(const char *name, unsigned int mask, struct statx &details) const
+    {
+        return statx(m_fd, name, 0, mask, &details) == 0;
+    }
+
+    /**
+     *  Read an extended attribute of an entry
+     *
+     *  Returns its length, or -1 with errno set as getxattr() does.
+     *  Kernels without getxattrat() open the entry to read it.
+     */
+    ssize_t attribute(const char *name, const char *attribute, char *value, size_t size) const
+    {
+        if (s_getxattrat.load(std::memory_order_relaxed))
+        {
+            XattrArgs args = {uint64_t(uintptr_t(value)), uint32_t(size), 0};
+            long length = syscall(SYS_getxattrat, m_fd, name, 0, attribute, &args, sizeof(args));
+            if ((length >= 0) || (errno != ENOSYS))
+                return length;
+            s_getxattrat.store(false, std::memory_order_relaxed);
+        }
+
+        int fd = openat(m_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0)
+            return -1;
+        ssize_t length = fgetxattr(fd, attribute, value, size);
+        int error = errno;
+        close(fd);
+        errno = error;
+        return length;
+    }
+
+private:
+    struct Dirent
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    struct XattrArgs
+    {
+        uint64_t value;
+        uint32_t size;
+        uint32_t flags;
+    };
+
+    static inline std::atomic<bool> s_getxattrat{true};  // shard scans run in threads
+
+    int m_fd;
+    size_t m_size;
+    size_t m_pos;
+    int64_t m_offset;
+    alignas(8) char m_buffer[BATCH_SIZE];
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <stdexcept>
+#include <new>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/**
+ *  How file bodies are sent, and what each way achieved
+ *
+ *  Tiny files are read and written with the response head in one
+ *  call. Others go out with sendfile(), large ones with read ahead
+ *  hints, and a large file which was not in the page cache and has
+ *  not been sent recently has its pages dropped after, so one-shot
+ *  reads of cold objects do not evict hot ones.
+ *  Lives in a shared anonymous mapping created before the server
+ *  forks, like the Metrics.
+ */
+class FileSend
+{
+public:
+    enum class STRATEGY
+    {
+        COPY,       // read with the head into one write
+        SENDFILE,   // sendfile() in chunks
+        READAHEAD,  // sendfile() with read ahead hints
+        COUNT
+    };
+
+    static constexpr size_t TINY = 16 * 1024;
+    static constexpr size_t LARGE = 8 << 20;
+    static constexpr size_t READAHEAD_BYTES = 8 << 20;  // hinted ahead of the cursor
+    static constexpr size_t RECENT_SLOTS = 1 << 14;
+    static constexpr uint64_t RECENT_SECONDS = 600;
+
+    FileSend() : m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map File Send Counters");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~FileSend()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    FileSend(const FileSend &) = delete;
+    FileSend &operator=(const FileSend &) = delete;
+
+    static inline STRATEGY strategy(size_t count)
+    {
+        return (count <= TINY) ? STRATEGY::COPY : (count >= LARGE) ? STRATEGY::READAHEAD : STRATEGY::SENDFILE;
+    }
+
+    void record(STRATEGY strategy, uint64_t bytes, uint64_t elapsed_us)
+    {
+        Counters &counters = m_shared->counters[size_t(strategy)];
+        counters.files.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        counters.elapsed_us.fetch_add(elapsed_us, std::memory_order_relaxed);
+    }
+
+    inline void dropped(uint64_t bytes)
+    {
+        m_shared->dropped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Whether the byte at offset is in the page cache
+     *
+     */
+    static bool cached(int fd, off_t offset)
+    {
+        char byte;
+        struct iovec iov = {&byte, 1};
+        return preadv2(fd, &iov, 1, offset, RWF_NOWAIT) >= 0;
+    }
+
+    /**
+     *  Whether a file was sent in the last RECENT_SECONDS, marking it sent now
+     *
+     *  A slot holds part of the file's identity and when it was last
+     *  sent, two files sharing a slot only make one look recent.
+     */
+    bool recent(const struct stat &details)
+    {
+        uint64_t id = (uint64_t(details.st_dev) * 0x9e3779b97f4a7c15ULL) ^ (uint64_t(details.st_ino) * 0xc2b2ae3d27d4eb4fULL);
+        uint64_t now = uint64_t(time(nullptr));
+        uint64_t tag = id >> 32;
+
+        uint64_t previous = m_shared->recent[id % RECENT_SLOTS].exchange((tag << 32) | (now & 0xffffffff), std::memory_order_relaxed);
+        return ((previous >> 32) == tag) && (((now - previous) & 0xffffffff) < RECENT_SECONDS);
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        static constexpr const char *names[] = {"copy", "sendfile", "readahead"};
+
+        out << "# HELP http_file_sends_total File bodies sent by strategy.\n";
+        out << "# TYPE http_file_sends_total counter\n";
+        for (size_t i = 0; i < size_t(STRATEGY::COUNT); i++)
+            out << "http_file_sends_total{strategy=\"" << names[i] << "\"} " << m_shared->counters[i].files.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_file_send_bytes_total File body bytes sent by strategy.\n";
+        out << "# TYPE http_file_send_bytes_total counter\n";
+        for (size_t i = 0; i < size_t(STRATEGY::COUNT); i++)
+            out << "http_file_send_bytes_total{strategy=\"" << names[i] << "\"} " << m_shared->counters[i].bytes.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_file_send_seconds_total Time spent sending file bodies by strategy.\n";
+        out << "# TYPE http_file_send_seconds_total counter\n";
+        for (size_t i = 0; i < size_t(STRATEGY::COUNT); i++)
+            out << "http_file_send_seconds_total{strategy=\"" << names[i] << "\"} " << m_shared->counters[i].elapsed_us.load(std::memory_order_relaxed) / 1e6 << "\n";
+
+        out << "# HELP http_file_send_dropped_bytes_total Bytes of cold one-shot files dropped from the page cache after sending.\n";
+        out << "# TYPE http_file_send_dropped_bytes_total counter\n";
+        out << "http_file_send_dropped_bytes_total " << m_shared->dropped_bytes.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    struct alignas(64) Counters
+    {
+        std::atomic<uint64_t> files{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> elapsed_us{0};
+    };
+
+    struct Shared
+    {
+        Counters counters[size_t(STRATEGY::COUNT)];
+        alignas(64) std::atomic<uint64_t> dropped_bytes{0};
+        std::atomic<uint64_t> recent[RECENT_SLOTS]{};
+    };
+
+    Shared *m_shared;
+};
@@ -0,0 +1,439 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <deque>
+#include <vector>
+
+/**
+ *  HPACK header compression for HTTP/2 (RFC 7541)
+ *
+ *  Decodes request header blocks with the dynamic table and Huffman
+ *  coded strings. Responses are encoded without indexing or Huffman,
+ *  which every decoder accepts, so the encoder keeps no state.
+ */
+class Hpack
+{
+public:
+    // the dynamic table size this end allows, the HTTP/2 default
+    static constexpr size_t TABLE_SIZE = 4096;
+
+    Hpack() : m_table(), m_size(0), m_max_size(TABLE_SIZE)
+    {
+    }
+
+    /**
+     *  Decode a header block calling field(name, value) for each header
+     *
+     *  Returns false if the block is malformed, a COMPRESSION_ERROR.
+     *  The views passed to field are only valid during the call.
+     */
+    template <typename F>
+    bool decode(std::string_view block, F field)
+    {
+        size_t pos = 0;
+        std::string name, value;
+
+        while (pos < block.size())
+        {
+            uint8_t byte = block[pos];
+            uint64_t index;
+
+            if (byte & 0x80)
+            {
+                // indexed header field
+                if (!integer(block, pos, 7, index) || !lookup(index, name, value))
+                    return false;
+                field(std::string_view(name), std::string_view(value));
+            }
+            else if ((byte & 0xe0) == 0x20)
+            {
+                // dynamic table size update
+                if (!integer(block, pos, 5, index) || (index > TABLE_SIZE))
+                    return false;
+                m_max_size = index;
+                evict(0);
+            }
+            else
+            {
+                // literal, with incremental indexing, without or never indexed
+                bool indexing = (byte & 0xc0) == 0x40;
+                if (!integer(block, pos, indexing ? 6 : 4, index))
+                    return false;
+
+                if (index == 0)
+                {
+                    if (!string(block, pos, name))
+                        return false;
+                }
+                else
+                {
+                    std::string unused;
+                    if (!lookup(index, name, unused))
+                        return false;
+                }
+                if (!string(block, pos, value))
+                    return false;
+
+                field(std::string_view(name), std::string_view(value));
+                if (indexing)
+                    insert(name, value);
+            }
+        }
+        return true;
+    }
+
+    /**
+     *  Append a header as a literal without indexing
+     *
+     */
+    static void encode(std::string &out, std::string_view name, std::string_view value)
+    {
+        size_t index = 0;
+        for (size_t i = 0; i < STATIC_ENTRIES; i++)
+        {
+            if (STATIC_TABLE[i].first == name)
+            {
+                index = i + 1;
+                break;
+            }
+        }
+
+        integer(out, 0x00, 4, index);
+        if (index == 0)
+            string(out, name);
+        string(out, value);
+    }
+
+    /**
+     *  Append the :status pseudo header
+     *
+     */
+    static void encodeStatus(std::string &out, std::string_view status)
+    {
+        for (size_t i = STATUS_FIRST; i <= STATUS_LAST; i++)
+        {
+            if (STATIC_TABLE[i].second == status)
+            {
+                integer(out, 0x80, 7, i + 1);
+                return;
+            }
+        }
+        encode(out, ":status", status);
+    }
+
+private:
+    static constexpr size_t STATIC_ENTRIES = 61;
+    static constexpr size_t STATUS_FIRST = 7;   // :status 200
+    static constexpr size_t STATUS_LAST = 13;   // :status 500
+    static constexpr size_t ENTRY_OVERHEAD = 32;
+
+    static constexpr uint32_t HUFFMAN_CODES[257] = {
+        0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+        0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+        0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+        0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+        0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+        0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+        0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+        0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+        0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+        0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+        0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+        0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+        0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+        0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+        0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+        0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+        0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+        0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+        0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+        0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+        0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+        0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+        0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+        0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+        0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+        0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+        0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+        0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+        0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+        0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+        0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+        0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+        0x3fffffff,
+    };
+    static constexpr uint8_t HUFFMAN_BITS[257] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+        30,
+    };
+    static constexpr std::pair<std::string_view, std::string_view> STATIC_TABLE[61] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+    };
+
+    /**
+     *  Decode an integer with an n bit prefix starting at pos
+     *
+     */
+    static bool integer(std::string_view block, size_t &pos, unsigned int n, uint64_t &value)
+    {
+        uint64_t max = (1 << n) - 1;
+        value = uint8_t(block[pos++]) & max;
+        if (value < max)
+            return true;
+
+        for (unsigned int shift = 0; shift < 28; shift += 7)
+        {
+            if (pos >= block.size())
+                return false;
+            uint8_t byte = block[pos++];
+            value += uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    static void integer(std::string &out, uint8_t flags, unsigned int n, uint64_t value)
+    {
+        uint64_t max = (1 << n) - 1;
+        if (value < max)
+        {
+            out.push_back(char(flags | value));
+            return;
+        }
+
+        out.push_back(char(flags | max));
+        value -= max;
+        while (value >= 0x80)
+        {
+            out.push_back(char((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(char(value));
+    }
+
+    static bool string(std::string_view block, size_t &pos, std::string &value)
+    {
+        if (pos >= block.size())
+            return false;
+
+        bool huffman = block[pos] & 0x80;
+        uint64_t length;
+        if (!integer(block, pos, 7, length) || (length > block.size() - pos))
+            return false;
+
+        std::string_view encoded = block.substr(pos, length);
+        pos += length;
+
+        if (!huffman)
+        {
+            value.assign(encoded);
+            return true;
+        }
+        return decodeHuffman(encoded, value);
+    }
+
+    static void string(std::string &out, std::string_view value)
+    {
+        integer(out, 0x00, 7, value.size());
+        out.append(value);
+    }
+
+    /**
+     *  A binary tree of the Huffman codes, built on first use
+     *
+     */
+    struct Node
+    {
+        int16_t child[2] = {-1, -1};
+        int16_t symbol = -1;
+    };
+
+    static const std::vector<Node> &tree()
+    {
+        static const std::vector<Node> nodes = []()
+        {
+            std::vector<Node> nodes(1);
+            for (int16_t symbol = 0; symbol < 257; symbol++)
+            {
+                size_t node = 0;
+                for (int bit = HUFFMAN_BITS[symbol] - 1; bit >= 0; bit--)
+                {
+                    int b = (HUFFMAN_CODES[symbol] >> bit) & 1;
+                    if (nodes[node].child[b] < 0)
+                    {
+                        nodes[node].child[b] = nodes.size();
+                        nodes.emplace_back();
+                    }
+                    node = nodes[node].child[b];
+                }
+                nodes[node].symbol = symbol;
+            }
+            return nodes;
+        }();
+        return nodes;
+    }
+
+    static bool decodeHuffman(std::string_view encoded, std::string &value)
+    {
+        const std::vector<Node> &nodes = tree();
+        value.clear();
+
+        size_t node = 0;
+        unsigned int depth = 0;  // bits since the last symbol, all ones if padding
+        bool ones = true;
+        for (unsigned char byte : encoded)
+        {
+            for (int bit = 7; bit >= 0; bit--)
+            {
+                int b = (byte >> bit) & 1;
+                if (nodes[node].child[b] < 0)
+                    return false;
+                node = nodes[node].child[b];
+                depth++;
+                ones = ones && b;
+
+                if (nodes[node].symbol >= 0)
+                {
+                    // EOS in a string is an error
+                    if (nodes[node].symbol == 256)
+                        return false;
+                    value.push_back(char(nodes[node].symbol));
+                    node = 0;
+                    depth = 0;
+                    ones = true;
+                }
+            }
+        }
+
+        // padding is the most significant bits of EOS, shorter than a byte
+        return (depth < 8) && ones;
+    }
+
+    bool lookup(uint64_t index, std::string &name, std::string &value) const
+    {
+        if (index == 0)
+            return false;
+        if (index <= STATIC_ENTRIES)
+        {
+            name.assign(STATIC_TABLE[index - 1].first);
+            value.assign(STATIC_TABLE[index - 1].second);
+            return true;
+        }
+        index -= STATIC_ENTRIES + 1;
+        if (index >= m_table.size())
+            return false;
+        name = m_table[index].first;
+        value = m_table[index].second;
+        return true;
+    }
+
+    void insert(const std::string &name, const std::string &value)
+    {
+        size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+        evict(size);
+        // an entry larger than the table empties it and is not added
+        if (size <= m_max_size)
+        {
+            m_table.emplace_front(name, value);
+            m_size += size;
+        }
+    }
+
+    /**
+     *  Drop the oldest entries until room bytes fit
+     *
+     */
+    void evict(size_t room)
+    {
+        while (!m_table.empty() && (m_size + room > m_max_size))
+        {
+            m_size -= m_table.back().first.size() + m_table.back().second.size() + ENTRY_OVERHEAD;
+            m_table.pop_back();
+        }
+    }
+
+    // newest first
+    std::deque<std::pair<std::string, std::string>> m_table;
+    size_t m_size;
+    size_t m_max_size;
+};
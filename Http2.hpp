@@ -0,0 +1,1011 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <map>
+#include <algorithm>
+#include <charconv>
+#include <cctype>
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "Hpack.hpp"
+
+/**
+ *  One HTTP/2 stream, a request and its response
+ *
+ */
+struct Http2Stream
+{
+    uint32_t id = 0;
+    uint8_t urgency = 3;          // RFC 9218 priority header, lower first
+    uint16_t weight = 16;         // RFC 7540 priority, higher first
+    bool ready = false;           // the request headers are complete
+    bool end_stream = false;      // the client has sent all of the request
+    bool reset = false;
+    bool head_request = false;
+    bool headers_sent = false;
+    bool ended = false;           // END_STREAM sent
+    std::string head;             // the request as an HTTP/1.1 head for Request
+    std::string body;             // DATA received and not read yet
+    size_t body_pos = 0;
+    int64_t send_window = 0;
+    int64_t recv_window = 0;
+    uint32_t unacked = 0;         // body read but not given back in a WINDOW_UPDATE
+    int64_t remaining = -1;       // response body left to send when the length is known
+};
+
+/**
+ *  The server end of an HTTP/2 connection in a worker process
+ *
+ *  Frames from every stream are read as they arrive, requests are
+ *  handed out one at a time by next() in priority order and their
+ *  responses written with send() and sendFile() as HTTP/1.1 heads
+ *  and bodies, which are turned into HEADERS and DATA frames.
+ *  Small frames are gathered and written together when the
+ *  connection would otherwise wait for the client. Large file bodies
+ *  go out with sendfile() behind each DATA frame header.
+ */
+class Http2Connection
+{
+public:
+    static constexpr std::string_view PREFACE{"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"};
+    // what an HTTP/1.1 parser sees of the preface
+    static constexpr std::string_view PREFACE_HEAD{"PRI * HTTP/2.0\r\n\r\n"};
+
+    static constexpr uint32_t MAX_STREAMS = 100;
+    static constexpr uint32_t DEFAULT_WINDOW = 65535;
+    static constexpr uint32_t STREAM_WINDOW = 256 * 1024;
+    static constexpr uint32_t CONNECTION_WINDOW = 1024 * 1024;
+    static constexpr uint32_t MAX_FRAME = 16384;
+    static constexpr uint32_t MAX_HEADER_LIST = 64 * 1024;  // as the HTTP/1 head, encoded or decoded
+    static constexpr size_t FLUSH_BYTES = 64 * 1024;
+    static constexpr size_t COPY_BYTES = 16 * 1024;
+
+    enum FRAME : uint8_t
+    {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    enum FLAG : uint8_t
+    {
+        END_STREAM = 0x1,
+        ACK = 0x1,
+        END_HEADERS = 0x4,
+        PADDED = 0x8,
+        PRIORITY_FLAG = 0x20
+    };
+
+    enum ERROR : uint32_t
+    {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        COMPRESSION_ERROR = 0x9,
+        ENHANCE_YOUR_CALM = 0xb
+    };
+
+    Http2Connection(int input, int output, const volatile sig_atomic_t &timed_out) : m_input(input), m_output(output), m_timed_out(timed_out), m_in(), m_in_pos(0), m_out(), m_hpack(),
+                                                                                      m_streams(), m_current(0), m_last_id(0), m_continuation(0), m_block(), m_send_window(DEFAULT_WINDOW),
+                                                                                      m_peer_window(DEFAULT_WINDOW), m_peer_max_frame(MAX_FRAME), m_recv_unacked(0), m_goaway(false), m_closed(false)
+    {
+    }
+
+    Http2Connection(const Http2Connection &) = delete;
+    Http2Connection &operator=(const Http2Connection &) = delete;
+
+    /**
+     *  Take the client preface and send our SETTINGS
+     *
+     *  pending holds what has been read of the connection so far.
+     */
+    bool start(std::string &pending)
+    {
+        m_in.swap(pending);
+        pending.clear();
+
+        while (m_in.size() < PREFACE.size())
+        {
+            if (!fill(true))
+                return false;
+        }
+        if (std::string_view(m_in).substr(0, PREFACE.size()) != PREFACE)
+            return false;
+        m_in_pos = PREFACE.size();
+
+        char settings[18];
+        setting(settings, 0x3, MAX_STREAMS);
+        setting(settings + 6, 0x4, STREAM_WINDOW);
+        setting(settings + 12, 0x6, MAX_HEADER_LIST);
+        frame(SETTINGS, 0, 0, std::string_view(settings, sizeof(settings)));
+        windowUpdate(0, CONNECTION_WINDOW - DEFAULT_WINDOW);
+        return flush();
+    }
+
+    /**
+     *  Wait for the next request to serve
+     *
+     *  The ready stream with the highest priority, nullptr when
+     *  the connection is closed, fails or times out.
+     */
+    Http2Stream *next()
+    {
+        // everything the client has already sent, so the choice sees all of it
+        while (!m_closed && fill(false))
+            ;
+        if (!process())
+            return nullptr;
+
+        while (true)
+        {
+            Http2Stream *best = nullptr;
+            for (auto &entry : m_streams)
+            {
+                Http2Stream &stream = entry.second;
+                if (!stream.ready || stream.reset)
+                    continue;
+                if ((best == nullptr) || (stream.urgency < best->urgency) || ((stream.urgency == best->urgency) && (stream.weight > best->weight)))
+                    best = &stream;
+            }
+
+            if (best != nullptr)
+            {
+                m_current = best->id;
+                return best;
+            }
+
+            if (m_closed || m_goaway || !pump())
+                return nullptr;
+        }
+    }
+
+    /**
+     *  Send part of the current response
+     *
+     *  The first call carries the HTTP/1.1 status line and headers,
+     *  informational responses are dropped.
+     */
+    ssize_t send(std::string_view data)
+    {
+        Http2Stream *stream = current();
+        if ((stream == nullptr) || stream->reset)
+            return -1;
+
+        size_t size = data.size();
+        while (!stream->headers_sent && !data.empty())
+        {
+            size_t end = headEnd(data);
+            std::string_view head = data.substr(0, end);
+            data.remove_prefix(end);
+            if ((head.size() > 9) && (head[9] == '1'))
+                continue;
+            if (!sendHeaders(*stream, head))
+                return -1;
+        }
+
+        if (!sendData(*stream, data))
+            return -1;
+        return size;
+    }
+
+    /**
+     *  Send count bytes of a file from offset as the current response body
+     *
+     *  Small bodies are copied into the pending frames, larger
+     *  ones follow each DATA frame header with sendfile().
+     */
+    ssize_t sendFile(int fd, off_t *offset, size_t count)
+    {
+        Http2Stream *stream = current();
+        if ((stream == nullptr) || stream->reset || !stream->headers_sent)
+            return -1;
+
+        size_t sent = 0;
+        while ((sent < count) && !stream->ended)
+        {
+            if (!waitWindow(*stream))
+                return sent;
+
+            size_t n = std::min({count - sent, size_t(m_peer_max_frame), size_t(std::min(m_send_window, stream->send_window))});
+            uint8_t flags = endsBody(*stream, n) ? END_STREAM : 0;
+            frameHeader(n, DATA, flags, stream->id);
+
+            if (count <= COPY_BYTES)
+            {
+                size_t at = m_out.size();
+                m_out.resize(at + n);
+                if (pread(fd, &m_out[at], n, *offset) != ssize_t(n))
+                    return broken();
+                *offset += n;
+            }
+            else
+            {
+                if (!flush(MSG_MORE))
+                    return -1;
+
+                // the frame header promised n bytes, all of them must follow
+                size_t done = 0;
+                while (done < n)
+                {
+                    ssize_t nsent = sendfile(m_output, fd, offset, n - done);
+                    if (nsent <= 0)
+                    {
+                        if ((nsent < 0) && (errno == EINTR) && !m_timed_out)
+                            continue;
+                        return broken();
+                    }
+                    done += nsent;
+                }
+            }
+
+            sent += n;
+            consumed(*stream, n, flags);
+        }
+
+        if ((m_out.size() >= FLUSH_BYTES) && !flush())
+            return -1;
+        return sent;
+    }
+
+    /**
+     *  Read up to len bytes of the current request body, 0 at its end
+     *
+     */
+    ssize_t recv(char *buffer, size_t len)
+    {
+        Http2Stream *stream = current();
+        if (stream == nullptr)
+            return -1;
+
+        while ((stream->body_pos == stream->body.size()) && !stream->end_stream && !stream->reset)
+        {
+            if (!pump())
+                return -1;
+        }
+        if (stream->reset)
+            return -1;
+
+        size_t n = std::min(len, stream->body.size() - stream->body_pos);
+        memcpy(buffer, stream->body.data() + stream->body_pos, n);
+        stream->body_pos += n;
+        if (stream->body_pos == stream->body.size())
+        {
+            stream->body.clear();
+            stream->body_pos = 0;
+        }
+
+        // give the window back as the body is read, so a slow handler slows the client
+        stream->unacked += n;
+        if ((stream->unacked >= STREAM_WINDOW / 2) && !stream->end_stream)
+        {
+            windowUpdate(stream->id, stream->unacked);
+            stream->recv_window += stream->unacked;
+            stream->unacked = 0;
+        }
+        return n;
+    }
+
+    /**
+     *  End the current response and forget the stream
+     *
+     */
+    void finish()
+    {
+        Http2Stream *stream = current();
+        if (stream == nullptr)
+            return;
+
+        if (!stream->reset && !m_closed)
+        {
+            if (!stream->headers_sent)
+                sendHeaders(*stream, "HTTP/1.1 500 Internal Server Error\n");
+            if (!stream->ended)
+            {
+                frame(DATA, END_STREAM, stream->id, std::string_view());
+                stream->ended = true;
+            }
+            // the rest of the request is not wanted
+            if (!stream->end_stream)
+                rstStream(stream->id, NO_ERROR);
+        }
+
+        m_streams.erase(stream->id);
+        m_current = 0;
+
+        if (m_out.size() >= FLUSH_BYTES)
+            flush();
+    }
+
+    /**
+     *  Reset the current stream, so a response cut short is not taken
+     *  as complete
+     *
+     */
+    void abort()
+    {
+        Http2Stream *stream = current();
+        if ((stream == nullptr) || stream->reset || m_closed)
+            return;
+
+        rstStream(stream->id, INTERNAL_ERROR);
+        stream->reset = true;
+        flush();
+    }
+
+    /**
+     *  Send GOAWAY and whatever is still pending
+     *
+     */
+    void close()
+    {
+        if (m_closed)
+            return;
+        goAway(NO_ERROR);
+        flush();
+        m_closed = true;
+    }
+
+    inline bool idle() const { return m_streams.empty(); }
+
+private:
+    inline Http2Stream *current()
+    {
+        auto stream = m_streams.find(m_current);
+        return (stream == m_streams.end()) ? nullptr : &stream->second;
+    }
+
+    static inline void put32(char *out, uint32_t value)
+    {
+        out[0] = char(value >> 24);
+        out[1] = char(value >> 16);
+        out[2] = char(value >> 8);
+        out[3] = char(value);
+    }
+
+    static inline uint32_t get32(const char *in)
+    {
+        return (uint32_t(uint8_t(in[0])) << 24) | (uint32_t(uint8_t(in[1])) << 16) | (uint32_t(uint8_t(in[2])) << 8) | uint32_t(uint8_t(in[3]));
+    }
+
+    static inline void setting(char *out, uint16_t id, uint32_t value)
+    {
+        out[0] = char(id >> 8);
+        out[1] = char(id);
+        put32(out + 2, value);
+    }
+
+    void frameHeader(size_t length, uint8_t type, uint8_t flags, uint32_t stream)
+    {
+        char header[9];
+        header[0] = char(length >> 16);
+        header[1] = char(length >> 8);
+        header[2] = char(length);
+        header[3] = char(type);
+        header[4] = char(flags);
+        put32(header + 5, stream & 0x7fffffff);
+        m_out.append(header, sizeof(header));
+    }
+
+    inline void frame(uint8_t type, uint8_t flags, uint32_t stream, std::string_view payload)
+    {
+        frameHeader(payload.size(), type, flags, stream);
+        m_out.append(payload);
+    }
+
+    void windowUpdate(uint32_t stream, uint32_t increment)
+    {
+        char payload[4];
+        put32(payload, increment);
+        frame(WINDOW_UPDATE, 0, stream, std::string_view(payload, sizeof(payload)));
+    }
+
+    void rstStream(uint32_t stream, uint32_t error)
+    {
+        char payload[4];
+        put32(payload, error);
+        frame(RST_STREAM, 0, stream, std::string_view(payload, sizeof(payload)));
+    }
+
+    void goAway(uint32_t error)
+    {
+        char payload[8];
+        put32(payload, m_last_id);
+        put32(payload + 4, error);
+        frame(GOAWAY, 0, 0, std::string_view(payload, sizeof(payload)));
+    }
+
+    /**
+     *  A connection error, nothing more is read or served
+     *
+     */
+    bool fail(uint32_t error)
+    {
+        if (!m_closed)
+        {
+            goAway(error);
+            flush();
+            m_closed = true;
+        }
+        return false;
+    }
+
+    /**
+     *  The framing can no longer be trusted, drop the connection
+     *
+     */
+    ssize_t broken()
+    {
+        m_closed = true;
+        m_out.clear();
+        return -1;
+    }
+
+    /**
+     *  Write the pending frames
+     *
+     */
+    bool flush(int flags = 0)
+    {
+        size_t sent = 0;
+        while (sent < m_out.size())
+        {
+            ssize_t nsent = ::send(m_output, m_out.data() + sent, m_out.size() - sent, flags | MSG_NOSIGNAL);
+            if (nsent <= 0)
+            {
+                if ((nsent < 0) && (errno == EINTR) && !m_timed_out)
+                    continue;
+                m_closed = true;
+                m_out.clear();
+                return false;
+            }
+            sent += nsent;
+        }
+        m_out.clear();
+        return true;
+    }
+
+    /**
+     *  Read what the client has sent, waiting for it when block is set
+     *
+     *  Returns false when nothing was read.
+     */
+    bool fill(bool block)
+    {
+        if (m_in_pos > 0)
+        {
+            m_in.erase(0, m_in_pos);
+            m_in_pos = 0;
+        }
+
+        char buffer[16384];
+        ssize_t nread;
+        do
+            nread = ::recv(m_input, buffer, sizeof(buffer), block ? 0 : MSG_DONTWAIT);
+        while ((nread < 0) && (errno == EINTR) && !m_timed_out && block);
+
+        if (nread <= 0)
+        {
+            // a timed out wait leaves the connection open for close() to say GOAWAY
+            if ((nread == 0) || (block && (errno != EINTR)))
+                m_closed = true;
+            return false;
+        }
+        m_in.append(buffer, nread);
+        return true;
+    }
+
+    /**
+     *  Send what is pending then wait for and handle more frames
+     *
+     */
+    bool pump()
+    {
+        if (!flush())
+            return false;
+        if (!fill(true))
+            return false;
+        return process();
+    }
+
+    /**
+     *  Handle every complete frame read so far
+     *
+     */
+    bool process()
+    {
+        while (m_in.size() - m_in_pos >= 9)
+        {
+            const char *header = m_in.data() + m_in_pos;
+            uint32_t length = (uint32_t(uint8_t(header[0])) << 16) | (uint32_t(uint8_t(header[1])) << 8) | uint8_t(header[2]);
+            if (length > MAX_FRAME)
+                return fail(FRAME_SIZE_ERROR);
+            if (m_in.size() - m_in_pos < 9 + length)
+                break;
+
+            uint8_t type = header[3];
+            uint8_t flags = header[4];
+            uint32_t stream = get32(header + 5) & 0x7fffffff;
+            std::string_view payload(header + 9, length);
+            m_in_pos += 9 + length;
+
+            if ((m_continuation != 0) && ((type != CONTINUATION) || (stream != m_continuation)))
+                return fail(PROTOCOL_ERROR);
+
+            if (!handle(type, flags, stream, payload))
+                return false;
+        }
+        return !m_closed;
+    }
+
+    /**
+     *  Remove padding, false if it is longer than the payload
+     *
+     */
+    static bool unpad(uint8_t flags, std::string_view &payload)
+    {
+        if (!(flags & PADDED))
+            return true;
+        if (payload.empty() || (uint8_t(payload[0]) >= payload.size()))
+            return false;
+        size_t padding = uint8_t(payload[0]);
+        payload = payload.substr(1, payload.size() - 1 - padding);
+        return true;
+    }
+
+    bool handle(uint8_t type, uint8_t flags, uint32_t id, std::string_view payload)
+    {
+        switch (type)
+        {
+        case DATA:
+        {
+            if (id == 0)
+                return fail(PROTOCOL_ERROR);
+
+            // the connection window is given back as data arrives, the stream windows bound what is held
+            m_recv_unacked += payload.size();
+            if (m_recv_unacked >= CONNECTION_WINDOW / 2)
+            {
+                windowUpdate(0, m_recv_unacked);
+                m_recv_unacked = 0;
+            }
+
+            auto found = m_streams.find(id);
+            if (found == m_streams.end())
+                return true;
+            Http2Stream &stream = found->second;
+            if (!unpad(flags, payload))
+                return fail(PROTOCOL_ERROR);
+
+            if (int64_t(payload.size()) > stream.recv_window)
+            {
+                rstStream(id, FLOW_CONTROL_ERROR);
+                stream.reset = true;
+                return true;
+            }
+            stream.recv_window -= payload.size();
+            stream.body.append(payload);
+            if (flags & END_STREAM)
+                stream.end_stream = true;
+            return true;
+        }
+
+        case HEADERS:
+        {
+            if ((id == 0) || !unpad(flags, payload))
+                return fail(PROTOCOL_ERROR);
+
+            uint16_t weight = 16;
+            if (flags & PRIORITY_FLAG)
+            {
+                if (payload.size() < 5)
+                    return fail(PROTOCOL_ERROR);
+                weight = uint8_t(payload[4]) + 1;
+                payload.remove_prefix(5);
+            }
+
+            auto found = m_streams.find(id);
+            if (found == m_streams.end())
+            {
+                if (((id & 1) == 0) || (id <= m_last_id))
+                    return fail(PROTOCOL_ERROR);
+                m_last_id = id;
+
+                Http2Stream stream;
+                stream.id = id;
+                stream.weight = weight;
+                stream.send_window = m_peer_window;
+                stream.recv_window = STREAM_WINDOW;
+                m_streams.emplace(id, std::move(stream));
+            }
+            else if (flags & END_STREAM)
+            {
+                // trailers end the request body, their fields are not used
+                found->second.end_stream = true;
+            }
+            else
+                return fail(PROTOCOL_ERROR);
+
+            if (flags & END_STREAM)
+                m_streams[id].end_stream = true;
+
+            if (payload.size() > MAX_HEADER_LIST)
+                return fail(ENHANCE_YOUR_CALM);
+            m_block.assign(payload);
+            if (!(flags & END_HEADERS))
+            {
+                m_continuation = id;
+                return true;
+            }
+            return headers(id);
+        }
+
+        case CONTINUATION:
+        {
+            if (id != m_continuation)
+                return fail(PROTOCOL_ERROR);
+            if (m_block.size() + payload.size() > MAX_HEADER_LIST)
+                return fail(ENHANCE_YOUR_CALM);
+            m_block.append(payload);
+            if (!(flags & END_HEADERS))
+                return true;
+            m_continuation = 0;
+            return headers(id);
+        }
+
+        case PRIORITY:
+        {
+            if (payload.size() != 5)
+                return fail(FRAME_SIZE_ERROR);
+            auto found = m_streams.find(id);
+            if (found != m_streams.end())
+                found->second.weight = uint8_t(payload[4]) + 1;
+            return true;
+        }
+
+        case RST_STREAM:
+        {
+            if (payload.size() != 4)
+                return fail(FRAME_SIZE_ERROR);
+            auto found = m_streams.find(id);
+            if (found == m_streams.end())
+                return true;
+            if (id == m_current)
+                found->second.reset = true;
+            else
+                m_streams.erase(found);
+            return true;
+        }
+
+        case SETTINGS:
+        {
+            if (id != 0)
+                return fail(PROTOCOL_ERROR);
+            if (flags & ACK)
+                return true;
+            if (payload.size() % 6 != 0)
+                return fail(FRAME_SIZE_ERROR);
+
+            for (size_t i = 0; i < payload.size(); i += 6)
+            {
+                uint16_t setting = (uint16_t(uint8_t(payload[i])) << 8) | uint8_t(payload[i + 1]);
+                uint32_t value = get32(payload.data() + i + 2);
+                if (setting == 0x4)
+                {
+                    if (value > 0x7fffffff)
+                        return fail(FLOW_CONTROL_ERROR);
+                    // applies to the open streams too
+                    int64_t delta = int64_t(value) - m_peer_window;
+                    for (auto &entry : m_streams)
+                        entry.second.send_window += delta;
+                    m_peer_window = value;
+                }
+                else if (setting == 0x5)
+                {
+                    if ((value < MAX_FRAME) || (value > 0xffffff))
+                        return fail(PROTOCOL_ERROR);
+                    m_peer_max_frame = value;
+                }
+            }
+            frame(SETTINGS, ACK, 0, std::string_view());
+            return true;
+        }
+
+        case PING:
+        {
+            if (payload.size() != 8)
+                return fail(FRAME_SIZE_ERROR);
+            if (!(flags & ACK))
+                frame(PING, ACK, 0, payload);
+            return true;
+        }
+
+        case GOAWAY:
+        {
+            m_goaway = true;
+            return true;
+        }
+
+        case WINDOW_UPDATE:
+        {
+            if (payload.size() != 4)
+                return fail(FRAME_SIZE_ERROR);
+            uint32_t increment = get32(payload.data()) & 0x7fffffff;
+            if (id == 0)
+            {
+                if (increment == 0)
+                    return fail(PROTOCOL_ERROR);
+                m_send_window += increment;
+                if (m_send_window > 0x7fffffff)
+                    return fail(FLOW_CONTROL_ERROR);
+                return true;
+            }
+
+            auto found = m_streams.find(id);
+            if (found != m_streams.end())
+            {
+                found->second.send_window += increment;
+                if ((increment == 0) || (found->second.send_window > 0x7fffffff))
+                {
+                    rstStream(id, (increment == 0) ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+                    found->second.reset = true;
+                }
+            }
+            return true;
+        }
+
+        case PUSH_PROMISE:
+            return fail(PROTOCOL_ERROR);
+
+        default:
+            // unknown frame types are ignored
+            return true;
+        }
+    }
+
+    /**
+     *  Decode a complete header block into the stream's request head
+     *
+     */
+    bool headers(uint32_t id)
+    {
+        std::string method, path, authority, fields;
+        uint8_t urgency = 3;
+        bool valid = true;
+        size_t list_size = 0;  // counted as for SETTINGS_MAX_HEADER_LIST_SIZE
+
+        bool decoded = m_hpack.decode(m_block, [&](std::string_view name, std::string_view value)
+                                      {
+                                          // a small index can stand for a large table entry
+                                          list_size += name.size() + value.size() + 32;
+                                          if (list_size > MAX_HEADER_LIST)
+                                              return;
+
+                                          // would end a line of the HTTP/1.1 head
+                                          if ((name.find_first_of("\r\n:", 1) != std::string_view::npos) || (value.find_first_of("\r\n", 0) != std::string_view::npos) || name.empty())
+                                          {
+                                              valid = false;
+                                              return;
+                                          }
+
+                                          if (name[0] == ':')
+                                          {
+                                              if (name == ":method")
+                                                  method = value;
+                                              else if (name == ":path")
+                                                  path = value;
+                                              else if (name == ":authority")
+                                                  authority = value;
+                                              else if (name != ":scheme")
+                                                  valid = false;
+                                              return;
+                                          }
+
+                                          if ((name == "priority") && (value.find("u=") != std::string_view::npos))
+                                          {
+                                              size_t u = value.find("u=") + 2;
+                                              if ((u < value.size()) && (value[u] >= '0') && (value[u] <= '7'))
+                                                  urgency = value[u] - '0';
+                                          }
+
+                                          fields.append(name).append(": ").append(value).append("\r\n");
+                                      });
+        m_block.clear();
+
+        // the table is shared by every stream, a bad block ends the connection
+        if (!decoded)
+            return fail(COMPRESSION_ERROR);
+        if (list_size > MAX_HEADER_LIST)
+            return fail(ENHANCE_YOUR_CALM);
+
+        Http2Stream &stream = m_streams[id];
+        if (stream.ready)
+            return true;
+
+        if (!valid || method.empty() || path.empty() || (path.find(' ') != std::string::npos))
+        {
+            rstStream(id, PROTOCOL_ERROR);
+            m_streams.erase(id);
+            return true;
+        }
+
+        if (m_streams.size() > MAX_STREAMS)
+        {
+            rstStream(id, REFUSED_STREAM);
+            m_streams.erase(id);
+            return true;
+        }
+
+        stream.head.reserve(method.size() + path.size() + authority.size() + fields.size() + 24);
+        stream.head.append(method).append(" ").append(path).append(" HTTP/2\r\n");
+        if (!authority.empty())
+            stream.head.append("host: ").append(authority).append("\r\n");
+        stream.head.append(fields).append("\r\n");
+        stream.head_request = (method == "HEAD");
+        stream.urgency = urgency;
+        stream.ready = true;
+        return true;
+    }
+
+    /**
+     *  Offset just past the blank line ending an HTTP/1.1 head
+     *
+     */
+    static size_t headEnd(std::string_view data)
+    {
+        size_t crlf = data.find("\n\r\n");
+        size_t lf = data.find("\n\n");
+        if ((crlf != std::string_view::npos) && ((lf == std::string_view::npos) || (crlf < lf)))
+            return crlf + 3;
+        if (lf != std::string_view::npos)
+            return lf + 2;
+        return data.size();
+    }
+
+    /**
+     *  Turn an HTTP/1.1 status line and headers into a HEADERS frame
+     *
+     */
+    bool sendHeaders(Http2Stream &stream, std::string_view head)
+    {
+        std::string block;
+        size_t eol = head.find('\n');
+        std::string_view status = (head.size() >= 12) ? head.substr(9, 3) : std::string_view("500");
+        Hpack::encodeStatus(block, status);
+
+        while (eol != std::string_view::npos)
+        {
+            size_t start = eol + 1;
+            eol = head.find('\n', start);
+            std::string_view line = head.substr(start, (eol == std::string_view::npos) ? eol : eol - start);
+            if (!line.empty() && (line.back() == '\r'))
+                line.remove_suffix(1);
+
+            size_t colon = line.find(':');
+            if (line.empty() || (colon == std::string_view::npos))
+                continue;
+
+            std::string name(line.substr(0, colon));
+            for (char &c : name)
+                c = std::tolower((unsigned char)c);
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && (value.front() == ' '))
+                value.remove_prefix(1);
+
+            // connection specific headers are not allowed in HTTP/2
+            if ((name == "connection") || (name == "keep-alive") || (name == "transfer-encoding") || (name == "upgrade") || (name == "proxy-connection"))
+                continue;
+
+            if (name == "content-length")
+                std::from_chars(value.data(), value.data() + value.size(), stream.remaining);
+
+            Hpack::encode(block, name, value);
+        }
+
+        bool end = stream.head_request || (status == "204") || (status == "304") || (stream.remaining == 0);
+
+        // CONTINUATION frames for a block larger than a frame
+        std::string_view rest(block);
+        uint8_t type = HEADERS;
+        do
+        {
+            std::string_view part = rest.substr(0, m_peer_max_frame);
+            rest.remove_prefix(part.size());
+            uint8_t flags = (rest.empty() ? END_HEADERS : 0) | ((type == HEADERS) && end ? END_STREAM : 0);
+            frame(type, flags, stream.id, part);
+            type = CONTINUATION;
+        } while (!rest.empty());
+
+        stream.headers_sent = true;
+        stream.ended = end;
+        return true;
+    }
+
+    inline bool endsBody(const Http2Stream &stream, size_t n) const
+    {
+        return (stream.remaining >= 0) && (int64_t(n) == stream.remaining);
+    }
+
+    inline void consumed(Http2Stream &stream, size_t n, uint8_t flags)
+    {
+        m_send_window -= n;
+        stream.send_window -= n;
+        if (stream.remaining > 0)
+            stream.remaining -= n;
+        if (flags & END_STREAM)
+            stream.ended = true;
+    }
+
+    /**
+     *  Wait for the client to open the flow control windows
+     *
+     */
+    bool waitWindow(Http2Stream &stream)
+    {
+        while ((m_send_window <= 0) || (stream.send_window <= 0))
+        {
+            if (!pump() || stream.reset)
+                return false;
+        }
+        return !stream.reset;
+    }
+
+    bool sendData(Http2Stream &stream, std::string_view data)
+    {
+        while (!data.empty() && !stream.ended)
+        {
+            if (!waitWindow(stream))
+                return false;
+
+            size_t n = std::min({data.size(), size_t(m_peer_max_frame), size_t(std::min(m_send_window, stream.send_window))});
+            uint8_t flags = endsBody(stream, n) ? END_STREAM : 0;
+            frame(DATA, flags, stream.id, data.substr(0, n));
+            data.remove_prefix(n);
+            consumed(stream, n, flags);
+        }
+
+        if (m_out.size() >= FLUSH_BYTES)
+            return flush();
+        return true;
+    }
+
+    int m_input;
+    int m_output;
+    const volatile sig_atomic_t &m_timed_out;
+
+    std::string m_in;
+    size_t m_in_pos;
+    std::string m_out;
+    Hpack m_hpack;
+
+    std::map<uint32_t, Http2Stream> m_streams;
+    uint32_t m_current;
+    uint32_t m_last_id;
+    uint32_t m_continuation;
+    std::string m_block;
+
+    int64_t m_send_window;
+    int64_t m_peer_window;
+    uint32_t m_peer_max_frame;
+    uint32_t m_recv_unacked;
+    bool m_goaway;
+    bool m_closed;
+};
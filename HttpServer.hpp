@@ -4,26 +4,62 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <errno.h>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <sstream>
 #include <map>
+#include <unordered_map>
 #include <list>
 #include <filesystem>
 #include <fstream>
 #include <algorithm>
 #include <stdexcept>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <charconv>
+#include <cstring>
+#include <cctype>
 
 #include <boost/log/trivial.hpp>
-#include <boost/url.hpp>
 #include <boost/algorithm/string.hpp>
 
-typedef std::map<std::string, std::string> Headers;
-typedef std::map<std::string, std::string> QueryParams;
-typedef std::map<std::string, std::string> MimeTypes;
+#include "Metrics.hpp"
+#include "AccessLog.hpp"
+#include "RequestTrace.hpp"
+#include "TimerWheel.hpp"
+#include "WorkerTable.hpp"
+#include "Admission.hpp"
+#include "Arena.hpp"
+#include "RequestHeaders.hpp"
+#include "Tls.hpp"
+#include "Http2.hpp"
+#include "Compression.hpp"
+#include "FileSend.hpp"
+#include "ZeroCopy.hpp"
+#include "Listener.hpp"
+
+// debug logging is compiled out of release builds
+#ifdef NDEBUG
+#define LOG_DEBUG while (false) BOOST_LOG_TRIVIAL(debug)
+#else
+#define LOG_DEBUG BOOST_LOG_TRIVIAL(debug)
+#endif
+
+// request and response strings and maps are allocated from the connection arena
+typedef std::pmr::map<std::pmr::string, std::pmr::string, std::less<>> Headers;
+typedef RequestHeaders::HEADER HEADER;
+typedef std::pmr::map<std::pmr::string, std::pmr::string, std::less<>> QueryParams;
+typedef std::pmr::vector<std::pmr::string> Segments;
 
 /**
  *  The client Response
@@ -34,19 +70,19 @@ class Response
 {
 
 public:
-    Response() : m_headers(), m_mime()
+    Response() : m_headers()
     {
+        char date[32];
         const std::time_t result = std::time(nullptr);
-        std::string str{std::ctime(&result)};
-        str.pop_back();
+        ctime_r(&result, date);
+        date[strcspn(date, "\n")] = '\0';
 
         // Some Default Headers
-        m_headers.emplace("Date", str);
+        m_headers.emplace("Date", date);
         m_headers.emplace("Accept-Ranges",  "bytes");
         m_headers.emplace("Server", "C++ Test Server");
-        m_headers.emplace("Connection", "keep-alive");
-
-        mime_types();
+        m_headers.emplace("Connection", s_keep_alive ? "keep-alive" : "close");
+        m_headers.emplace("Content-Length", "0");
     }
 
     static constexpr std::string_view OK = "HTTP/1.1 200 OK";
@@ -62,14 +98,23 @@ public:
     static constexpr std::string_view NOT_ALLOWED = "HTTP/1.1 405 Method Not Allowed";
     static constexpr std::string_view EXISTS = "HTTP/1.1 409 Conflict";
     static constexpr std::string_view SERVER_ERROR = "HTTP/1.1 500 Internal Server Error";
+    static constexpr std::string_view SLOW_DOWN = "HTTP/1.1 503 Slow Down";
+
+    // each connection has its own process, so this is per connection
+    static inline bool s_keep_alive = true;
+
+    // phases of the request being served, set by enableServerTiming()
+    static inline const RequestTrace *s_trace = nullptr;
 
     inline void setContentLength(ssize_t length)
     {
-        m_headers["Content-Length"] = std::to_string(length);
+        char buf[24];
+        auto end = std::to_chars(buf, buf + sizeof(buf), length).ptr;
+        addHeader("Content-Length", std::string_view(buf, end - buf));
     }
-    inline void setContentType(std::string extension)
+    inline void setContentType(std::string_view extension)
     {
-        m_headers["Content-Type"] = m_mime[extension];
+        addHeader("Content-Type", mime_extension(extension));
     }
 
     inline Headers& headers() {
@@ -80,139 +125,171 @@ public:
      *  Add HTTP Response headers which need file information
      *
      */
-    inline void addFileHeaders(const struct stat *details, const std::filesystem::path &path)
+    inline void addFileHeaders(const struct stat *details, std::string_view path)
     {
+        char buf[64];
+        ctime_r(&(details->st_mtim).tv_sec, buf);
+        buf[strcspn(buf, "\n")] = '\0';
+        addHeader("Last-Modified", buf);
 
-        std::string last_mod{std::ctime(&(details->st_mtim).tv_sec)};
-        last_mod.pop_back();
-        m_headers["Last-Modified"] = last_mod;
-
-        std::ostringstream oss;
-        oss << details->st_ino << "-" << details->st_size << "-" << details->st_mtim.tv_sec;
-        m_headers["Etag"] = oss.str();
+        snprintf(buf, sizeof(buf), "%lu-%ld-%ld", (unsigned long)details->st_ino, (long)details->st_size, (long)details->st_mtim.tv_sec);
+        addHeader("Etag", buf);
 
-        m_headers["Content-Length"] = std::to_string(details->st_size);
-        m_headers["Content-Type"] = mime_type(path.filename());
+        setContentLength(details->st_size);
+        addHeader("Content-Type", mime_type(path));
     }
 
     /**
      *  Return the response headers as a single string
      *
      */
-    std::string headers_str()
+    std::pmr::string headers_str() const
     {
-        std::ostringstream ss;
-        for (auto const &header : m_headers)
-            ss << header.first << ": " << header.second << "\n";
+        std::pmr::string response;
+        appendHeaders(response);
+        return response;
+    }
 
-        ss << "\n";
-        std::string response(ss.str());
+    /**
+     *  Return the status line and headers as a single string
+     *
+     */
+    std::pmr::string str(std::string_view status) const
+    {
+        std::pmr::string response;
+        response.reserve(status.size() + 1 + headersSize());
+        response.append(status).append("\n");
+        appendHeaders(response);
         return response;
     }
 
-    inline void addHeader(std::string key, std::string value)
+    inline void addHeader(std::string_view key, std::string_view value)
     {
-        m_headers[key] = value;
+        auto header = m_headers.find(key);
+        if (header == m_headers.end())
+            m_headers.emplace(key, value);
+        else
+            header->second.assign(value);
     }
 
     /**
      *  Get a Request Header
      *
      */
-    inline std::string getHeader(const char *key)
+    inline const std::pmr::string &getHeader(std::string_view key) const
     {
-        if (m_headers.find(key) == m_headers.end())
-            return "";
-        else
-            return m_headers[key];
+        auto header = m_headers.find(key);
+        return (header == m_headers.end()) ? empty() : header->second;
     }
 
    /**
      *  return the mime type based on the filename
      *
      */
-    inline std::string mime_type(const std::filesystem::path &filename)
+    static std::string_view mime_type(std::string_view filename)
     {
-        std::string extension = filename.extension();
-        if (m_mime.find(extension) == m_mime.end())
+        // the extension of the last path component, a leading dot is not one
+        std::string_view name = filename.substr(filename.find_last_of('/') + 1);
+        size_t dot = name.find_last_of('.');
+        if ((dot == std::string_view::npos) || (dot == 0))
             return "application/octet-stream";
-        else
-            return m_mime[filename.extension()];
+
+        return mime_extension(name.substr(dot));
     }
 
+    static std::string_view mime_extension(std::string_view extension)
+    {
+        static constexpr std::pair<std::string_view, std::string_view> mime[] = {
+            {".html", "text/html"},
+            {".htm", "text/html"},
+            {".ico", "image/x-icon"},
+            {".png", "image/png"},
+            {".aac", "audio/aac"},
+            {".apng", "image/apng"},
+            {".avi", "video/x-msvideo"},
+            {".bin", "application/octet-stream"},
+            {".css", "text/css"},
+            {".jpeg", "image/jpeg"},
+            {".jpg", "image/jpeg"},
+            {".js", "text/javascript"},
+            {".json", "application/json"},
+            {".mjs", "text/javascript"},
+            {".mp3", "audio/mpeg"},
+            {".mp4", "video/mp4"},
+            {".mpeg", "video/mpeg"},
+            {".svg", "image/svg+xml"},
+            {".tif", "image/tiff"},
+            {".tiff", "image/tiff"},
+            {".ttf", "font/ttf"},
+            {".txt", "text/plain"},
+            {".wav", "audio/wav"},
+            {".weba", "audio/webm"},
+            {".webm", "video/webm"},
+            {".xhtml", "application/xhtml+xml"},
+            {".webp", "image/webp"},
+            {".xml", "application/xml"}};
+
+        for (auto &m : mime)
+        {
+            if (m.first == extension)
+                return m.second;
+        }
+        return "application/octet-stream";
+    }
+
+    static const std::pmr::string &empty()
+    {
+        static const std::pmr::string s_empty{std::pmr::new_delete_resource()};
+        return s_empty;
+    }
 
 private:
- 
-    /**
-     *  define some simple mime types
-     *  based on file extensions
-     *
-     */
-    void mime_types()
-    {
-        m_mime.emplace(".html", "text/html");
-        m_mime.emplace(".htm", "text/html");
-        m_mime.emplace(".ico", "image/x-icon");
-        m_mime.emplace(".png", "image/png");
-        m_mime.emplace(".aac", "audio/aac");
-        m_mime.emplace(".apng", "image/apng");
-        m_mime.emplace(".avi", "video/x-msvideo");
-        m_mime.emplace(".bin", "application/octet-stream");
-        m_mime.emplace(".css", "text/css");
-        m_mime.emplace(".jpeg", "image/jpeg");
-        m_mime.emplace(".jpg", "image/jpeg");
-        m_mime.emplace(".js", "text/javascript");
-        m_mime.emplace(".json", "application/json");
-        m_mime.emplace(".mjs", "text/javascript");
-        m_mime.emplace(".mp3", "audio/mpeg");
-        m_mime.emplace(".mp4", "video/mp4");
-        m_mime.emplace(".mpeg", "video/mpeg");
-        m_mime.emplace(".svg", "image/sresponse.addHeadervg+xml");
-        m_mime.emplace(".tif", "image/tiff");
-        m_mime.emplace(".tiff", "image/tiff");
-        m_mime.emplace(".ttf", "font/ttf");
-        m_mime.emplace(".txt", "text/plain");
-        m_mime.emplace(".wav", "audio/wav");
-        m_mime.emplace(".weba", "audio/webm");
-        m_mime.emplace(".webm", "video/webm");
-        m_mime.emplace(".xhtml", "application/xhtml+xml");
-        m_mime.emplace(".webp", "image/webp");
-        m_mime.emplace(".xml", "application/xml");
+    size_t headersSize() const
+    {
+        size_t size = 1;
+        for (auto const &header : m_headers)
+            size += header.first.size() + header.second.size() + 3;
+        return size;
+    }
+
+    void appendHeaders(std::pmr::string &response) const
+    {
+        for (auto const &header : m_headers)
+            response.append(header.first).append(": ").append(header.second).append("\n");
+        if (s_trace != nullptr)
+            s_trace->serverTiming(response);
+        response.append("\n");
     }
 
     Headers m_headers;
-    MimeTypes m_mime;
 };
 
 /**
  *  The client Request
  *
  *  The HTTP method and path
- *  The HTTP request headers are stored in the map.
+ *  The HTTP request headers are views into a copy of the request head.
  *
  */
 class Request
 {
 public:
-    Request(const std::string &request_line) : m_method(), m_path(), m_version("HTTP/1.1"), m_headers(), m_params()
+    Request(std::string_view request_head) : http_method(METHOD::OTHER), m_method(), m_path(), m_version("HTTP/1.1"), m_head(request_head), m_headers(), m_params(), m_segments()
     {
-        using namespace boost;
-
-        auto header_lines = std::vector<std::string>{};
-        auto sstream = std::stringstream{request_line};
-        for (std::string line; std::getline(sstream, line, '\n');)
-            header_lines.push_back(algorithm::trim_copy(line));
+        std::string_view request_line = m_head;
+        size_t eol = request_line.find('\n');
+        std::string_view request_first_line = trim(request_line.substr(0, eol));
+        if (request_first_line.empty())
+            throw std::runtime_error("Empty Request");
 
-        const std::string request_first_line = header_lines[0];
-        header_lines.erase(header_lines.begin());
+        size_t method_end = request_first_line.find(' ');
+        size_t target_end = (method_end == std::string_view::npos) ? method_end : request_first_line.find(' ', method_end + 1);
+        if ((target_end == std::string_view::npos) || (request_first_line.find(' ', target_end + 1) != std::string_view::npos))
+            throw std::runtime_error("Malformed Request Line");
 
-        auto request_parts = std::vector<std::string>{};
-        auto sstream_method = std::stringstream{request_first_line};
-        for (std::string line; std::getline(sstream_method, line, ' ');)
-            request_parts.push_back(algorithm::trim_copy(line));
-
-        m_method = request_parts[0];
-        m_version = request_parts[2];
+        m_method = request_first_line.substr(0, method_end);
+        std::string_view target = request_first_line.substr(method_end + 1, target_end - method_end - 1);
+        m_version = request_first_line.substr(target_end + 1);
 
         if (m_method == "GET")
             http_method = METHOD::GET;
@@ -225,28 +302,65 @@ public:
         if (m_method == "DELETE")
             http_method = METHOD::DELETE;
 
-        for (std::string &line : header_lines)
+        while (eol != std::string_view::npos)
         {
-            line = algorithm::trim_copy(line);
-            if (!line.empty())
-            {
-                auto npos = line.find(":", 0);
-                auto key = line.substr(0, npos);
-                auto value = line.substr(npos + 1, line.length());
-                key = boost::algorithm::to_lower_copy(algorithm::trim_copy(key));
-                m_headers.emplace(key, algorithm::trim_copy(value));
-            }
+            size_t start = eol + 1;
+            eol = request_line.find('\n', start);
+            std::string_view line = trim(request_line.substr(start, eol == std::string_view::npos ? eol : eol - start));
+
+            size_t colon = line.find(':');
+            if (line.empty() || (colon == std::string_view::npos))
+                continue;
+
+            // names are stored in lower case, the head is our own copy
+            std::string_view key = trim(line.substr(0, colon));
+            char *name = m_head.data() + (key.data() - m_head.data());
+            for (size_t i = 0; i < key.size(); i++)
+                name[i] = std::tolower((unsigned char)name[i]);
+            m_headers.add(key, trim(line.substr(colon + 1)));
         }
-        BOOST_LOG_TRIVIAL(debug) << request_parts[1];
+        LOG_DEBUG << target;
+
+        // origin form, an absolute path and an optional query
+        if (target.empty() || (target.front() != '/'))
+            throw std::runtime_error("Invalid Request Target");
 
-        urls::url_view u = urls::parse_origin_form(request_parts[1]).value();
-        m_path = u.path();
+        size_t query = target.find('?');
+        std::string_view path = target.substr(0, query);
+        decode(path, m_path, false);
 
-        for (auto seg : u.encoded_segments())
-            m_segments.push_back(seg.decode());
+        if (path.size() > 1)
+        {
+            size_t seg_start = 1;
+            while (true)
+            {
+                size_t seg_end = path.find('/', seg_start);
+                decode(path.substr(seg_start, seg_end == std::string_view::npos ? seg_end : seg_end - seg_start), m_segments.emplace_back(), false);
+                if (seg_end == std::string_view::npos)
+                    break;
+                seg_start = seg_end + 1;
+            }
+        }
 
-        for (auto param : u.params())
-            m_params.emplace(algorithm::trim_copy(param.key), algorithm::trim_copy(param.value));
+        if (query != std::string_view::npos)
+        {
+            std::string_view params = target.substr(query + 1);
+            while (!params.empty())
+            {
+                size_t amp = params.find('&');
+                std::string_view param = params.substr(0, amp);
+                params = (amp == std::string_view::npos) ? std::string_view() : params.substr(amp + 1);
+                if (param.empty())
+                    continue;
+
+                size_t eq = param.find('=');
+                std::pmr::string key, value;
+                decode(param.substr(0, eq), key, true);
+                if (eq != std::string_view::npos)
+                    decode(param.substr(eq + 1), value, true);
+                m_params.emplace(trim(key), trim(value));
+            }
+        }
     }
 
     enum class METHOD
@@ -255,9 +369,13 @@ public:
         POST,
         PUT,
         HEAD,
-        DELETE
+        DELETE,
+        OTHER
     };
 
+    Request(const Request &) = delete;
+    Request &operator=(const Request &) = delete;
+
     Request::METHOD http_method;
 
 
@@ -275,37 +393,95 @@ public:
     }
 
     /**
-     *  Get a Request Header by its Key
+     *  Get a well known Request Header, empty if not sent
+     *
+     */
+    inline std::string_view getHeader(HEADER id) const { return m_headers.get(id); }
+    inline bool hasHeader(HEADER id) const { return m_headers.has(id); }
+
+    /**
+     *  The Content-Length, 0 if not sent or not a number
      *
      */
-    std::string getHeader(const char *key)
+    long int contentLength() const
     {
-        
-        std::string k = boost::algorithm::to_lower_copy(std::string(key));
-        if (m_headers.find(k) == m_headers.end())
-            return "";
-        else
-            return m_headers[k];
+        std::string_view value = m_headers.get(HEADER::CONTENT_LENGTH);
+        long int length = 0;
+        if (std::from_chars(value.data(), value.data() + value.size(), length).ec != std::errc())
+            return 0;
+        return length;
     }
 
-    bool hasHeader(const char *key) {
-        return !(m_headers.find(boost::algorithm::to_lower_copy(std::string(key))) == m_headers.end());
+    /**
+     *  Get a Request Header by its Key in any case
+     *
+     */
+    std::string_view getHeader(std::string_view key) const
+    {
+        const RequestHeaders::Field *header = m_headers.get(key);
+        return (header == nullptr) ? std::string_view() : header->second;
     }
 
-    std::string method() const { return m_method; }
-    std::string path() const { return m_path; }
-    std::string version() const { return m_version; }
-    QueryParams params() { return m_params; }
-    Headers headers() { return m_headers; }
-    std::list<std::string> segments() { return m_segments; }
+    bool hasHeader(std::string_view key) const {
+        return m_headers.get(key) != nullptr;
+    }
+
+    const std::pmr::string &method() const { return m_method; }
+    const std::pmr::string &path() const { return m_path; }
+    const std::pmr::string &version() const { return m_version; }
+    const QueryParams &params() const { return m_params; }
+    const RequestHeaders &headers() const { return m_headers; }
+    const Segments &segments() const { return m_segments; }
 
 private:
-    std::string m_method;
-    std::string m_path;
-    std::string m_version;
-    Headers m_headers;
+    static std::string_view trim(std::string_view value)
+    {
+        size_t start = value.find_first_not_of(" \t\r\n");
+        if (start == std::string_view::npos)
+            return std::string_view();
+        return value.substr(start, value.find_last_not_of(" \t\r\n") - start + 1);
+    }
+
+    /**
+     *  Percent decode a path segment or query parameter
+     *
+     */
+    static void decode(std::string_view encoded, std::pmr::string &decoded, bool plus_as_space)
+    {
+        auto hex = [](char c) -> int
+        {
+            if ((c >= '0') && (c <= '9'))
+                return c - '0';
+            if ((c >= 'a') && (c <= 'f'))
+                return c - 'a' + 10;
+            if ((c >= 'A') && (c <= 'F'))
+                return c - 'A' + 10;
+            return -1;
+        };
+
+        decoded.reserve(encoded.size());
+        for (size_t i = 0; i < encoded.size(); i++)
+        {
+            char c = encoded[i];
+            if ((c == '%') && (i + 2 < encoded.size()) && (hex(encoded[i + 1]) >= 0) && (hex(encoded[i + 2]) >= 0))
+            {
+                decoded.push_back(char(hex(encoded[i + 1]) * 16 + hex(encoded[i + 2])));
+                i += 2;
+            }
+            else if ((c == '+') && plus_as_space)
+                decoded.push_back(' ');
+            else
+                decoded.push_back(c);
+        }
+    }
+
+    std::pmr::string m_method;
+    std::pmr::string m_path;
+    std::pmr::string m_version;
+    std::pmr::string m_head;
+    RequestHeaders m_headers;
     QueryParams m_params;
-    std::list<std::string> m_segments;
+    Segments m_segments;
 };
 
 /**
@@ -317,124 +493,253 @@ private:
 class HttpServer
 {
 public:
-    HttpServer(unsigned short port, const char *www_root) : m_server_port(port), m_backlog(32), m_www_root(www_root)
+    HttpServer(unsigned short port, const char *www_root) : m_listener(), m_server_port(port), m_unix_path(), m_www_root(www_root), m_tasks(), m_drain_deadline(0), m_metrics(), m_record(), m_access_log(), m_trace(), m_slow_log(), m_compression(), m_file_send(), m_zerocopy(),
+                                                           m_timeouts(), m_limits(), m_admission(), m_workers(MAX_WORKERS), m_wheel(WorkerTable::now_ms(), TIMER_TICK_MS),
+                                                           m_timers(MAX_WORKERS), m_signalled(MAX_WORKERS), m_worker_slots(), m_tls(), m_http2(false), m_arena(), m_gzip(), m_zerocopy_connection(), m_slot(0), m_input(-1), m_h2(nullptr), m_pending(), m_body_remaining(0), m_chunked(false)
     {
-        m_server_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (m_server_sock > 0)
+        for (size_t i = 0; i < MAX_WORKERS; i++)
+            m_timers[i].id = i;
+        m_admission.setQueuedLimit(m_limits.queued_bytes);
+
+        if (m_listener.inherit())
+        {
+            BOOST_LOG_TRIVIAL(info) << "Listening Sockets Handed Over";
+        }
+        else if (!m_listener.bind(m_server_port))
         {
-            int reuse = 1;
-            setsockopt(m_server_sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
-            setsockopt(m_server_sock, SOL_SOCKET, SO_REUSEPORT, (const char *)&reuse, sizeof(reuse));
+            BOOST_LOG_TRIVIAL(error) << strerror(errno);
+            throw std::runtime_error("Cannot Bind to Port");
+        }
+        LOG_DEBUG << "Socket Bound to Port: " << m_server_port;
+    }
 
-            BOOST_LOG_TRIVIAL(debug) << "Socket Created: " << std::to_string(m_server_sock);
+    ~HttpServer()
+    {
+        LOG_DEBUG << "Socket Closed: " << std::to_string(m_listener.fd());
+    }
 
-            struct sockaddr_in socketAddress;
+    /**
+     *  Write a JSON line for every request to path
+     *
+     *  Call before Accept()
+     */
+    void enableAccessLog(const std::string &path)
+    {
+        m_access_log = std::make_unique<AccessLog>(path);
+        addBackgroundTask([this]() { m_access_log->drain(); }, std::chrono::milliseconds(100));
+    }
 
-            socketAddress.sin_family = AF_INET;
-            socketAddress.sin_port = htons(m_server_port);
-            socketAddress.sin_addr.s_addr = inet_addr("0.0.0.0");
+    /**
+     *  Add a Server-Timing header to every response with the time
+     *  spent so far in each phase of the request
+     *
+     *  Call before Accept()
+     */
+    void enableServerTiming()
+    {
+        RequestTrace::s_enabled = true;
+        Response::s_trace = &m_trace;
+    }
 
-            if (bind(m_server_sock, (struct sockaddr *)&socketAddress, sizeof(socketAddress)) == 0)
-            {
-                BOOST_LOG_TRIVIAL(debug) << "Socket Bound to Port: " << m_server_port;
+    /**
+     *  Write requests taking at least threshold to path as JSON lines,
+     *  with the time spent in each phase
+     *
+     *  Call before Accept()
+     */
+    void enableSlowLog(const std::string &path, std::chrono::microseconds threshold)
+    {
+        RequestTrace::s_enabled = true;
+        m_slow_log = std::make_unique<SlowLog>(path, threshold.count());
+    }
 
-                if (listen(m_server_sock, m_backlog) == 0)
-                {
-                    BOOST_LOG_TRIVIAL(info) << "Listening on Port: " << m_server_port;
-                }
-            }
-            else
-            {
-                BOOST_LOG_TRIVIAL(error) << strerror(errno);
-                throw std::runtime_error("Cannot Bind to Port");
-            }
-        }
+    /**
+     *  Serve HTTPS with the certificate and private key in PEM files
+     *
+     *  Sessions are handed to kernel TLS when the kernel supports it.
+     *  Call before Accept()
+     */
+    void enableTls(const std::string &cert_file, const std::string &key_file)
+    {
+        m_tls = std::make_unique<TlsContext>(cert_file, key_file);
+        if (m_http2)
+            m_tls->enableHttp2();
     }
 
-    ~HttpServer()
+    /**
+     *  Accept HTTP/2, as prior knowledge h2c and over TLS through ALPN
+     *
+     *  Call before Accept()
+     */
+    void enableHttp2()
     {
-        close(m_server_sock);
-        BOOST_LOG_TRIVIAL(debug) << "Socket Closed: " << std::to_string(m_server_sock);
+        m_http2 = true;
+        if (m_tls)
+            m_tls->enableHttp2();
     }
 
-    std::string read_request(int client_socket)
+    /**
+     *  Send generated bodies of at least threshold bytes with MSG_ZEROCOPY
+     *
+     *  Only over plain TCP connections. Call before Accept()
+     */
+    void enableZeroCopy(size_t threshold = ZeroCopy::MIN_SIZE)
     {
-        std::vector<unsigned char> buffer;
+        m_zerocopy.setThreshold(threshold);
+    }
 
-        unsigned char sock_buff[1024];
-        ssize_t nread = 0;
-        do
+    /**
+     *  Also listen on a Unix domain stream socket at path, with tcp
+     *  false only on it
+     *
+     *  Connections on it are served by the same handlers as plain
+     *  HTTP, or h2c with enableHttp2(), even with TLS enabled.
+     *  Call before Accept()
+     */
+    void enableUnixSocket(const std::string &path, bool tcp = true)
+    {
+        // a restart keeps the socket it was handed
+        if ((m_listener.fd(Listener::TRANSPORT::UNIX) < 0) && !m_listener.bindUnix(path))
         {
-            nread = recv(client_socket, sock_buff, 1024, MSG_DONTWAIT);
-            if (nread > 0)
-                buffer.insert(buffer.end(), sock_buff, sock_buff + nread);
-        } while (nread > 0);
+            BOOST_LOG_TRIVIAL(error) << path << ": " << strerror(errno);
+            throw std::runtime_error("Cannot Bind to Unix Socket");
+        }
+        m_unix_path = path;
+
+        if (!tcp)
+            m_listener.close(Listener::TRANSPORT::TCP);
+    }
+
+    /**
+     *  Set the accept queue, deferred accept, fast open, socket buffers
+     *  and accept batch of the server socket
+     *
+     *  Call before Accept()
+     */
+    void setListenOptions(const ListenOptions &options)
+    {
+        m_listener.setOptions(options);
+    }
+
+    /**
+     *  Set the header, body, keep-alive idle, send and drain timeouts
+     *
+     *  Call before Accept()
+     */
+    void setTimeouts(const Timeouts &timeouts)
+    {
+        m_timeouts = timeouts;
+    }
 
-        std::string str(buffer.begin(), buffer.end());
+    /**
+     *  Set the connection and queued body byte limits
+     *
+     *  Call before Accept()
+     */
+    void setLimits(const Limits &limits)
+    {
+        m_limits = limits;
+        m_limits.connections = std::min(m_limits.connections, m_workers.capacity());
+        m_admission.setQueuedLimit(m_limits.queued_bytes);
+    }
 
-        return str;
+    /**
+     *  Limit the requests of a class, see admissionClass(), in flight at once
+     *
+     *  Call before Accept()
+     */
+    void setInFlightLimit(const std::string &admission_class, unsigned int limit)
+    {
+        m_admission.setLimit(admission_class, limit);
     }
 
     /**
-     *  Wait for client requests
-     *  fork() a child process for each request
+     *  Wait for client connections
+     *  fork() a child process for each connection
      *
+     *  The parent tracks every child on a timer wheel and kills
+     *  the ones which miss the deadline of their current phase.
+     *  On SIGHUP a new server process is started on the listening
+     *  sockets, once it accepts this one stops and drains, as it
+     *  does on SIGTERM. Returns when the last worker has finished.
      */
     void Accept()
     {
-        while (true)
+        if (!m_listener.listen())
+        {
+            BOOST_LOG_TRIVIAL(error) << strerror(errno);
+            throw std::runtime_error("Cannot Listen on Port");
+        }
+        if (m_listener.fd(Listener::TRANSPORT::TCP) >= 0)
+            BOOST_LOG_TRIVIAL(info) << "Listening on Port: " << m_server_port;
+        if (m_listener.fd(Listener::TRANSPORT::UNIX) >= 0)
+            BOOST_LOG_TRIVIAL(info) << "Listening on Unix Socket: " << m_unix_path;
+
+        startBackgroundTasks();
+        catchRestarts();
+
+        // the process which handed over the sockets can stop accepting now
+        m_listener.ready();
+
+        // poll() skips a transport which is not listening, the last is a new server starting
+        constexpr size_t TRANSPORTS = size_t(Listener::TRANSPORT::COUNT);
+        struct pollfd fds[TRANSPORTS + 1];
+        int handover = -1;
+        bool backoff = false;
+
+        while ((m_drain_deadline == 0) || (m_workers.active() > 0))
         {
-            struct sockaddr_in clientAddress;
-            socklen_t socklen = sizeof(clientAddress);
-            int client_socket = accept(m_server_sock, (struct sockaddr *)&clientAddress, &socklen);
-            BOOST_LOG_TRIVIAL(debug) << "Client Connection From: " << inet_ntoa(clientAddress.sin_addr);
-            if (client_socket > 0)
+            if (s_reloading && (handover < 0) && (m_drain_deadline == 0))
             {
-                if (fork() == 0)
-                {
-                    // close the parent process server socket
-                    close(m_server_sock);
-
-                    std::string rcv = read_request(client_socket);
-
-                    // parse the client request
-                    Request request{rcv};
-
-                    BOOST_LOG_TRIVIAL(info) << "Method: " << request.method();
-                    BOOST_LOG_TRIVIAL(info) << "Path: " << request.path();
-
-                    switch (request.http_method)
-                    {
-                    case Request::METHOD::GET:
-                        GET(request, client_socket);
-                        break;
-                    case Request::METHOD::HEAD:
-                        HEAD(request, client_socket);
-                        break;
-                    case Request::METHOD::PUT:
-                        PUT(request, client_socket);
-                        break;
-                    case Request::METHOD::POST:
-                        POST(request, client_socket);
-                        break;
-                    case Request::METHOD::DELETE:
-                        DELETE(request, client_socket);
-                        break;
-                    default:
-                        not_allowed(client_socket);
-                        break;
-                    }
-
-                    // close the client socket from the child
-                    close(client_socket);
-
-                    // exit the child process
-                    _exit(0);
-                }
-                // close the client socket from the parent
-                close(client_socket);
+                BOOST_LOG_TRIVIAL(info) << "Restarting";
+                handover = m_listener.handOver();
+                if (handover < 0)
+                    BOOST_LOG_TRIVIAL(error) << "Cannot Start New Server: " << strerror(errno);
+            }
+            s_reloading = 0;
+
+            if (s_stopping && (m_drain_deadline == 0))
+            {
+                drain(false);
+                continue;
+            }
+
+            // out of descriptors the queues stay readable, so they are left for a tick
+            for (size_t i = 0; i < TRANSPORTS; i++)
+                fds[i] = {m_listener.fd(Listener::TRANSPORT(i)), short(backoff ? 0 : POLLIN), 0};
+            fds[TRANSPORTS] = {handover, POLLIN, 0};
+            int wait_ms = m_wheel.armed() ? int(m_wheel.tick_ms()) : (backoff ? int(TIMER_TICK_MS) : -1);
+            int ready = poll(fds, TRANSPORTS + 1, wait_ms);
+            backoff = false;
+
+            reapWorkers();
+            expireWorkers();
+
+            if (ready <= 0)
+                continue;
+
+            for (size_t i = 0; i < TRANSPORTS; i++)
+            {
+                if ((fds[i].revents & POLLIN) && !backoff)
+                    backoff = !acceptBatch(Listener::TRANSPORT(i));
+            }
+
+            // the new server says it accepts, or closed the pipe as it failed to start
+            if (fds[TRANSPORTS].revents != 0)
+            {
+                char byte;
+                bool started = (read(handover, &byte, 1) == 1);
+                close(handover);
+                handover = -1;
+
+                if (started)
+                    drain(true);
+                else
+                    BOOST_LOG_TRIVIAL(error) << "New Server Did Not Start, Carrying On";
             }
         }
+
+        BOOST_LOG_TRIVIAL(info) << "Stopped";
     }
 
 protected:
@@ -475,23 +780,15 @@ protected:
         // Check file can be read and exists
         if (access(full_path.c_str(), R_OK) != 0)
         {
-            std::ostringstream ss;
-            ss << Response::NOT_FOUND << "\n";
-            ss << response.headers_str();
-            std::string response_buff(ss.str());
-            write(client_socket, response_buff.c_str(), response_buff.size());
+            send_buffer(client_socket, response.str(Response::NOT_FOUND));
             return;
         }
 
         struct stat file_details;
         if (stat(full_path.c_str(), &file_details) == 0)
         {
-            response.addFileHeaders(&file_details, full_path);
-            std::ostringstream ss;
-            ss << Response::OK << "\n";
-            ss << response.headers_str();
-            std::string response_buff(ss.str());
-            write(client_socket, response_buff.c_str(), response_buff.size());
+            response.addFileHeaders(&file_details, full_path.native());
+            send_buffer(client_socket, response.str(Response::OK));
         }
     }
 
@@ -516,39 +813,24 @@ protected:
         // Check file can be read and exists
         if (access(full_path.c_str(), R_OK) != 0)
         {
-            std::ostringstream ss;
-            ss << Response::NOT_FOUND << "\n";
-            ss << response.headers_str();
-            std::string response_buff(ss.str());
-            write(client_socket, response_buff.c_str(), response_buff.size());
+            send_buffer(client_socket, response.str(Response::NOT_FOUND));
             return;
         }
 
         struct stat file_details;
         if (stat(full_path.c_str(), &file_details) == 0)
         {
-            response.addFileHeaders(&file_details, full_path);
+            response.addFileHeaders(&file_details, full_path.native());
             // check for etag match
-            if (request.getHeader("If-None-Match") == response.getHeader("Etag"))
+            if (request.getHeader(HEADER::IF_NONE_MATCH) == response.getHeader("Etag"))
             {
-                std::ostringstream ss;
-                ss << Response::NOT_MODIFIED << "\n";
-                ss << response.headers_str();
-                std::string response_buff(ss.str());
-                write(client_socket, response_buff.c_str(), response_buff.size());
+                send_buffer(client_socket, response.str(Response::NOT_MODIFIED));
             }
             else
             {
-                std::ostringstream ss;
-                ss << Response::OK << "\n";
-                ss << response.headers_str();
-                std::string response_buff(ss.str());
-                write(client_socket, response_buff.c_str(), response_buff.size());
-
-                // send content
-                off_t off = 0;
+                // send the head and content
                 int in_fd = open(full_path.c_str(), O_RDONLY);
-                ssize_t sentbytes = sendfile(client_socket, in_fd, &off, file_details.st_size);
+                ssize_t sentbytes = send_file(client_socket, response.str(Response::OK), in_fd, 0, file_details.st_size);
                 close(in_fd);
 
                 if (sentbytes != file_details.st_size)
@@ -559,22 +841,1238 @@ protected:
 
     std::filesystem::path getRootPath() { return std::filesystem::path(m_www_root); }
 
-private:
-    void not_allowed(int client_socket)
+    /**
+     *  Publish the phase this worker is in and how long it may block in it
+     *
+     *  A timeout of 0 means no deadline.
+     */
+    inline void phase(WorkerTable::PHASE phase, uint64_t timeout_ms)
     {
-        Response response{};
+        WorkerTable::Slot &slot = m_workers[m_slot];
+        if (RequestTrace::s_enabled)
+            trace(slot.phase.load(std::memory_order_relaxed), phase);
+        slot.deadline.store(timeout_ms ? WorkerTable::now_ms() + timeout_ms : 0, std::memory_order_relaxed);
+        slot.phase.store(phase, std::memory_order_relaxed);
+    }
 
-        std::ostringstream ss;
-        ss << Response::NOT_ALLOWED << "\n";
-        ss << "Allow: GET, HEAD, PUT, DELETE"
-           << "\n";
-        ss << response.headers_str();
-        std::string response_buff(ss.str());
-        write(client_socket, response_buff.c_str(), response_buff.size());
+    /**
+     *  Close the trace phase which leaving a worker phase ends
+     *
+     */
+    inline void trace(WorkerTable::PHASE from, WorkerTable::PHASE to)
+    {
+        if (from == to)
+            return;
+
+        switch (from)
+        {
+        case WorkerTable::PHASE::HEADER:
+        case WorkerTable::PHASE::IDLE:
+            m_trace.mark(RequestTrace::READ);
+            break;
+        case WorkerTable::PHASE::BODY:
+            m_trace.mark(RequestTrace::BODY);
+            break;
+        case WorkerTable::PHASE::HANDLER:
+            m_trace.mark(RequestTrace::HANDLER);
+            break;
+        case WorkerTable::PHASE::SEND:
+            m_trace.mark(RequestTrace::SEND);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /**
+     *  Whether the server is stopping or restarting, see Accept()
+     *
+     */
+    inline bool draining()
+    {
+        return m_workers[m_slot].draining.load(std::memory_order_relaxed);
+    }
+
+    /**
+     *  Without SA_RESTART a blocked read or write returns EINTR on a timeout
+     *
+     */
+    static void catchTimeouts()
+    {
+        struct sigaction action = {};
+        action.sa_handler = [](int) { s_timed_out = 1; };
+        sigaction(SIGALRM, &action, NULL);
+    }
+
+    /**
+     *  Read up to len bytes of the request body
+     *
+     *  Returns 0 once Content-Length bytes have been read.
+     *  The body timeout applies to each read.
+     */
+    ssize_t recv_body(char *buffer, size_t len)
+    {
+        if (s_timed_out)
+            return -1;
+
+        // the end of an HTTP/2 request body is marked by its stream
+        if (m_h2 != nullptr)
+        {
+            phase(WorkerTable::PHASE::BODY, m_timeouts.body);
+            ssize_t nread = m_h2->recv(buffer, len);
+            phase(WorkerTable::PHASE::HANDLER, 0);
+            return nread;
+        }
+
+        if (m_body_remaining <= 0)
+            return 0;
+
+        len = std::min(len, size_t(m_body_remaining));
+
+        ssize_t nread;
+        if (!m_pending.empty())
+        {
+            // bytes which arrived with the request headers
+            nread = std::min(len, m_pending.size());
+            memcpy(buffer, m_pending.data(), nread);
+            m_pending.erase(0, nread);
+        }
+        else
+        {
+            phase(WorkerTable::PHASE::BODY, m_timeouts.body);
+            do
+                nread = recv(m_input, buffer, len, 0);
+            while ((nread < 0) && (errno == EINTR) && !s_timed_out);
+            phase(WorkerTable::PHASE::HANDLER, 0);
+        }
+
+        if (nread > 0)
+            m_body_remaining -= nread;
+        return nread;
+    }
+
+    /**
+     *  Write a response buffer to the client
+     *
+     *  Records the status line and bytes sent for the metrics.
+     *  Flags are added to send(), MSG_MORE holds the buffer back to
+     *  go out with what is sent next, a MSG_ZEROCOPY buffer must be
+     *  in the arena as it is not released until the next request.
+     */
+    ssize_t send_buffer(int client_socket, std::string_view buffer, int flags = 0)
+    {
+        recordStatus(buffer);
+
+        if (s_timed_out)
+            return -1;
+
+        phase(WorkerTable::PHASE::SEND, m_timeouts.send);
+
+        if (m_h2 != nullptr)
+        {
+            ssize_t nsent = m_h2->send(buffer);
+            phase(WorkerTable::PHASE::HANDLER, 0);
+            if (nsent > 0)
+                m_record.bytes_out += nsent;
+            return nsent;
+        }
+
+        if (!m_zerocopy_connection.enabled())
+            flags &= ~MSG_ZEROCOPY;
+
+        size_t sent = 0;
+        while (sent < buffer.size())
+        {
+            ssize_t nwritten = send(client_socket, buffer.data() + sent, buffer.size() - sent, MSG_NOSIGNAL | flags);
+            if (nwritten <= 0)
+            {
+                // out of memory to pin the pages, copy instead
+                if ((nwritten < 0) && (errno == ENOBUFS) && (flags & MSG_ZEROCOPY))
+                {
+                    flags &= ~MSG_ZEROCOPY;
+                    continue;
+                }
+                if ((nwritten < 0) && retry(client_socket))
+                    continue;
+                break;
+            }
+            sent += nwritten;
+            if (flags & MSG_ZEROCOPY)
+            {
+                m_zerocopy_connection.sent();
+                m_zerocopy.sent(nwritten);
+            }
+            phase(WorkerTable::PHASE::SEND, m_timeouts.send);
+        }
+
+        phase(WorkerTable::PHASE::HANDLER, 0);
+        m_record.bytes_out += sent;
+        return sent;
+    }
+
+    /**
+     *  Note the status of a response head for the metrics
+     *
+     */
+    inline void recordStatus(std::string_view head)
+    {
+        // after the final status, a body which starts like a status line is a body
+        if (m_record.status >= 200)
+            return;
+        if ((head.size() > 12) && (head.compare(0, 5, "HTTP/") == 0))
+            std::from_chars(head.data() + 9, head.data() + 12, m_record.status);
+    }
+
+    /**
+     *  Send a response head then count bytes of a file from offset
+     *
+     *  A tiny body is read and written with the head in one call,
+     *  anything larger goes to send_file() behind the head.
+     *  Returns the body bytes sent.
+     */
+    ssize_t send_file(int client_socket, std::string_view head, int in_fd, off_t offset, size_t count)
+    {
+        if ((m_h2 != nullptr) || (FileSend::strategy(count) != FileSend::STRATEGY::COPY))
+        {
+            if (send_buffer(client_socket, head, (count > 0) ? MSG_MORE : 0) != ssize_t(head.size()))
+                return -1;
+            return send_file(client_socket, in_fd, &offset, count);
+        }
+
+        recordStatus(head);
+        if (s_timed_out)
+            return -1;
+
+        struct timespec start = RequestRecord::now();
+
+        char body[FileSend::TINY];
+        size_t nread = 0;
+        while (nread < count)
+        {
+            ssize_t n = pread(in_fd, body + nread, count - nread, offset + nread);
+            if (n <= 0)
+            {
+                if ((n < 0) && (errno == EINTR))
+                    continue;
+                break;
+            }
+            nread += n;
+        }
+
+        phase(WorkerTable::PHASE::SEND, m_timeouts.send);
+
+        struct iovec iov[2] = {{const_cast<char *>(head.data()), head.size()}, {body, nread}};
+        size_t total = head.size() + nread;
+        size_t sent = 0;
+        while (sent < total)
+        {
+            // skip what has gone already
+            struct iovec rest[2];
+            int count_iov = 0;
+            size_t skip = sent;
+            for (auto &v : iov)
+            {
+                if (skip >= v.iov_len)
+                {
+                    skip -= v.iov_len;
+                    continue;
+                }
+                rest[count_iov].iov_base = static_cast<char *>(v.iov_base) + skip;
+                rest[count_iov++].iov_len = v.iov_len - skip;
+                skip = 0;
+            }
+
+            ssize_t nwritten = writev(client_socket, rest, count_iov);
+            if (nwritten <= 0)
+            {
+                if ((nwritten < 0) && retry(client_socket))
+                    continue;
+                break;
+            }
+            sent += nwritten;
+            phase(WorkerTable::PHASE::SEND, m_timeouts.send);
+        }
+
+        phase(WorkerTable::PHASE::HANDLER, 0);
+        m_record.bytes_out += sent;
+
+        size_t body_sent = (sent > head.size()) ? sent - head.size() : 0;
+        m_file_send.record(FileSend::STRATEGY::COPY, body_sent, RequestRecord::since_us(start));
+        return (sent < head.size()) ? -1 : body_sent;
+    }
+
+    /**
+     *  Send count bytes of a file to the client from offset
+     *
+     *  The send timeout applies to each chunk, so a large
+     *  file to a slow but live client is not cut off.
+     */
+    ssize_t send_file(int client_socket, int in_fd, off_t *offset, size_t count)
+    {
+        if (s_timed_out)
+            return -1;
+
+        FileSend::STRATEGY strategy = FileSend::strategy(count);
+        struct timespec start = RequestRecord::now();
+        off_t first = *offset;
+
+        // a cold file nobody has asked for lately is not kept in the page cache
+        bool drop = false;
+        off_t hinted = first;
+        if (strategy == FileSend::STRATEGY::READAHEAD)
+        {
+            struct stat details;
+            bool cold = !FileSend::cached(in_fd, first);
+            drop = (fstat(in_fd, &details) == 0) && !m_file_send.recent(details) && cold;
+            posix_fadvise(in_fd, first, count, POSIX_FADV_SEQUENTIAL);
+        }
+
+        size_t sent = 0;
+        while (sent < count)
+        {
+            // keep the reads READAHEAD_BYTES ahead of the socket
+            if (strategy == FileSend::STRATEGY::READAHEAD)
+            {
+                off_t want = first + off_t(std::min(count, sent + FileSend::READAHEAD_BYTES));
+                if (want - hinted >= off_t(SEND_CHUNK) || ((want == first + off_t(count)) && (want > hinted)))
+                {
+                    posix_fadvise(in_fd, hinted, want - hinted, POSIX_FADV_WILLNEED);
+                    hinted = want;
+                }
+            }
+
+            phase(WorkerTable::PHASE::SEND, m_timeouts.send);
+            ssize_t nsent;
+            if (m_h2 != nullptr)
+                nsent = m_h2->sendFile(in_fd, offset, std::min(count - sent, SEND_CHUNK));
+            else
+                nsent = sendfile(client_socket, in_fd, offset, std::min(count - sent, SEND_CHUNK));
+            if (nsent <= 0)
+            {
+                if ((nsent < 0) && retry(client_socket))
+                    continue;
+                break;
+            }
+            sent += nsent;
+        }
+
+        if (drop && (sent > 0))
+        {
+            posix_fadvise(in_fd, first, sent, POSIX_FADV_DONTNEED);
+            m_file_send.dropped(sent);
+        }
+
+        phase(WorkerTable::PHASE::HANDLER, 0);
+        m_record.bytes_out += sent;
+        m_file_send.record(strategy, sent, RequestRecord::since_us(start));
+        return sent;
+    }
+
+    /**
+     *  Whether a failed write should be tried again
+     *
+     *  Interrupted writes are retried unless the send timed out,
+     *  a full non-blocking socket is waited on.
+     */
+    bool retry(int client_socket)
+    {
+        if (s_timed_out)
+            return false;
+        if (errno == EINTR)
+            return true;
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            return false;
+
+        // the send timeout interrupts the wait
+        struct pollfd pfd = {client_socket, POLLOUT, 0};
+        return (poll(&pfd, 1, -1) > 0) || ((errno == EINTR) && !s_timed_out);
+    }
+
+    inline Metrics &metrics() { return m_metrics; }
+    inline RequestRecord &record() { return m_record; }
+    inline Compression &compression() { return m_compression; }
+    inline RequestTrace &trace() { return m_trace; }
+
+    // set in a background task when the server stops
+    static inline bool stopping() { return s_stopping; }
+
+    /**
+     *  Start a generated body for a response with its Content-Type set
+     *
+     *  Write the body through the returned buffer, then send it with
+     *  send_body(). It is gzipped when the client accepts gzip and the
+     *  body is large enough, only the compressed body is held.
+     */
+    std::streambuf *begin_body(const Request &request, Response &response, std::pmr::string &body)
+    {
+        bool compressible = ContentCoding::compressible(response.getHeader("Content-Type"));
+        if (compressible)
+            response.addHeader("Vary", "Accept-Encoding");
+
+        unsigned int accepted = ContentCoding::accepted(request.getHeader(HEADER::ACCEPT_ENCODING));
+        return m_gzip.start(body, compressible && (accepted & ContentCoding::bit(ContentCoding::CODING::GZIP)));
+    }
+
+    /**
+     *  Send the status line, headers and a body from begin_body()
+     *
+     */
+    void send_body(int client_socket, Response &response, std::string_view status, std::pmr::string &body)
+    {
+        if (m_gzip.finish())
+        {
+            response.addHeader("Content-Encoding", "gzip");
+            m_compression.sent(ContentCoding::CODING::GZIP, Compression::SOURCE::STREAM, m_gzip.rawSize(), body.size());
+        }
+        response.setContentLength(body.size());
+
+        std::pmr::string buffer = response.str(status);
+        buffer.append(body);
+        send_buffer(client_socket, buffer, m_zerocopy.use(buffer.size()) ? MSG_ZEROCOPY : 0);
+    }
+
+    /**
+     *  Send the status line and headers of a body of unknown length
+     *
+     *  Send the body with send_chunk() and finish it with end_chunks().
+     *  HTTP/1.1 bodies are chunked, HTTP/2 ones go out as DATA frames
+     *  as they are and an HTTP/1.0 body ends with the connection.
+     */
+    bool begin_chunks(const Request &request, int client_socket, Response &response, std::string_view status)
+    {
+        response.headers().erase("Content-Length");
+        m_chunked = (m_h2 == nullptr) && (request.version() == "HTTP/1.1");
+        if (m_chunked)
+            response.addHeader("Transfer-Encoding", "chunked");
+        else if (m_h2 == nullptr)
+        {
+            Response::s_keep_alive = false;
+            response.addHeader("Connection", "close");
+        }
+
+        std::pmr::string head = response.str(status);
+        return send_buffer(client_socket, head, MSG_MORE) == ssize_t(head.size());
+    }
+
+    /**
+     *  Send a part of a body started with begin_chunks()
+     *
+     */
+    bool send_chunk(int client_socket, std::string_view data)
+    {
+        if (data.empty())
+            return true;
+        if (!m_chunked)
+            return send_buffer(client_socket, data) == ssize_t(data.size());
+
+        char size[24];
+        int len = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+        return (send_buffer(client_socket, std::string_view(size, len), MSG_MORE) == len) &&
+               (send_buffer(client_socket, data, MSG_MORE) == ssize_t(data.size())) && (send_buffer(client_socket, "\r\n") == 2);
+    }
+
+    /**
+     *  Finish a body started with begin_chunks()
+     *
+     */
+    bool end_chunks(int client_socket)
+    {
+        if (!m_chunked)
+            return true;
+        m_chunked = false;
+        return send_buffer(client_socket, "0\r\n\r\n") == 5;
+    }
+
+    /**
+     *  Give up on a body started with begin_chunks(), so the client
+     *  sees it cut short rather than ended
+     *
+     *  HTTP/1 bodies end with the connection without the last chunk,
+     *  an HTTP/2 stream is reset.
+     */
+    void abort_chunks()
+    {
+        m_chunked = false;
+        if (m_h2 != nullptr)
+            m_h2->abort();
+        else
+            Response::s_keep_alive = false;
+    }
+
+    /**
+     *  Wait until the kernel has released the buffers sent with MSG_ZEROCOPY
+     *
+     *  They are in the arena, which the next request reuses.
+     */
+    bool release_zerocopy()
+    {
+        if (!m_zerocopy_connection.pending())
+            return true;
+
+        struct timespec start = RequestRecord::now();
+        phase(WorkerTable::PHASE::SEND, m_timeouts.send);
+
+        bool copied = false;
+        bool released = m_zerocopy_connection.reap(true, s_timed_out, copied);
+        if (copied)
+            m_zerocopy.copied();
+        m_zerocopy.waited(RequestRecord::since_us(start));
+        return released;
+    }
+
+    /**
+     *  Write the server metrics in Prometheus text format
+     *
+     */
+    virtual void writeMetrics(std::ostream &out)
+    {
+        m_metrics.write(out);
+        m_admission.write(out);
+        m_compression.write(out);
+        m_file_send.write(out);
+        m_zerocopy.write(out);
+        m_listener.write(out);
+        if (m_tls)
+            m_tls->write(out);
+    }
+
+    /**
+     *  The class a request is counted in for setInFlightLimit()
+     *
+     */
+    virtual std::string_view admissionClass(Request &request)
+    {
+        return request.method();
+    }
+
+    /**
+     *  Serve requests on a connection until it is closed or times out
+     *
+     *  Called in the worker process forked for the connection.
+     *  Responses are written to client_socket, requests are read
+     *  from input when it is given. With http2 the connection has
+     *  already agreed on HTTP/2.
+     */
+    void serve(int client_socket, const struct sockaddr_storage &clientAddress, struct timespec accepted, int input = -1, bool http2 = false)
+    {
+        catchTimeouts();
+        m_input = (input < 0) ? client_socket : input;
+        m_zerocopy_connection.start(client_socket, m_zerocopy.enabled() && (input < 0));
+
+        char client[INET6_ADDRSTRLEN] = "";
+        Listener::name(clientAddress, client, sizeof(client));
+
+        // the strings and maps of each request come from the connection arena
+        std::pmr::memory_resource *heap = std::pmr::set_default_resource(m_arena.resource());
+
+        if (http2)
+            serveHttp2(client_socket, client);
+
+        bool keep_alive = !http2;
+        for (unsigned int served = 0; keep_alive && !s_timed_out; served++)
+        {
+            if (served > 0)
+            {
+                if (!release_zerocopy())
+                    break;
+
+                if (m_pending.empty())
+                    phase(WorkerTable::PHASE::IDLE, m_timeouts.idle);
+                else
+                    phase(WorkerTable::PHASE::HEADER, m_timeouts.header);
+            }
+
+            // the last request is finished with, free everything it allocated
+            m_arena.reset();
+
+            size_t head_size;
+            if (!read_request(head_size))
+                break;
+
+            // the prior knowledge HTTP/2 preface starts like a request head
+            if ((served == 0) && m_http2 && (std::string_view(m_pending.data(), head_size) == Http2Connection::PREFACE_HEAD))
+            {
+                serveHttp2(client_socket, client);
+                break;
+            }
+
+            m_record = RequestRecord{};
+            m_record.start = (served == 0) ? accepted : RequestRecord::now();
+            m_record.bytes_in = head_size;
+            m_trace.start(m_record.start);
+            m_trace.mark(RequestTrace::READ);
+
+            // parse the client request
+            std::optional<Request> parsed;
+            try
+            {
+                parsed.emplace(std::string_view(m_pending.data(), head_size));
+            }
+            catch (const std::exception &e)
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Bad Request From " << client << ": " << e.what();
+                Response::s_keep_alive = false;
+                bad_request(client_socket);
+                m_metrics.record(m_record);
+                break;
+            }
+            m_pending.erase(0, head_size);
+            Request &request = *parsed;
+            m_trace.mark(RequestTrace::PARSE);
+
+            LOG_DEBUG << "Method: " << request.method();
+            LOG_DEBUG << "Path: " << request.path();
+
+            // chunked bodies are not supported, the end of one could not be found
+            std::string_view connection = request.getHeader(HEADER::CONNECTION);
+            if (request.version() == "HTTP/1.1")
+                keep_alive = !boost::algorithm::iequals(connection, "close");
+            else
+                keep_alive = boost::algorithm::iequals(connection, "keep-alive");
+            if (request.hasHeader(HEADER::TRANSFER_ENCODING))
+                keep_alive = false;
+
+            // a draining server closes the connection after this request
+            if (draining())
+                keep_alive = false;
+
+            m_body_remaining = request.contentLength();
+            Response::s_keep_alive = keep_alive;
+
+            handle(request, client_socket, client);
+
+            // the next request starts after this body
+            if ((m_body_remaining > 0) || draining())
+                keep_alive = false;
+        }
+
+        std::pmr::set_default_resource(heap);
+    }
+
+    /**
+     *  Admit and dispatch a request, then record it
+     *
+     */
+    void handle(Request &request, int client_socket, const char *client)
+    {
+        // the metrics stay reachable under load
+        if (request.path() == METRICS_PATH)
+            dispatch(request, client_socket);
+        else if (admit(request))
+        {
+            m_trace.mark(RequestTrace::QUEUE);
+            dispatch(request, client_socket);
+            release();
+        }
+        else
+        {
+            // the body is not read, so the connection cannot carry on
+            if (m_body_remaining > 0)
+                Response::s_keep_alive = false;
+            slow_down(client_socket);
+        }
+
+        if (s_timed_out)
+            m_record.status = 408;
+
+        m_metrics.record(m_record);
+
+        if (m_access_log)
+            m_access_log->push(m_record, client, request.method(), request.path());
+
+        if (m_slow_log)
+        {
+            m_trace.mark(RequestTrace::HANDLER);
+            m_slow_log->record(m_record, m_trace, client, request.method(), request.path());
+        }
+    }
+
+    /**
+     *  Serve the streams of an HTTP/2 connection, see enableHttp2()
+     *
+     *  Requests are handled one at a time in priority order by the
+     *  same handlers, send_buffer(), send_file() and recv_body()
+     *  go through the stream.
+     */
+    void serveHttp2(int client_socket, const char *client)
+    {
+        Http2Connection h2(m_input, client_socket, s_timed_out);
+        if (!h2.start(m_pending))
+            return;
+        m_h2 = &h2;
+
+        while (!s_timed_out)
+        {
+            // a draining server says GOAWAY once the streams are done
+            if (draining() && h2.idle())
+                break;
+
+            if (h2.idle())
+                phase(WorkerTable::PHASE::IDLE, m_timeouts.idle);
+            else
+                phase(WorkerTable::PHASE::HEADER, m_timeouts.header);
+
+            Http2Stream *stream = h2.next();
+            if (stream == nullptr)
+                break;
+            phase(WorkerTable::PHASE::HANDLER, 0);
+
+            m_arena.reset();
+
+            m_record = RequestRecord{};
+            m_record.start = RequestRecord::now();
+            m_record.bytes_in = stream->head.size();
+            m_trace.start(m_record.start);
+
+            std::optional<Request> parsed;
+            try
+            {
+                parsed.emplace(stream->head);
+            }
+            catch (const std::exception &e)
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Bad Request From " << client << ": " << e.what();
+                bad_request(client_socket);
+                m_metrics.record(m_record);
+                h2.finish();
+                continue;
+            }
+            Request &request = *parsed;
+            m_trace.mark(RequestTrace::PARSE);
+
+            m_body_remaining = request.contentLength();
+            Response::s_keep_alive = true;
+
+            handle(request, client_socket, client);
+            h2.finish();
+        }
+
+        h2.close();
+        m_h2 = nullptr;
+    }
+
+    /**
+     *  Do the TLS handshake then serve the connection, see enableTls()
+     *
+     *  The handshake has the header timeout.
+     */
+    void serveTls(int client_socket, const struct sockaddr_storage &clientAddress, struct timespec accepted)
+    {
+        catchTimeouts();
+
+        TlsConnection tls(*m_tls, client_socket);
+        if (!tls.accept(s_timed_out))
+        {
+            LOG_DEBUG << "TLS Handshake Failed";
+            return;
+        }
+        LOG_DEBUG << "TLS Mode: " << TlsContext::name(tls.mode());
+
+        serve(tls.output(), clientAddress, accepted, tls.input(), tls.alpn() == "h2");
+
+        // the relay flushes the last response within the send timeout
+        phase(WorkerTable::PHASE::SEND, m_timeouts.send);
+        tls.close();
+    }
+
+    static constexpr const char *METRICS_PATH = "/_metrics";
+    static constexpr size_t SEND_CHUNK = 1 << 20;
+
+    /**
+     *  Run a task every interval in its own process
+     *
+     *  Tasks are started by Accept() and exit with the server.
+     */
+    void addBackgroundTask(std::function<void()> task, std::chrono::milliseconds interval)
+    {
+        m_tasks.emplace_back(task, interval);
+    }
+
+    /**
+     *  True while the server which handed over the sockets on a
+     *  restart is still draining
+     *
+     *  Its requests change the stored content without going through
+     *  this server's shared state.
+     */
+    inline bool predecessorRunning()
+    {
+        return m_listener.predecessorRunning();
+    }
+
+private:
+    /**
+     *  Accept what is queued on a transport, up to a batch so the timers
+     *  still run, and fork a worker for each connection
+     *
+     *  Returns false if out of descriptors.
+     */
+    bool acceptBatch(Listener::TRANSPORT transport)
+    {
+        // TLS is for the network, a client on the Unix socket is on this host
+        bool tls = m_tls && (transport == Listener::TRANSPORT::TCP);
+
+        unsigned int count = 0;
+        while (count < m_listener.options().accept_batch)
+        {
+            struct sockaddr_storage clientAddress;
+            int client_socket = m_listener.accept(transport, clientAddress);
+            if (client_socket < 0)
+            {
+                if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM))
+                {
+                    BOOST_LOG_TRIVIAL(warning) << "Cannot Accept: " << strerror(errno);
+                    m_listener.woken(count);
+                    return false;
+                }
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                    break;
+                continue;
+            }
+            count++;
+            struct timespec accepted = RequestRecord::now();
+
+            char client[INET6_ADDRSTRLEN];
+            LOG_DEBUG << "Client Connection From: " << Listener::name(clientAddress, client, sizeof(client));
+
+            uint64_t now = WorkerTable::now_ms();
+            size_t slot;
+            if ((m_workers.active() >= m_limits.connections) || !m_workers.acquire(slot, now + m_timeouts.header))
+            {
+                LOG_DEBUG << "Connection Limit Reached: " << m_workers.active();
+                reject(client_socket, tls);
+                continue;
+            }
+
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                // close the parent process server sockets
+                m_listener.detach();
+                signal(SIGHUP, SIG_DFL);
+                signal(SIGTERM, SIG_DFL);
+
+                m_slot = slot;
+                if (tls)
+                    serveTls(client_socket, clientAddress, accepted);
+                else
+                    serve(client_socket, clientAddress, accepted);
+
+                // close the client socket from the child
+                close(client_socket);
+
+                // exit the child process
+                _exit(0);
+            }
+
+            if (pid > 0)
+            {
+                m_workers[slot].pid.store(pid, std::memory_order_relaxed);
+                m_worker_slots[pid] = slot;
+                m_signalled[slot] = false;
+                m_wheel.arm(m_timers[slot], std::min(now + m_timeouts.header, now + CHECK_INTERVAL_MS));
+            }
+            else
+            {
+                BOOST_LOG_TRIVIAL(error) << "Cannot fork: " << strerror(errno);
+                m_workers.release(slot);
+            }
+
+            // close the client socket from the parent
+            close(client_socket);
+        }
+        m_listener.woken(count);
+        return true;
+    }
+
+    /**
+     *  SIGHUP restarts and SIGTERM stops, both after draining
+     *
+     *  Without SA_RESTART the wait for connections returns EINTR.
+     */
+    static void catchRestarts()
+    {
+        struct sigaction action = {};
+        action.sa_handler = [](int) { s_reloading = 1; };
+        sigaction(SIGHUP, &action, NULL);
+        action.sa_handler = [](int) { s_stopping = 1; };
+        sigaction(SIGTERM, &action, NULL);
+    }
+
+    /**
+     *  Stop accepting and let the workers finish their requests
+     *
+     *  Handed over, the sockets stay open in the new server and the
+     *  Unix socket file is left in place for it. Idle connections are
+     *  closed, the others after their request, and whatever is left
+     *  at the drain timeout is timed out.
+     */
+    void drain(bool handed_over)
+    {
+        if (handed_over)
+            m_listener.detach();
+        else
+            m_listener.close();
+
+        for (auto &worker : m_worker_slots)
+            m_workers[worker.second].draining.store(true, std::memory_order_relaxed);
+
+        uint64_t now = WorkerTable::now_ms();
+        m_drain_deadline = now + std::max<uint64_t>(m_timeouts.drain, 1);
+        BOOST_LOG_TRIVIAL(info) << "Draining " << m_workers.active() << " Connections";
+
+        // idle workers are closed on the next turn of the wheel
+        for (auto &worker : m_worker_slots)
+            m_wheel.arm(m_timers[worker.second], now);
+    }
+
+    void startBackgroundTasks()
+    {
+        for (auto &task : m_tasks)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                m_listener.detach();
+
+                // run the task one last time when the server exits
+                signal(SIGTERM, [](int) { s_stopping = 1; });
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+                while (!s_stopping)
+                {
+                    task.first();
+                    usleep(task.second.count() * 1000);
+                }
+                task.first();
+                _exit(0);
+            }
+            if (pid < 0)
+                BOOST_LOG_TRIVIAL(error) << "Cannot Start Background Task: " << strerror(errno);
+        }
+    }
+
+    void dispatch(Request &request, int client_socket)
+    {
+        if ((request.http_method == Request::METHOD::GET) && (request.path() == METRICS_PATH))
+        {
+            m_record.handler = m_metrics.handler("METRICS");
+            metrics(client_socket);
+            return;
+        }
+
+        switch (request.http_method)
+        {
+        case Request::METHOD::GET:
+            m_record.handler = m_metrics.handler("GET");
+            GET(request, client_socket);
+            break;
+        case Request::METHOD::HEAD:
+            m_record.handler = m_metrics.handler("HEAD");
+            HEAD(request, client_socket);
+            break;
+        case Request::METHOD::PUT:
+            m_record.handler = m_metrics.handler("PUT");
+            PUT(request, client_socket);
+            break;
+        case Request::METHOD::POST:
+            m_record.handler = m_metrics.handler("POST");
+            POST(request, client_socket);
+            break;
+        case Request::METHOD::DELETE:
+            m_record.handler = m_metrics.handler("DELETE");
+            DELETE(request, client_socket);
+            break;
+        default:
+            not_allowed(client_socket);
+            break;
+        }
+    }
+
+    /**
+     *  Read the request line and headers, up to the blank line
+     *
+     *  They are left at the start of m_pending, size is set to their
+     *  length. Returns false if the client closes the connection,
+     *  times out or sends too much.
+     */
+    bool read_request(size_t &size)
+    {
+        char sock_buff[4096];
+        size_t end;
+
+        while (true)
+        {
+            // blank lines before a request are ignored
+            m_pending.erase(0, std::min(m_pending.find_first_not_of("\r\n"), m_pending.size()));
+
+            if ((end = headerEnd(m_pending)) != std::string::npos)
+                break;
+
+            if (m_pending.size() >= MAX_HEADER_BYTES)
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Request Headers Too Large";
+                return false;
+            }
+
+            ssize_t nread = recv(m_input, sock_buff, sizeof(sock_buff), 0);
+            if (nread <= 0)
+                return false;
+
+            if (m_workers[m_slot].phase.load(std::memory_order_relaxed) == WorkerTable::PHASE::IDLE)
+                phase(WorkerTable::PHASE::HEADER, m_timeouts.header);
+
+            m_pending.append(sock_buff, nread);
+        }
+
+        size = end;
+        phase(WorkerTable::PHASE::HANDLER, 0);
+        return true;
+    }
+
+    /**
+     *  Return the offset just past the blank line ending the headers
+     *
+     */
+    static size_t headerEnd(const std::string &buffer)
+    {
+        size_t crlf = buffer.find("\n\r\n");
+        size_t lf = buffer.find("\n\n");
+        if ((crlf != std::string::npos) && ((lf == std::string::npos) || (crlf < lf)))
+            return crlf + 3;
+        if (lf != std::string::npos)
+            return lf + 2;
+        return std::string::npos;
+    }
+
+    /**
+     *  Reap finished workers and free their slots
+     *
+     */
+    void reapWorkers()
+    {
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        {
+            auto worker = m_worker_slots.find(pid);
+            if (worker == m_worker_slots.end())
+                continue;
+
+            // give back the admission of a worker which died in a request
+            WorkerTable::Slot &slot = m_workers[worker->second];
+            if (slot.admitted.load(std::memory_order_relaxed))
+                m_admission.release(slot.admission_class.load(std::memory_order_relaxed), slot.queued_bytes.load(std::memory_order_relaxed));
+
+            m_wheel.cancel(m_timers[worker->second]);
+            m_workers.release(worker->second);
+            m_worker_slots.erase(worker);
+        }
+    }
+
+    /**
+     *  Turn the timer wheel and deal with the workers which are due
+     *
+     *  A worker whose deadline has moved on is checked again later,
+     *  one which missed it gets SIGALRM to abandon its request and
+     *  SIGKILL if it is still there after a grace period.
+     */
+    void expireWorkers()
+    {
+        uint64_t now = WorkerTable::now_ms();
+        m_wheel.advance(now, [this, now](Timer &timer)
+                        {
+                            WorkerTable::Slot &slot = m_workers[timer.id];
+                            pid_t pid = slot.pid.load(std::memory_order_relaxed);
+                            uint64_t deadline = slot.deadline.load(std::memory_order_relaxed);
+
+                            // a draining server closes idle connections straight away, and the rest at its deadline
+                            WorkerTable::PHASE phase = slot.phase.load(std::memory_order_relaxed);
+                            if ((m_drain_deadline != 0) && ((phase == WorkerTable::PHASE::IDLE) || (now >= m_drain_deadline)))
+                                deadline = now;
+
+                            if ((deadline == 0) || (deadline > now))
+                            {
+                                m_wheel.arm(timer, (deadline == 0) ? now + CHECK_INTERVAL_MS : std::min(deadline, now + CHECK_INTERVAL_MS));
+                            }
+                            else if (!m_signalled[timer.id])
+                            {
+                                // an idle keep-alive connection timing out is normal
+                                if (phase == WorkerTable::PHASE::IDLE)
+                                    LOG_DEBUG << "Worker " << pid << " Idle Timeout";
+                                else
+                                    BOOST_LOG_TRIVIAL(warning) << "Worker " << pid << " Timed Out In " << WorkerTable::name(phase);
+                                kill(pid, SIGALRM);
+                                m_signalled[timer.id] = true;
+                                m_wheel.arm(timer, now + KILL_GRACE_MS);
+                            }
+                            else
+                            {
+                                kill(pid, SIGKILL);
+                                m_wheel.arm(timer, now + CHECK_INTERVAL_MS);
+                            } });
+    }
+
+    /**
+     *  Take an admission place for a request, recorded in the worker slot
+     *
+     */
+    bool admit(Request &request)
+    {
+        uint32_t index = m_admission.find(admissionClass(request));
+        uint64_t bytes = m_body_remaining;
+        if (!m_admission.admit(index, bytes))
+            return false;
+
+        WorkerTable::Slot &slot = m_workers[m_slot];
+        slot.admission_class.store(index, std::memory_order_relaxed);
+        slot.queued_bytes.store(bytes, std::memory_order_relaxed);
+        slot.admitted.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     *  Give back the admission place of the request
+     *
+     *  Each counter is cleared in the slot straight after it is given
+     *  back and admitted last, so a worker killed part way through is
+     *  reclaimed by the parent for just what it still held.
+     */
+    void release()
+    {
+        WorkerTable::Slot &slot = m_workers[m_slot];
+        m_admission.release(Admission::NO_CLASS, slot.queued_bytes.load(std::memory_order_relaxed));
+        slot.queued_bytes.store(0, std::memory_order_relaxed);
+        m_admission.release(slot.admission_class.load(std::memory_order_relaxed), 0);
+        slot.admission_class.store(Admission::NO_CLASS, std::memory_order_relaxed);
+        slot.admitted.store(false, std::memory_order_release);
+    }
+
+    /**
+     *  Return 503 SLOW DOWN
+     *
+     */
+    void slow_down(int client_socket)
+    {
+        Response response{};
+        char retry_after[16];
+        snprintf(retry_after, sizeof(retry_after), "%u", m_limits.retry_after);
+        response.addHeader("Retry-After", retry_after);
+
+        send_buffer(client_socket, response.str(Response::SLOW_DOWN));
+    }
+
+    /**
+     *  Turn a connection away from the parent without forking
+     *
+     *  Never blocks, whatever of the request has arrived is read
+     *  first so closing the socket does not reset the connection.
+     */
+    void reject(int client_socket, bool tls)
+    {
+        m_admission.rejectConnection();
+
+        char sock_buff[4096];
+        while (recv(client_socket, sock_buff, sizeof(sock_buff), MSG_DONTWAIT) > 0)
+            ;
+
+        // a TLS client could not read a plain text response
+        if (tls)
+        {
+            close(client_socket);
+            return;
+        }
+
+        std::ostringstream ss;
+        ss << Response::SLOW_DOWN << "\n";
+        ss << "Retry-After: " << m_limits.retry_after << "\n";
+        ss << "Content-Length: 0\n";
+        ss << "Connection: close\n\n";
+        std::string response_buff(ss.str());
+        send(client_socket, response_buff.data(), response_buff.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        shutdown(client_socket, SHUT_WR);
+        close(client_socket);
+    }
+
+    /**
+     *  Return 400 BAD REQUEST for a request which cannot be parsed
+     *
+     */
+    void bad_request(int client_socket)
+    {
+        Response response{};
+        send_buffer(client_socket, response.str(Response::BAD_REQUEST));
+    }
+
+    void metrics(int client_socket)
+    {
+        Response response{};
+
+        std::ostringstream mesg;
+        writeMetrics(mesg);
+        std::string mesg_buff(mesg.str());
+
+        response.setContentLength(mesg_buff.length());
+        response.addHeader("Content-Type", "text/plain; version=0.0.4");
+
+        std::ostringstream ss;
+        ss << Response::OK << "\n";
+        ss << response.headers_str();
+        ss << mesg_buff;
+        send_buffer(client_socket, ss.str());
+    }
+
+    void not_allowed(int client_socket)
+    {
+        Response response{};
+        response.addHeader("Allow", "GET, HEAD, PUT, DELETE");
+        send_buffer(client_socket, response.str(Response::NOT_ALLOWED));
     }
 
-    int m_server_sock;
+    Listener m_listener;
     unsigned short m_server_port;
-    int m_backlog;
+    std::string m_unix_path;
     std::string m_www_root;
+    std::vector<std::pair<std::function<void()>, std::chrono::milliseconds>> m_tasks;
+    static inline volatile sig_atomic_t s_stopping = 0;
+    static inline volatile sig_atomic_t s_reloading = 0;
+    uint64_t m_drain_deadline;  // 0 until the server drains
+    Metrics m_metrics;
+    RequestRecord m_record;
+    std::unique_ptr<AccessLog> m_access_log;
+    RequestTrace m_trace;
+    std::unique_ptr<SlowLog> m_slow_log;
+    Compression m_compression;
+    FileSend m_file_send;
+    ZeroCopy m_zerocopy;
+
+    static constexpr size_t MAX_WORKERS = 1024;
+    static constexpr size_t MAX_HEADER_BYTES = 64 * 1024;
+    static constexpr uint64_t TIMER_TICK_MS = 10;
+    static constexpr uint64_t CHECK_INTERVAL_MS = 1000;
+    static constexpr uint64_t KILL_GRACE_MS = 1000;
+
+    // connection timeouts and limits, kept by the parent
+    Timeouts m_timeouts;
+    Limits m_limits;
+    Admission m_admission;
+    WorkerTable m_workers;
+    TimerWheel m_wheel;
+    std::vector<Timer> m_timers;
+    std::vector<bool> m_signalled;
+    std::unordered_map<pid_t, size_t> m_worker_slots;
+    std::unique_ptr<TlsContext> m_tls;
+    bool m_http2;
+
+    // state of the connection in a worker
+    Arena m_arena;
+    GzipWriter m_gzip;
+    ZeroCopyConnection m_zerocopy_connection;
+    size_t m_slot;
+    int m_input;
+    Http2Connection *m_h2;
+    std::string m_pending;
+    long m_body_remaining;
+    bool m_chunked;
+    static inline volatile sig_atomic_t s_timed_out = 0;
 };
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <stdexcept>
+#include <new>
+
+#include <sys/mman.h>
+
+/**
+ *  Counting Bloom filter of the stored bucket/key names
+ *
+ *  Lives in a shared anonymous mapping created before the
+ *  server forks, so every worker process sees the same filter.
+ *  A miss means the object definitely does not exist.
+ *  Counters saturate at 255 and are then never decremented.
+ *  Until every stored key has been added misses are not trusted and
+ *  removals are not counted, the key may never have been added.
+ */
+class KeyFilter
+{
+public:
+    KeyFilter(size_t slots, unsigned int hashes = 4) : m_slots(slots), m_hashes(hashes), m_shared(nullptr), m_counters(nullptr)
+    {
+        size_t size = sizeof(Shared) + m_slots;
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Key Filter");
+
+        m_shared = new (mem) Shared();
+        m_counters = reinterpret_cast<std::atomic<uint8_t> *>(static_cast<char *>(mem) + sizeof(Shared));
+    }
+
+    ~KeyFilter()
+    {
+        munmap(m_shared, sizeof(Shared) + m_slots);
+    }
+
+    KeyFilter(const KeyFilter &) = delete;
+    KeyFilter &operator=(const KeyFilter &) = delete;
+
+    void add(std::string_view bucket, std::string_view key)
+    {
+        uint64_t h1, h2;
+        hash(bucket, key, h1, h2);
+        for (unsigned int i = 0; i < m_hashes; i++)
+        {
+            std::atomic<uint8_t> &counter = m_counters[(h1 + i * h2) % m_slots];
+            uint8_t value = counter.load(std::memory_order_relaxed);
+            while (value < UINT8_MAX && !counter.compare_exchange_weak(value, value + 1, std::memory_order_relaxed))
+                ;
+        }
+    }
+
+    void remove(std::string_view bucket, std::string_view key)
+    {
+        if (!loaded())
+            return;
+
+        uint64_t h1, h2;
+        hash(bucket, key, h1, h2);
+        for (unsigned int i = 0; i < m_hashes; i++)
+        {
+            std::atomic<uint8_t> &counter = m_counters[(h1 + i * h2) % m_slots];
+            uint8_t value = counter.load(std::memory_order_relaxed);
+            while (value > 0 && value < UINT8_MAX && !counter.compare_exchange_weak(value, value - 1, std::memory_order_relaxed))
+                ;
+        }
+    }
+
+    /**
+     *  Every stored key has been added
+     *
+     */
+    inline void setLoaded() { m_shared->loaded.store(true, std::memory_order_release); }
+    inline bool loaded() const { return m_shared->loaded.load(std::memory_order_acquire); }
+
+    /**
+     *  false if the object is definitely not stored
+     *
+     */
+    bool mayContain(std::string_view bucket, std::string_view key)
+    {
+        m_shared->lookups.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t h1, h2;
+        hash(bucket, key, h1, h2);
+        for (unsigned int i = 0; i < m_hashes; i++)
+        {
+            if (m_counters[(h1 + i * h2) % m_slots].load(std::memory_order_relaxed) == 0)
+            {
+                m_shared->misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     *  Record a lookup which passed the filter but was not found
+     *
+     */
+    inline void falsePositive()
+    {
+        m_shared->false_positives.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline uint64_t lookups() const { return m_shared->lookups.load(std::memory_order_relaxed); }
+    inline uint64_t misses() const { return m_shared->misses.load(std::memory_order_relaxed); }
+    inline uint64_t falsePositives() const { return m_shared->false_positives.load(std::memory_order_relaxed); }
+
+    /**
+     *  False positives as a fraction of the keys which were not stored
+     *
+     */
+    double falsePositiveRate() const
+    {
+        uint64_t negatives = misses() + falsePositives();
+        return negatives == 0 ? 0.0 : double(falsePositives()) / double(negatives);
+    }
+
+private:
+    struct Shared
+    {
+        std::atomic<uint64_t> lookups{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> false_positives{0};
+        std::atomic<bool> loaded{false};
+    };
+
+    /**
+     *  Two independent FNV-1a hashes for double hashing
+     *
+     */
+    static void hash(std::string_view bucket, std::string_view key, uint64_t &h1, uint64_t &h2)
+    {
+        h1 = 14695981039346656037ULL;
+        h2 = 0x9ae16a3b2f90404fULL;
+        auto mix = [&](unsigned char c)
+        {
+            h1 = (h1 ^ c) * 1099511628211ULL;
+            h2 = (h2 ^ c) * 0x100000001b3ULL + 0x7f4a7c15ULL;
+        };
+        for (unsigned char c : bucket)
+            mix(c);
+        mix('/');
+        for (unsigned char c : key)
+            mix(c);
+        h2 |= 1;
+    }
+
+    size_t m_slots;
+    unsigned int m_hashes;
+    Shared *m_shared;
+    std::atomic<uint8_t> *m_counters;
+};
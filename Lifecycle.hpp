@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <new>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <boost/log/trivial.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include "StorageRoots.hpp"
+#include "DirScanner.hpp"
+
+/**
+ *  One rule of a bucket lifecycle, for the keys starting with prefix
+ *
+ *  A day count of 0 means the rule does not take that action.
+ */
+struct LifecycleRule
+{
+    std::string prefix;
+    uint32_t expire_days = 0;  // objects not written for this long are removed
+    uint32_t abort_days = 0;   // uploads not written to for this long are removed
+};
+
+/**
+ *  Expires objects by the lifecycle rules of their buckets
+ *
+ *  The rules are kept as the S3 LifecycleConfiguration XML they were
+ *  put with, in a hidden file in the bucket. A background sweeper
+ *  walks the buckets with rules a batch of entries at a time, from a
+ *  cursor of bucket, root and directory offset which is kept on disk,
+ *  so a pass over a large bucket carries on across runs and restarts.
+ *  Objects are removed through the server, which keeps its filters,
+ *  caches and counters right, at a limited rate. Uploads which have
+ *  stalled, hidden files a PUT writes before renaming them over the
+ *  object, are removed by the sweeper itself.
+ */
+class Lifecycle
+{
+public:
+    static constexpr const char *RULES_FILE = ".lifecycle";
+    static constexpr const char *CURSOR_FILE = ".lifecycle-cursor";
+    static constexpr size_t MAX_RULES = 1000;  // as S3
+    static constexpr size_t SWEEP_BATCH = 32768;  // entries looked at a run
+    static constexpr time_t DAY = 24 * 60 * 60;
+
+    // remove an object of bucket with key at path if not written since before
+    typedef std::function<bool(const std::string &bucket, std::string_view key, const std::string &path, time_t before)> Expire;
+
+    Lifecycle(const StorageRoots &roots, unsigned int rate) : m_roots(roots), m_rate(std::max(rate, 1u)), m_cursor(), m_loaded(false), m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Lifecycle");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~Lifecycle()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    Lifecycle(const Lifecycle &) = delete;
+    Lifecycle &operator=(const Lifecycle &) = delete;
+
+    /**
+     *  Read the rules of a LifecycleConfiguration
+     *
+     *  Disabled rules are left out. Returns false with the reason in
+     *  error if the document is not one.
+     */
+    static bool parse(const std::string &xml, std::vector<LifecycleRule> &rules, std::string &error)
+    {
+        namespace pt = boost::property_tree;
+
+        pt::ptree tree;
+        try
+        {
+            std::istringstream in(xml);
+            pt::read_xml(in, tree, pt::xml_parser::trim_whitespace);
+        }
+        catch (const pt::xml_parser_error &e)
+        {
+            error = e.message();
+            return false;
+        }
+
+        auto config = tree.get_child_optional("LifecycleConfiguration");
+        if (!config)
+        {
+            error = "Not A LifecycleConfiguration";
+            return false;
+        }
+
+        rules.clear();
+        size_t count = 0;
+        for (auto &child : *config)
+        {
+            if (child.first != "Rule")
+                continue;
+            if (++count > MAX_RULES)
+            {
+                error = "Too Many Rules";
+                return false;
+            }
+
+            const pt::ptree &rule = child.second;
+            std::string status = rule.get<std::string>("Status", "");
+            if ((status != "Enabled") && (status != "Disabled"))
+            {
+                error = "Status Must Be Enabled Or Disabled";
+                return false;
+            }
+
+            LifecycleRule parsed;
+            parsed.prefix = rule.get<std::string>("Filter.Prefix", rule.get<std::string>("Prefix", ""));
+            try
+            {
+                parsed.expire_days = rule.get<uint32_t>("Expiration.Days", 0);
+                parsed.abort_days = rule.get<uint32_t>("AbortIncompleteMultipartUpload.DaysAfterInitiation", 0);
+            }
+            catch (const pt::ptree_bad_data &)
+            {
+                error = "Days Must Be A Positive Integer";
+                return false;
+            }
+            if ((parsed.expire_days == 0) && (parsed.abort_days == 0))
+            {
+                error = "Rule Without Expiration Days";
+                return false;
+            }
+
+            if (status == "Enabled")
+                rules.push_back(std::move(parsed));
+        }
+        if (count == 0)
+        {
+            error = "No Rules";
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     *  The rules put on a bucket, empty if there are none
+     *
+     */
+    static std::vector<LifecycleRule> rules(const std::filesystem::path &bucket_path)
+    {
+        std::vector<LifecycleRule> rules;
+        std::string xml, error;
+        if (read(bucket_path, xml) && !parse(xml, rules, error))
+            BOOST_LOG_TRIVIAL(error) << "Bad Lifecycle Rules: " << bucket_path << ": " << error;
+        return rules;
+    }
+
+    /**
+     *  The configuration of a bucket as it was put
+     *
+     */
+    static bool read(const std::filesystem::path &bucket_path, std::string &xml)
+    {
+        std::ifstream in(bucket_path / RULES_FILE, std::ios::binary);
+        if (!in)
+            return false;
+        xml.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    /**
+     *  Write the configuration of a bucket, after parse() has accepted it
+     *
+     */
+    static bool save(const std::filesystem::path &bucket_path, std::string_view xml)
+    {
+        std::filesystem::path path = bucket_path / RULES_FILE;
+        std::string tmp = path.string() + "." + std::to_string(getpid());
+        {
+            std::ofstream out(tmp, std::ios::trunc | std::ios::binary);
+            out.write(xml.data(), xml.size());
+            if (!out.flush())
+            {
+                unlink(tmp.c_str());
+                return false;
+            }
+        }
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    static bool remove(const std::filesystem::path &bucket_path)
+    {
+        return unlink((bucket_path / RULES_FILE).c_str()) == 0;
+    }
+
+    /**
+     *  Put the calling process in the idle I/O class, so its reads
+     *  and writes only go to the disks when nothing else wants them
+     *
+     *  Only schedulers with I/O classes, BFQ and CFQ, honour it.
+     */
+    static bool idle()
+    {
+        constexpr int IOPRIO_WHO_PROCESS = 1;
+        constexpr int IOPRIO_CLASS_IDLE = 3;
+        constexpr int IOPRIO_CLASS_SHIFT = 13;
+        return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0;
+    }
+
+    /**
+     *  Look at the next batch of entries, run by a background task
+     *
+     *  Objects are handed to expire no faster than the rate.
+     */
+    void sweep(const Expire &expire)
+    {
+        if (!m_loaded)
+        {
+            loadCursor();
+            m_loaded = true;
+        }
+
+        std::vector<std::string> buckets;
+        for (const auto &entry : std::filesystem::directory_iterator(m_roots.primary()))
+        {
+            if (entry.is_directory() && !StorageRoots::isHidden(entry.path()))
+                buckets.push_back(entry.path().filename());
+        }
+        std::sort(buckets.begin(), buckets.end());
+
+        // a bucket removed under the cursor is passed over
+        auto bucket = std::lower_bound(buckets.begin(), buckets.end(), m_cursor.bucket);
+        if ((bucket == buckets.end()) || (*bucket != m_cursor.bucket))
+            m_cursor.moveTo(bucket == buckets.end() ? "" : *bucket);
+
+        size_t budget = SWEEP_BATCH;
+        time_t now = time(nullptr);
+        while ((budget > 0) && (bucket != buckets.end()))
+        {
+            std::vector<LifecycleRule> rules = Lifecycle::rules(m_roots.primary() / *bucket);
+            std::vector<std::filesystem::path> bucket_paths = m_roots.bucketPaths(*bucket);
+            while (!rules.empty() && (budget > 0) && (m_cursor.root < bucket_paths.size()))
+            {
+                if (scan(*bucket, bucket_paths[m_cursor.root], rules, now, budget, expire))
+                {
+                    m_cursor.root++;
+                    m_cursor.offset = 0;
+                }
+            }
+            if (rules.empty() || (m_cursor.root >= bucket_paths.size()))
+            {
+                ++bucket;
+                m_cursor.moveTo(bucket == buckets.end() ? "" : *bucket);
+            }
+        }
+
+        if (bucket == buckets.end())
+            m_shared->passes.fetch_add(1, std::memory_order_relaxed);
+        saveCursor();
+    }
+
+    void write(std::ostream &out) const
+    {
+        out << "# HELP lifecycle_scanned_total Entries the lifecycle sweeper looked at.\n";
+        out << "# TYPE lifecycle_scanned_total counter\n";
+        out << "lifecycle_scanned_total " << m_shared->scanned.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP lifecycle_expired_total Objects removed by lifecycle rules.\n";
+        out << "# TYPE lifecycle_expired_total counter\n";
+        out << "lifecycle_expired_total " << m_shared->expired.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP lifecycle_expired_bytes_total Bytes of the objects removed by lifecycle rules.\n";
+        out << "# TYPE lifecycle_expired_bytes_total counter\n";
+        out << "lifecycle_expired_bytes_total " << m_shared->expired_bytes.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP lifecycle_aborted_total Stalled uploads removed by lifecycle rules.\n";
+        out << "# TYPE lifecycle_aborted_total counter\n";
+        out << "lifecycle_aborted_total " << m_shared->aborted.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP lifecycle_passes_total Sweeps over every bucket completed.\n";
+        out << "# TYPE lifecycle_passes_total counter\n";
+        out << "lifecycle_passes_total " << m_shared->passes.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    struct Cursor
+    {
+        std::string bucket;
+        size_t root = 0;
+        int64_t offset = 0;  // DirScanner::offset() in the bucket on that root
+
+        void moveTo(const std::string &next)
+        {
+            bucket = next;
+            root = 0;
+            offset = 0;
+        }
+    };
+
+    struct Shared
+    {
+        std::atomic<uint64_t> scanned{0};
+        std::atomic<uint64_t> expired{0};
+        std::atomic<uint64_t> expired_bytes{0};
+        std::atomic<uint64_t> aborted{0};
+        std::atomic<uint64_t> passes{0};
+    };
+
+    /**
+     *  Look at the entries of a bucket on one root from the cursor
+     *
+     *  Returns true at the end of the directory, false when the
+     *  budget ran out first.
+     */
+    bool scan(const std::string &bucket, const std::filesystem::path &bucket_path, const std::vector<LifecycleRule> &rules, time_t now, size_t &budget, const Expire &expire)
+    {
+        DirScanner scanner(bucket_path.c_str());
+        if (!scanner.opened())
+            return true;
+        if ((m_cursor.offset != 0) && !scanner.seek(m_cursor.offset))
+            m_cursor.offset = 0;
+
+        char key[PATH_MAX];
+        DirScanner::Entry entry;
+        while (budget > 0)
+        {
+            if (!scanner.next(entry))
+                return true;
+            budget--;
+            m_cursor.offset = scanner.offset();
+            m_shared->scanned.fetch_add(1, std::memory_order_relaxed);
+
+            struct statx details;
+            bool upload = uploading(entry.name);
+            if ((entry.name[0] == '.') && !upload)
+                continue;
+            if (!scanner.stat(entry.name, STATX_TYPE | STATX_MTIME | STATX_SIZE, details) || !S_ISREG(details.stx_mode))
+                continue;
+
+            // a PUT sets the key on its upload once the body is in
+            ssize_t length = scanner.attribute(entry.name, XATT_KEY_NAME, key, sizeof(key));
+            std::string_view name = (length >= 0) ? std::string_view(key, length) : std::string_view();
+            uint32_t days = upload ? abortDays(rules, name, length >= 0) : expireDays(rules, name);
+            if ((days == 0) || (now - details.stx_mtime.tv_sec < time_t(days) * DAY))
+                continue;
+
+            time_t before = now - time_t(days) * DAY;
+            if (upload)
+            {
+                if (unlinkat(scanner.fd(), entry.name, 0) == 0)
+                {
+                    m_shared->aborted.fetch_add(1, std::memory_order_relaxed);
+                    BOOST_LOG_TRIVIAL(info) << "Lifecycle Aborted Upload: " << bucket << "/" << entry.name;
+                }
+            }
+            else if ((length >= 0) && expire(bucket, name, (bucket_path / entry.name).string(), before))
+            {
+                m_shared->expired.fetch_add(1, std::memory_order_relaxed);
+                m_shared->expired_bytes.fetch_add(details.stx_size, std::memory_order_relaxed);
+            }
+            else
+                continue;
+
+            // only removals are paced, looking is cheap at idle priority
+            usleep(1000000 / m_rate);
+        }
+        return false;
+    }
+
+    // the hidden file of a PUT in progress, .<hash>.<pid>, not a variant .<hash>.gz or its .<hash>.gz.<pid>
+    static bool uploading(const char *name)
+    {
+        size_t length = strlen(name);
+        return (length > 42) && (name[0] == '.') && (name[41] == '.') && (strspn(name + 1, "0123456789abcdef") == 40) &&
+               (strspn(name + 42, "0123456789") == length - 42);
+    }
+
+    // the soonest expiry of the rules for the key, 0 for none
+    static uint32_t expireDays(const std::vector<LifecycleRule> &rules, std::string_view key)
+    {
+        uint32_t days = 0;
+        for (auto &rule : rules)
+        {
+            if ((rule.expire_days > 0) && (key.compare(0, rule.prefix.size(), rule.prefix) == 0))
+                days = (days == 0) ? rule.expire_days : std::min(days, rule.expire_days);
+        }
+        return days;
+    }
+
+    // without the key of the upload only the most lenient rule is safe
+    static uint32_t abortDays(const std::vector<LifecycleRule> &rules, std::string_view key, bool known)
+    {
+        uint32_t days = 0;
+        for (auto &rule : rules)
+        {
+            if (rule.abort_days == 0)
+                continue;
+            if (!known)
+                days = std::max(days, rule.abort_days);
+            else if (key.compare(0, rule.prefix.size(), rule.prefix) == 0)
+                days = (days == 0) ? rule.abort_days : std::min(days, rule.abort_days);
+        }
+        return days;
+    }
+
+    void loadCursor()
+    {
+        std::ifstream in(m_roots.primary() / CURSOR_FILE);
+        Cursor cursor;
+        if (std::getline(in, cursor.bucket) && (in >> cursor.root >> cursor.offset))
+            m_cursor = cursor;
+    }
+
+    void saveCursor()
+    {
+        std::filesystem::path path = m_roots.primary() / CURSOR_FILE;
+        std::string tmp = path.string() + "." + std::to_string(getpid());
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << m_cursor.bucket << "\n"
+                << m_cursor.root << " " << m_cursor.offset << "\n";
+            if (!out.flush())
+            {
+                unlink(tmp.c_str());
+                return;
+            }
+        }
+        rename(tmp.c_str(), path.c_str());
+    }
+
+    static constexpr const char *XATT_KEY_NAME = "user.S3.Key";  // PathDetails::XATT_KEY_NAME
+
+    const StorageRoots &m_roots;
+    unsigned int m_rate;  // objects removed a second at most
+    Cursor m_cursor;
+    bool m_loaded;
+    Shared *m_shared;
+};
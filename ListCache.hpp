@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory_resource>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <new>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ *  Cache of generated bucket and object listings
+ *
+ *  A listing is kept under its bucket and query with the generation
+ *  of the bucket it was read at. Every change to a bucket bumps its
+ *  generation, so a listing of a bucket which has changed since is
+ *  never found again. The empty bucket name stands for the list of
+ *  buckets. Lives in a shared anonymous mapping created before the
+ *  server forks, like the KeyFilter, each entry is a seqlock so a
+ *  reader never takes a listing which is being replaced. The writer's
+ *  pid is kept with the sequence, so an entry left odd by a worker
+ *  killed while storing is taken over rather than lost.
+ */
+class ListCache
+{
+public:
+    static constexpr size_t ENTRIES = 32;
+    static constexpr size_t KEY_SIZE = 1024;
+    static constexpr size_t MAX_SIZE = 1 << 20;  // larger listings are always generated
+    static constexpr size_t GENERATION_SLOTS = 4096;
+    static constexpr uint64_t MAX_AGE_SECONDS = 60;  // also catches changes made behind the server's back
+
+    ListCache() : m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map List Cache");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~ListCache()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    ListCache(const ListCache &) = delete;
+    ListCache &operator=(const ListCache &) = delete;
+
+    /**
+     *  The generation of a bucket, read before it is listed
+     *
+     */
+    inline uint64_t generation(std::string_view bucket) const
+    {
+        return counter(bucket).load(std::memory_order_acquire);
+    }
+
+    /**
+     *  Invalidate the listings of a bucket, once the change is made
+     *
+     */
+    inline void changed(std::string_view bucket)
+    {
+        counter(bucket).fetch_add(1, std::memory_order_acq_rel);
+        m_shared->invalidations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Copy the listing stored under key at generation into listing
+     *
+     */
+    bool find(std::string_view key, uint64_t generation, std::pmr::string &listing)
+    {
+        Entry &entry = m_shared->entries[hash(key) % ENTRIES];
+        uint32_t sequence = uint32_t(entry.sequence.load(std::memory_order_acquire));
+
+        // sizes are clamped, a torn read is thrown away below
+        bool found = !(sequence & 1) && (entry.generation == generation) && (uint64_t(time(nullptr)) - entry.stored < MAX_AGE_SECONDS) &&
+                     (std::string_view(entry.key, std::min<size_t>(entry.key_size, KEY_SIZE)) == key);
+        if (found)
+            listing.assign(entry.listing, std::min<size_t>(entry.size, MAX_SIZE));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        found = found && (uint32_t(entry.sequence.load(std::memory_order_relaxed)) == sequence);
+
+        (found ? m_shared->hits : m_shared->misses).fetch_add(1, std::memory_order_relaxed);
+        return found;
+    }
+
+    /**
+     *  Keep a listing read at generation, replacing whatever shares its entry
+     *
+     */
+    void store(std::string_view key, uint64_t generation, std::string_view listing)
+    {
+        if ((key.size() > KEY_SIZE) || (listing.size() > MAX_SIZE))
+        {
+            m_shared->too_large.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // skipped while another worker writes the entry, taken over from one which died
+        Entry &entry = m_shared->entries[hash(key) % ENTRIES];
+        uint64_t word = entry.sequence.load(std::memory_order_relaxed);
+        uint32_t sequence = uint32_t(word);
+        if ((sequence & 1) && !writerDied(word))
+            return;
+        sequence += (sequence & 1) ? 1 : 0;
+        if (!entry.sequence.compare_exchange_strong(word, claim(sequence + 1), std::memory_order_acquire))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+
+        entry.generation = generation;
+        entry.stored = uint64_t(time(nullptr));
+        entry.key_size = key.size();
+        memcpy(entry.key, key.data(), key.size());
+        entry.size = listing.size();
+        memcpy(entry.listing, listing.data(), listing.size());
+
+        entry.sequence.store(sequence + 2, std::memory_order_release);
+        m_shared->stores.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        out << "# HELP list_cache_hits_total Listings served from the cache.\n";
+        out << "# TYPE list_cache_hits_total counter\n";
+        out << "list_cache_hits_total " << m_shared->hits.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP list_cache_misses_total Listings generated from the buckets.\n";
+        out << "# TYPE list_cache_misses_total counter\n";
+        out << "list_cache_misses_total " << m_shared->misses.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP list_cache_stores_total Listings stored in the cache.\n";
+        out << "# TYPE list_cache_stores_total counter\n";
+        out << "list_cache_stores_total " << m_shared->stores.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP list_cache_too_large_total Listings too large to cache.\n";
+        out << "# TYPE list_cache_too_large_total counter\n";
+        out << "list_cache_too_large_total " << m_shared->too_large.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP list_cache_invalidations_total Bucket changes which invalidated cached listings.\n";
+        out << "# TYPE list_cache_invalidations_total counter\n";
+        out << "list_cache_invalidations_total " << m_shared->invalidations.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    struct alignas(64) Entry
+    {
+        std::atomic<uint64_t> sequence{0};  // odd while the entry is written, the writer's pid above
+        uint32_t key_size = 0;
+        uint32_t size = 0;
+        uint64_t generation = 0;
+        uint64_t stored = 0;
+        char key[KEY_SIZE];
+        char listing[MAX_SIZE];
+    };
+
+    struct Shared
+    {
+        Entry entries[ENTRIES];
+        std::atomic<uint64_t> generations[GENERATION_SLOTS]{};
+        std::atomic<uint64_t> buckets{0};
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> stores{0};
+        std::atomic<uint64_t> too_large{0};
+        std::atomic<uint64_t> invalidations{0};
+    };
+
+    static uint64_t hash(std::string_view text)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : text)
+            h = (h ^ c) * 1099511628211ULL;
+        return h;
+    }
+
+    static inline uint64_t claim(uint32_t sequence)
+    {
+        return (uint64_t(uint32_t(getpid())) << 32) | sequence;
+    }
+
+    static inline bool writerDied(uint64_t word)
+    {
+        pid_t pid = pid_t(word >> 32);
+        return (pid > 0) && (kill(pid, 0) != 0) && (errno == ESRCH);
+    }
+
+    // buckets sharing a slot only invalidate each other more often
+    inline std::atomic<uint64_t> &counter(std::string_view bucket) const
+    {
+        return bucket.empty() ? m_shared->buckets : m_shared->generations[hash(bucket) % GENERATION_SLOTS];
+    }
+
+    Shared *m_shared;
+};
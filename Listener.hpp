@@ -0,0 +1,557 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <new>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+/**
+ *  How the server socket listens and accepts
+ *
+ */
+struct ListenOptions
+{
+    int backlog = 1024;              // accept queue, capped by net.core.somaxconn
+    int defer_accept = 1;            // seconds a connection may wait for its first data unaccepted, 0 off
+    int fastopen = 0;                // TCP Fast Open queue, 0 off as a SYN's data may be replayed
+    int receive_buffer = 0;          // SO_RCVBUF of accepted sockets, 0 the kernel default
+    int send_buffer = 0;             // SO_SNDBUF of accepted sockets, 0 the kernel default
+    unsigned int accept_batch = 64;  // connections accepted per wakeup at most
+};
+
+/**
+ *  The server sockets
+ *
+ *  The TCP socket is bound dual stack to the IPv6 any address, IPv4
+ *  clients show as mapped addresses, or to the IPv4 one where there
+ *  is no IPv6. A Unix domain socket may listen alongside it or on its
+ *  own for clients on the same host. The sockets are non-blocking so
+ *  each wakeup accepts what is queued until it is empty.
+ *  A restart hands the sockets to the new server process, which
+ *  starts accepting on them while the old one drains, so no
+ *  connection is refused. Created in the parent before it forks, the
+ *  accept counters live in a shared anonymous mapping like the
+ *  Metrics.
+ */
+class Listener
+{
+public:
+    enum class TRANSPORT
+    {
+        TCP,
+        UNIX,
+        COUNT
+    };
+
+    enum class ERROR
+    {
+        ABORTED,   // the client went before it was accepted
+        FD_LIMIT,  // out of file descriptors
+        OTHER,
+        COUNT
+    };
+
+    Listener() : m_fds{-1, -1}, m_path(), m_owner(0), m_predecessor(-1), m_options(), m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Listener Counters");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~Listener()
+    {
+        close();
+        if (m_predecessor >= 0)
+            ::close(m_predecessor);
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    Listener(const Listener &) = delete;
+    Listener &operator=(const Listener &) = delete;
+
+    inline int fd(TRANSPORT transport = TRANSPORT::TCP) const { return m_fds[size_t(transport)]; }
+    inline const ListenOptions &options() const { return m_options; }
+    inline void setOptions(const ListenOptions &options) { m_options = options; }
+
+    /**
+     *  Take over the sockets handed down by handOver()
+     *
+     *  Follows the systemd convention, so socket activation works
+     *  too: LISTEN_PID is this process and LISTEN_FDS sockets start at
+     *  fd 3, named by LISTEN_FDNAMES. Returns false if there are none.
+     *  From handOver() LISTEN_PREDECESSOR_FD is a pidfd of the server
+     *  which handed them over.
+     */
+    bool inherit()
+    {
+        const char *pid = getenv("LISTEN_PID");
+        const char *fds = getenv("LISTEN_FDS");
+        if ((pid == nullptr) || (fds == nullptr) || (atol(pid) != getpid()))
+            return false;
+
+        std::string names = getenv("LISTEN_FDNAMES") ? getenv("LISTEN_FDNAMES") : "";
+        int count = atoi(fds);
+        for (int i = 0; i < count; i++)
+        {
+            int sock = LISTEN_FDS_START + i;
+            fcntl(sock, F_SETFD, FD_CLOEXEC);
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+            // unnamed sockets are told apart by their family
+            std::string label = names.substr(0, names.find(':'));
+            names.erase(0, std::min(names.size(), label.size() + 1));
+            struct sockaddr_un address{};
+            socklen_t length = sizeof(address);
+            getsockname(sock, (struct sockaddr *)&address, &length);
+            if (label.empty())
+                label = name((address.sun_family == AF_UNIX) ? TRANSPORT::UNIX : TRANSPORT::TCP);
+
+            TRANSPORT transport = (label == name(TRANSPORT::UNIX)) ? TRANSPORT::UNIX : TRANSPORT::TCP;
+            if (m_fds[size_t(transport)] >= 0)
+            {
+                ::close(sock);
+                continue;
+            }
+            m_fds[size_t(transport)] = sock;
+
+            if ((transport == TRANSPORT::UNIX) && (address.sun_path[0] != '\0'))
+            {
+                m_path = address.sun_path;
+                m_owner = getpid();
+            }
+        }
+
+        const char *predecessor = getenv("LISTEN_PREDECESSOR_FD");
+        if (predecessor != nullptr)
+        {
+            m_predecessor = atoi(predecessor);
+            fcntl(m_predecessor, F_SETFD, FD_CLOEXEC);
+        }
+
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+        unsetenv("LISTEN_PREDECESSOR_FD");
+        return true;
+    }
+
+    /**
+     *  Start a new server process with the same command line and hand
+     *  it the sockets
+     *
+     *  Returns a pipe which has a byte once the new process accepts,
+     *  and is closed without one if it did not start, -1 on failure.
+     */
+    int handOver()
+    {
+        std::string line;
+        {
+            std::ifstream cmdline("/proc/self/cmdline", std::ios::binary);
+            line.assign(std::istreambuf_iterator<char>(cmdline), std::istreambuf_iterator<char>());
+        }
+        std::vector<char *> argv;
+        for (size_t start = 0; start < line.size(); start = line.find('\0', start) + 1)
+            argv.push_back(&line[start]);
+        argv.push_back(nullptr);
+
+        int ready[2];
+        if ((argv.size() < 2) || (pipe2(ready, O_CLOEXEC) != 0))
+            return -1;
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // move everything above where the sockets go first, then into place
+            std::string names;
+            int count = 0;
+            int moved[size_t(TRANSPORT::COUNT)];
+            int notify = fcntl(ready[1], F_DUPFD, LISTEN_FDS_START + int(TRANSPORT::COUNT) + 1);
+            int predecessor = syscall(SYS_pidfd_open, getppid(), 0);
+            if (predecessor >= 0)
+                predecessor = fcntl(predecessor, F_DUPFD, LISTEN_FDS_START + int(TRANSPORT::COUNT) + 1);
+            for (size_t i = 0; i < size_t(TRANSPORT::COUNT); i++)
+                moved[i] = (m_fds[i] >= 0) ? fcntl(m_fds[i], F_DUPFD_CLOEXEC, LISTEN_FDS_START + int(TRANSPORT::COUNT) + 2) : -1;
+            for (size_t i = 0; i < size_t(TRANSPORT::COUNT); i++)
+            {
+                if (moved[i] < 0)
+                    continue;
+                dup2(moved[i], LISTEN_FDS_START + count++);
+                names += (names.empty() ? "" : ":") + std::string(name(TRANSPORT(i)));
+            }
+
+            setenv("LISTEN_PID", std::to_string(getpid()).c_str(), 1);
+            setenv("LISTEN_FDS", std::to_string(count).c_str(), 1);
+            setenv("LISTEN_FDNAMES", names.c_str(), 1);
+            setenv("LISTEN_READY_FD", std::to_string(notify).c_str(), 1);
+            if (predecessor >= 0)
+                setenv("LISTEN_PREDECESSOR_FD", std::to_string(predecessor).c_str(), 1);
+
+            // the new server is not one of this server's workers
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            signal(SIGHUP, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+
+            // by name, so a deploy which replaced the binary runs the new one
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+
+        ::close(ready[1]);
+        if (pid < 0)
+        {
+            ::close(ready[0]);
+            return -1;
+        }
+        return ready[0];
+    }
+
+    /**
+     *  True until the server which handed over the sockets has exited
+     *
+     *  It drains after this one accepts, and the requests it finishes
+     *  may still change what is stored.
+     */
+    bool predecessorRunning()
+    {
+        if (m_predecessor < 0)
+            return false;
+
+        struct pollfd exited = {m_predecessor, POLLIN, 0};
+        if (poll(&exited, 1, 0) <= 0)
+            return true;
+        ::close(m_predecessor);
+        m_predecessor = -1;
+        return false;
+    }
+
+    /**
+     *  Tell the process which handed over the sockets that this one accepts
+     *
+     */
+    void ready()
+    {
+        const char *notify = getenv("LISTEN_READY_FD");
+        if (notify == nullptr)
+            return;
+
+        int fd = atoi(notify);
+        ssize_t written = ::write(fd, "R", 1);
+        (void)written;
+        ::close(fd);
+        unsetenv("LISTEN_READY_FD");
+    }
+
+    /**
+     *  Create the socket and bind it to port on every address
+     *
+     *  Returns false if it cannot be bound, with errno set.
+     */
+    bool bind(unsigned short port)
+    {
+        int &sock = m_fds[size_t(TRANSPORT::TCP)];
+        sock = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock >= 0)
+        {
+            int off = 0;
+            setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            reuse();
+
+            struct sockaddr_in6 address{};
+            address.sin6_family = AF_INET6;
+            address.sin6_port = htons(port);
+            address.sin6_addr = in6addr_any;
+            if (::bind(sock, (struct sockaddr *)&address, sizeof(address)) == 0)
+                return true;
+
+            ::close(sock);
+        }
+
+        // no IPv6 on this host
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+            return false;
+        reuse();
+
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        return ::bind(sock, (struct sockaddr *)&address, sizeof(address)) == 0;
+    }
+
+    /**
+     *  Create a Unix domain stream socket at path, replacing a stale one
+     *
+     *  The socket file is removed again when the listener is. Returns
+     *  false if it cannot be bound, with errno set.
+     */
+    bool bindUnix(const std::string &path)
+    {
+        struct sockaddr_un address{};
+        if (path.empty() || (path.size() >= sizeof(address.sun_path)))
+        {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.data(), path.size());
+
+        // only ever remove a socket, not a file which happens to have the name
+        struct stat details;
+        if ((lstat(path.c_str(), &details) == 0) && S_ISSOCK(details.st_mode))
+            unlink(path.c_str());
+
+        int &sock = m_fds[size_t(TRANSPORT::UNIX)];
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+            return false;
+
+        if (::bind(sock, (struct sockaddr *)&address, sizeof(address)) != 0)
+        {
+            ::close(sock);
+            sock = -1;
+            return false;
+        }
+
+        m_path = path;
+        m_owner = getpid();
+        return true;
+    }
+
+    /**
+     *  Stop listening on a transport
+     *
+     */
+    void close(TRANSPORT transport)
+    {
+        int &sock = m_fds[size_t(transport)];
+        if (sock >= 0)
+            ::close(sock);
+        sock = -1;
+
+        if (transport == TRANSPORT::UNIX)
+        {
+            if (!m_path.empty() && (m_owner == getpid()))
+                unlink(m_path.c_str());
+            m_path.clear();
+        }
+    }
+
+    void close()
+    {
+        close(TRANSPORT::TCP);
+        close(TRANSPORT::UNIX);
+    }
+
+    /**
+     *  Close the sockets in a forked child, the parent keeps listening
+     *
+     */
+    void detach()
+    {
+        for (int &sock : m_fds)
+        {
+            if (sock >= 0)
+                ::close(sock);
+            sock = -1;
+        }
+        m_path.clear();
+    }
+
+    /**
+     *  Apply the options and start listening
+     *
+     *  An option the kernel refuses is left at its default, only a
+     *  failed listen() returns false.
+     */
+    bool listen()
+    {
+        for (size_t i = 0; i < size_t(TRANSPORT::COUNT); i++)
+        {
+            int sock = m_fds[i];
+            if (sock < 0)
+                continue;
+
+            // accepted sockets inherit the buffer sizes, set before the handshake for the window scale
+            if (m_options.receive_buffer > 0)
+                setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &m_options.receive_buffer, sizeof(m_options.receive_buffer));
+            if (m_options.send_buffer > 0)
+                setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &m_options.send_buffer, sizeof(m_options.send_buffer));
+
+            if (TRANSPORT(i) == TRANSPORT::TCP)
+            {
+                if (m_options.defer_accept > 0)
+                    setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &m_options.defer_accept, sizeof(m_options.defer_accept));
+                if (m_options.fastopen > 0)
+                    setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &m_options.fastopen, sizeof(m_options.fastopen));
+            }
+
+            if (::listen(sock, m_options.backlog) != 0)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     *  Accept the next queued connection
+     *
+     *  Returns -1 with errno EAGAIN when the queue is empty, other
+     *  failures are counted.
+     */
+    int accept(TRANSPORT transport, struct sockaddr_storage &address)
+    {
+        socklen_t length = sizeof(address);
+        int client_socket = accept4(fd(transport), (struct sockaddr *)&address, &length, SOCK_CLOEXEC);
+        if (client_socket >= 0)
+        {
+            // a Unix socket client has no name of its own
+            if (transport == TRANSPORT::UNIX)
+                address.ss_family = AF_UNIX;
+            m_shared->accepted[size_t(transport)].fetch_add(1, std::memory_order_relaxed);
+            return client_socket;
+        }
+
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return -1;
+
+        ERROR error = ERROR::OTHER;
+        if ((errno == ECONNABORTED) || (errno == EPROTO))
+            error = ERROR::ABORTED;
+        else if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM))
+            error = ERROR::FD_LIMIT;
+        m_shared->errors[size_t(error)].fetch_add(1, std::memory_order_relaxed);
+        return -1;
+    }
+
+    /**
+     *  Count a wakeup which accepted count connections
+     *
+     */
+    void woken(unsigned int count)
+    {
+        m_shared->wakeups.fetch_add(1, std::memory_order_relaxed);
+        if (count >= m_options.accept_batch)
+            m_shared->full_batches.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Write the client's address, IPv4 mapped addresses as IPv4 and
+     *  Unix domain socket clients as unix
+     */
+    static const char *name(const struct sockaddr_storage &address, char *buffer, socklen_t size)
+    {
+        buffer[0] = '\0';
+        if (address.ss_family == AF_INET)
+            return inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in &>(address).sin_addr, buffer, size);
+
+        if (address.ss_family == AF_INET6)
+        {
+            const struct in6_addr &ip = reinterpret_cast<const struct sockaddr_in6 &>(address).sin6_addr;
+            if (IN6_IS_ADDR_V4MAPPED(&ip))
+                return inet_ntop(AF_INET, &ip.s6_addr[12], buffer, size);
+            return inet_ntop(AF_INET6, &ip, buffer, size);
+        }
+
+        if ((address.ss_family == AF_UNIX) && (size > 4))
+            memcpy(buffer, "unix", 5);
+        return buffer;
+    }
+
+    static inline const char *name(TRANSPORT transport)
+    {
+        return (transport == TRANSPORT::UNIX) ? "unix" : "tcp";
+    }
+
+    static inline const char *name(ERROR error)
+    {
+        switch (error)
+        {
+        case ERROR::ABORTED:
+            return "aborted";
+        case ERROR::FD_LIMIT:
+            return "fd_limit";
+        default:
+            return "other";
+        }
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        out << "# HELP http_listener_accepted_total Connections accepted by transport.\n";
+        out << "# TYPE http_listener_accepted_total counter\n";
+        for (size_t i = 0; i < size_t(TRANSPORT::COUNT); i++)
+            out << "http_listener_accepted_total{transport=\"" << name(TRANSPORT(i)) << "\"} " << m_shared->accepted[i].load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_listener_accept_errors_total Failed accepts by reason.\n";
+        out << "# TYPE http_listener_accept_errors_total counter\n";
+        for (size_t i = 0; i < size_t(ERROR::COUNT); i++)
+            out << "http_listener_accept_errors_total{reason=\"" << name(ERROR(i)) << "\"} " << m_shared->errors[i].load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_listener_wakeups_total Times the listener woke to accept.\n";
+        out << "# TYPE http_listener_wakeups_total counter\n";
+        out << "http_listener_wakeups_total " << m_shared->wakeups.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_listener_full_batches_total Wakeups which accepted a full batch and left the rest queued.\n";
+        out << "# TYPE http_listener_full_batches_total counter\n";
+        out << "http_listener_full_batches_total " << m_shared->full_batches.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_listener_backlog Length of the accept queue asked for.\n";
+        out << "# TYPE http_listener_backlog gauge\n";
+        out << "http_listener_backlog " << m_options.backlog << "\n";
+    }
+
+private:
+    void reuse()
+    {
+        int &sock = m_fds[size_t(TRANSPORT::TCP)];
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    }
+
+    struct Shared
+    {
+        std::atomic<uint64_t> accepted[size_t(TRANSPORT::COUNT)]{};
+        std::atomic<uint64_t> errors[size_t(ERROR::COUNT)]{};
+        std::atomic<uint64_t> wakeups{0};
+        std::atomic<uint64_t> full_batches{0};
+    };
+
+    static constexpr int LISTEN_FDS_START = 3;
+
+    int m_fds[size_t(TRANSPORT::COUNT)];
+    std::string m_path;
+    pid_t m_owner;  // the process which removes the socket file
+    int m_predecessor;  // pidfd of the server which handed over the sockets, -1 once it has exited
+    ListenOptions m_options;
+    Shared *m_shared;
+};
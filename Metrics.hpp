@@ -0,0 +1,304 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <new>
+#include <algorithm>
+#include <vector>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ *  What one request did, filled in by the worker
+ *  handling it and recorded when it completes.
+ *
+ */
+struct RequestRecord
+{
+    RequestRecord() : handler(0), status(0), bytes_in(0), bytes_out(0), start() {}
+
+    size_t handler;
+    int status;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    struct timespec start;
+
+    static inline struct timespec now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts;
+    }
+
+    inline uint64_t elapsed_us() const
+    {
+        return since_us(start);
+    }
+
+    static inline uint64_t since_us(const struct timespec &from)
+    {
+        struct timespec end = now();
+        return (end.tv_sec - from.tv_sec) * 1000000 + (end.tv_nsec - from.tv_nsec) / 1000;
+    }
+};
+
+/**
+ *  Request counters and latency histograms
+ *
+ *  Lives in a shared anonymous mapping created before the server
+ *  forks. Each worker process adds to its own cache line padded slot
+ *  with relaxed atomics, the slots are only summed when scraped.
+ */
+class Metrics
+{
+public:
+    static constexpr size_t WORKER_SLOTS = 64;
+    static constexpr size_t MAX_HANDLERS = 32;
+    static constexpr size_t HANDLER_NAME_LEN = 32;
+
+    // log-linear buckets, 4 per power of two microseconds
+    static constexpr size_t SUB_BUCKETS = 4;
+    static constexpr size_t LATENCY_BUCKETS = SUB_BUCKETS + 34 * SUB_BUCKETS;
+
+    static constexpr int STATUS_CODES[] = {100, 200, 201, 204, 206, 304, 400, 404, 405, 409, 412, 500, 503};
+    static constexpr size_t STATUS_SLOTS = sizeof(STATUS_CODES) / sizeof(STATUS_CODES[0]) + 1;
+
+    Metrics() : m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Metrics");
+
+        m_shared = new (mem) Shared();
+        handler("OTHER");
+    }
+
+    ~Metrics()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    /**
+     *  Return the index of a handler, registering it on first use.
+     *
+     *  Names are claimed in order, so a worker registering the same
+     *  handler at the same time waits for the slot it lost to be named
+     *  and finds its handler there. Once the table is full, or if the
+     *  worker naming a slot died, new handlers are counted as OTHER.
+     */
+    size_t handler(const char *name)
+    {
+        for (size_t i = 0; i < MAX_HANDLERS; i++)
+        {
+            HandlerName &slot = m_shared->names[i];
+            bool claimed = slot.claimed.load(std::memory_order_acquire);
+            if (!claimed && slot.claimed.compare_exchange_strong(claimed, true, std::memory_order_acq_rel))
+            {
+                strncpy(slot.name, name, HANDLER_NAME_LEN - 1);
+                slot.ready.store(true, std::memory_order_release);
+                size_t count = m_shared->handler_count.load(std::memory_order_relaxed);
+                while ((count < i + 1) && !m_shared->handler_count.compare_exchange_weak(count, i + 1, std::memory_order_release))
+                    ;
+                return i;
+            }
+
+            for (unsigned int spin = 0; !slot.ready.load(std::memory_order_acquire); spin++)
+            {
+                if (spin == NAME_WAIT_SPINS)
+                    return 0;
+                sched_yield();
+            }
+            if (strncmp(slot.name, name, HANDLER_NAME_LEN - 1) == 0)
+                return i;
+        }
+        return 0;
+    }
+
+    /**
+     *  Add a completed request to this worker's slot
+     *
+     */
+    void record(const RequestRecord &request)
+    {
+        HandlerCounters &counters = m_shared->slots[getpid() % WORKER_SLOTS].handlers[request.handler % MAX_HANDLERS];
+        uint64_t latency = request.elapsed_us();
+
+        counters.requests.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes_in.fetch_add(request.bytes_in, std::memory_order_relaxed);
+        counters.bytes_out.fetch_add(request.bytes_out, std::memory_order_relaxed);
+        counters.latency_sum_us.fetch_add(latency, std::memory_order_relaxed);
+        counters.status[statusSlot(request.status)].fetch_add(1, std::memory_order_relaxed);
+        counters.latency[latencyBucket(latency)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Write the summed counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        size_t count = std::min(m_shared->handler_count.load(std::memory_order_acquire), MAX_HANDLERS);
+
+        std::vector<std::pair<std::string, HandlerTotals>> handlers;
+        for (size_t h = 0; h < count; h++)
+        {
+            if (!m_shared->names[h].ready.load(std::memory_order_acquire))
+                continue;
+
+            HandlerTotals totals;
+            for (size_t s = 0; s < WORKER_SLOTS; s++)
+                totals.add(m_shared->slots[s].handlers[h]);
+
+            if (totals.requests > 0)
+                handlers.emplace_back(std::string("handler=\"") + m_shared->names[h].name + "\"", totals);
+        }
+
+        out << "# HELP http_requests_total Requests handled by handler and status code.\n";
+        out << "# TYPE http_requests_total counter\n";
+        for (auto &h : handlers)
+        {
+            for (size_t c = 0; c < STATUS_SLOTS; c++)
+            {
+                if (h.second.status[c] > 0)
+                    out << "http_requests_total{" << h.first << ",code=\"" << statusCode(c) << "\"} " << h.second.status[c] << "\n";
+            }
+        }
+
+        out << "# HELP http_request_bytes_total Request bytes received by handler.\n";
+        out << "# TYPE http_request_bytes_total counter\n";
+        for (auto &h : handlers)
+            out << "http_request_bytes_total{" << h.first << "} " << h.second.bytes_in << "\n";
+
+        out << "# HELP http_response_bytes_total Response bytes sent by handler.\n";
+        out << "# TYPE http_response_bytes_total counter\n";
+        for (auto &h : handlers)
+            out << "http_response_bytes_total{" << h.first << "} " << h.second.bytes_out << "\n";
+
+        out << "# HELP http_request_duration_seconds Time to handle a request by handler.\n";
+        out << "# TYPE http_request_duration_seconds histogram\n";
+        for (auto &h : handlers)
+        {
+            uint64_t cumulative = 0;
+            // every bound is written so the series line up across scrapes,
+            // the last bucket also holds anything slower and is left to +Inf
+            for (size_t b = 0; b < LATENCY_BUCKETS - 1; b++)
+            {
+                cumulative += h.second.latency[b];
+                out << "http_request_duration_seconds_bucket{" << h.first << ",le=\"" << bucketUpperBound(b) / 1e6 << "\"} " << cumulative << "\n";
+            }
+            out << "http_request_duration_seconds_bucket{" << h.first << ",le=\"+Inf\"} " << h.second.requests << "\n";
+            out << "http_request_duration_seconds_sum{" << h.first << "} " << h.second.latency_sum_us / 1e6 << "\n";
+            out << "http_request_duration_seconds_count{" << h.first << "} " << h.second.requests << "\n";
+        }
+    }
+
+    /**
+     *  Bucket index of a latency in microseconds
+     *
+     */
+    static inline size_t latencyBucket(uint64_t us)
+    {
+        if (us < SUB_BUCKETS)
+            return us;
+
+        size_t exponent = 63 - __builtin_clzll(us);
+        size_t sub = (us >> (exponent - 2)) & (SUB_BUCKETS - 1);
+        size_t bucket = SUB_BUCKETS + (exponent - 2) * SUB_BUCKETS + sub;
+        return std::min(bucket, LATENCY_BUCKETS - 1);
+    }
+
+    /**
+     *  Largest latency in microseconds counted by a bucket
+     *
+     */
+    static inline uint64_t bucketUpperBound(size_t bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+
+        size_t exponent = (bucket - SUB_BUCKETS) / SUB_BUCKETS + 2;
+        size_t sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << (exponent - 2)) - 1;
+    }
+
+private:
+    struct alignas(64) HandlerCounters
+    {
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> bytes_in{0};
+        std::atomic<uint64_t> bytes_out{0};
+        std::atomic<uint64_t> latency_sum_us{0};
+        std::atomic<uint64_t> status[STATUS_SLOTS]{};
+        std::atomic<uint64_t> latency[LATENCY_BUCKETS]{};
+    };
+
+    struct WorkerSlot
+    {
+        HandlerCounters handlers[MAX_HANDLERS];
+    };
+
+    static constexpr unsigned int NAME_WAIT_SPINS = 1000;
+
+    struct HandlerName
+    {
+        std::atomic<bool> claimed{false};
+        std::atomic<bool> ready{false};
+        char name[HANDLER_NAME_LEN]{};
+    };
+
+    struct Shared
+    {
+        std::atomic<size_t> handler_count{0};
+        HandlerName names[MAX_HANDLERS];
+        WorkerSlot slots[WORKER_SLOTS];
+    };
+
+    struct HandlerTotals
+    {
+        uint64_t requests = 0;
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+        uint64_t latency_sum_us = 0;
+        uint64_t status[STATUS_SLOTS] = {};
+        uint64_t latency[LATENCY_BUCKETS] = {};
+
+        void add(const HandlerCounters &counters)
+        {
+            requests += counters.requests.load(std::memory_order_relaxed);
+            bytes_in += counters.bytes_in.load(std::memory_order_relaxed);
+            bytes_out += counters.bytes_out.load(std::memory_order_relaxed);
+            latency_sum_us += counters.latency_sum_us.load(std::memory_order_relaxed);
+            for (size_t c = 0; c < STATUS_SLOTS; c++)
+                status[c] += counters.status[c].load(std::memory_order_relaxed);
+            for (size_t b = 0; b < LATENCY_BUCKETS; b++)
+                latency[b] += counters.latency[b].load(std::memory_order_relaxed);
+        }
+    };
+
+    static inline size_t statusSlot(int code)
+    {
+        for (size_t c = 0; c < STATUS_SLOTS - 1; c++)
+        {
+            if (STATUS_CODES[c] == code)
+                return c;
+        }
+        return STATUS_SLOTS - 1;
+    }
+
+    static inline std::string statusCode(size_t slot)
+    {
+        return slot < STATUS_SLOTS - 1 ? std::to_string(STATUS_CODES[slot]) : "other";
+    }
+
+    Shared *m_shared;
+};
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <memory_resource>
+#include <vector>
+
+/**
+ *  The headers of one request
+ *
+ *  Names and values are views into the request head, which must
+ *  outlive the headers. The first INLINE headers are stored in place,
+ *  any more go to a vector from the default memory resource.
+ *  Well known headers are found through a perfect hash of their
+ *  name when the request is parsed and looked up by HEADER in O(1),
+ *  anything else (x-amz-meta-*) is a linear scan.
+ */
+class RequestHeaders
+{
+public:
+    enum class HEADER : uint8_t
+    {
+        HOST,
+        CONNECTION,
+        CONTENT_LENGTH,
+        CONTENT_TYPE,
+        CONTENT_MD5,
+        TRANSFER_ENCODING,
+        EXPECT,
+        RANGE,
+        IF_MATCH,
+        IF_NONE_MATCH,
+        IF_MODIFIED_SINCE,
+        IF_UNMODIFIED_SINCE,
+        ACCEPT,
+        ACCEPT_ENCODING,
+        USER_AGENT,
+        AUTHORIZATION,
+        UPGRADE,
+        X_AMZ_DATE,
+        X_AMZ_CONTENT_SHA256,
+        COUNT
+    };
+
+    // lower case names in HEADER order
+    static constexpr std::array<std::string_view, size_t(HEADER::COUNT)> NAMES{
+        "host",
+        "connection",
+        "content-length",
+        "content-type",
+        "content-md5",
+        "transfer-encoding",
+        "expect",
+        "range",
+        "if-match",
+        "if-none-match",
+        "if-modified-since",
+        "if-unmodified-since",
+        "accept",
+        "accept-encoding",
+        "user-agent",
+        "authorization",
+        "upgrade",
+        "x-amz-date",
+        "x-amz-content-sha256",
+    };
+
+    static constexpr size_t INLINE = 16;
+
+    typedef std::pair<std::string_view, std::string_view> Field;
+
+    class const_iterator
+    {
+    public:
+        const_iterator(const RequestHeaders *headers, size_t index) : m_headers(headers), m_index(index) {}
+
+        inline const Field &operator*() const { return (*m_headers)[m_index]; }
+        inline const Field *operator->() const { return &(*m_headers)[m_index]; }
+        inline const_iterator &operator++()
+        {
+            m_index++;
+            return *this;
+        }
+        inline bool operator!=(const const_iterator &other) const { return m_index != other.m_index; }
+        inline bool operator==(const const_iterator &other) const { return m_index == other.m_index; }
+
+    private:
+        const RequestHeaders *m_headers;
+        size_t m_index;
+    };
+
+    RequestHeaders() : m_size(0), m_fields(), m_overflow(), m_known()
+    {
+    }
+
+    /**
+     *  Add a header, the name is expected in lower case.
+     *  The first of a repeated well known header is the one found.
+     */
+    void add(std::string_view name, std::string_view value)
+    {
+        if (m_size < INLINE)
+            m_fields[m_size] = Field(name, value);
+        else
+            m_overflow.emplace_back(name, value);
+        m_size++;
+
+        HEADER id = find(name);
+        if ((id != HEADER::COUNT) && (m_known[size_t(id)] == 0))
+            m_known[size_t(id)] = uint16_t(m_size);
+    }
+
+    inline bool has(HEADER id) const { return m_known[size_t(id)] != 0; }
+
+    /**
+     *  The value of a well known header, empty if not present
+     *
+     */
+    inline std::string_view get(HEADER id) const
+    {
+        size_t index = m_known[size_t(id)];
+        return (index == 0) ? std::string_view() : (*this)[index - 1].second;
+    }
+
+    /**
+     *  Look up a header by name in any case
+     *
+     */
+    const Field *get(std::string_view name) const
+    {
+        HEADER id = find(name);
+        if (id != HEADER::COUNT)
+            return has(id) ? &(*this)[m_known[size_t(id)] - 1] : nullptr;
+
+        for (size_t i = 0; i < m_size; i++)
+        {
+            const Field &field = (*this)[i];
+            if (equals(field.first, name))
+                return &field;
+        }
+        return nullptr;
+    }
+
+    inline const Field &operator[](size_t index) const
+    {
+        return (index < INLINE) ? m_fields[index] : m_overflow[index - INLINE];
+    }
+
+    inline size_t size() const { return m_size; }
+    inline bool empty() const { return m_size == 0; }
+    inline const_iterator begin() const { return const_iterator(this, 0); }
+    inline const_iterator end() const { return const_iterator(this, m_size); }
+
+    /**
+     *  The HEADER for a name in any case, COUNT if it is not well known
+     *
+     */
+    static constexpr HEADER find(std::string_view name)
+    {
+        if (name.empty())
+            return HEADER::COUNT;
+        uint8_t slot = SLOTS[hash(name)];
+        return ((slot != EMPTY) && equals(NAMES[slot], name)) ? HEADER(slot) : HEADER::COUNT;
+    }
+
+private:
+    static constexpr size_t TABLE_SIZE = 64;
+    static constexpr uint8_t EMPTY = 0xff;
+
+    static constexpr char lower(char c)
+    {
+        return ((c >= 'A') && (c <= 'Z')) ? char(c + ('a' - 'A')) : c;
+    }
+
+    static constexpr bool equals(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            if (lower(a[i]) != lower(b[i]))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     *  Perfect for NAMES, checked when the table is built
+     *
+     */
+    static constexpr size_t hash(std::string_view name)
+    {
+        return (name.size() + 2 * lower(name.front()) + 3 * lower(name.back()) + lower(name[name.size() / 2])) & (TABLE_SIZE - 1);
+    }
+
+    static constexpr std::array<uint8_t, TABLE_SIZE> table()
+    {
+        std::array<uint8_t, TABLE_SIZE> slots{};
+        for (auto &slot : slots)
+            slot = EMPTY;
+        for (size_t i = 0; i < NAMES.size(); i++)
+        {
+            // two names in one slot make this not a constant expression
+            if (slots[hash(NAMES[i])] != EMPTY)
+                throw "Header Hash Collision";
+            slots[hash(NAMES[i])] = i;
+        }
+        return slots;
+    }
+
+    // defined below, once the class is complete
+    static const std::array<uint8_t, TABLE_SIZE> SLOTS;
+
+    size_t m_size;
+    Field m_fields[INLINE];
+    std::pmr::vector<Field> m_overflow;
+    // index + 1 into the fields of each well known header, 0 when absent
+    uint16_t m_known[size_t(HEADER::COUNT)];
+};
+
+inline constexpr std::array<uint8_t, RequestHeaders::TABLE_SIZE> RequestHeaders::SLOTS = RequestHeaders::table();
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Metrics.hpp"
+#include "AccessLog.hpp"
+
+/**
+ *  Where the time of a request went
+ *
+ *  Each mark adds the time since the one before to a phase, so the
+ *  phases add up to the time since the request started. Marks read
+ *  CLOCK_MONOTONIC like the request record, through the vDSO. The
+ *  coarse clock ticks once a jiffy, longer than most phases take.
+ */
+class RequestTrace
+{
+public:
+    enum PHASE : uint8_t
+    {
+        READ,        // request head from the socket
+        PARSE,       // request line and headers
+        QUEUE,       // waiting for admission
+        LOOKUP,      // path to object file
+        STAT,        // access() and stat()
+        ATTRIBUTES,  // extended attribute reads
+        BODY,        // request body from the socket
+        HANDLER,     // anything else the handler did
+        SEND,        // response to the socket
+        PHASES
+    };
+
+    static constexpr const char *NAMES[PHASES] = {"read", "parse", "queue", "lookup", "stat", "xattr", "body", "handler", "send"};
+
+    // set before the server forks, the marks cost nothing without it
+    static inline bool s_enabled = false;
+
+    RequestTrace() : m_start(), m_last(), m_ns() {}
+
+    inline void start(const struct timespec &from)
+    {
+        m_start = from;
+        m_last = from;
+        std::fill(m_ns, m_ns + PHASES, 0);
+    }
+
+    /**
+     *  Add the time since the last mark to phase
+     *
+     */
+    inline void mark(PHASE phase)
+    {
+        if (!s_enabled)
+            return;
+
+        struct timespec now = RequestRecord::now();
+        m_ns[phase] += ns(m_last, now);
+        m_last = now;
+    }
+
+    inline uint64_t phase_ns(PHASE phase) const { return m_ns[phase]; }
+
+    /**
+     *  Append a Server-Timing header line with the phases so far
+     *
+     */
+    void serverTiming(std::pmr::string &out) const
+    {
+        out.append("Server-Timing: ");
+        for (size_t i = 0; i < PHASES; i++)
+        {
+            if (m_ns[i] == 0)
+                continue;
+            out.append(NAMES[i]).append(";dur=");
+            milliseconds(m_ns[i], out);
+            out.append(", ");
+        }
+        out.append("total;dur=");
+        milliseconds(ns(m_start, RequestRecord::now()), out);
+        out.append("\n");
+    }
+
+private:
+    static inline uint64_t ns(const struct timespec &from, const struct timespec &to)
+    {
+        return (to.tv_sec - from.tv_sec) * 1000000000 + (to.tv_nsec - from.tv_nsec);
+    }
+
+    // as milliseconds to the microsecond, snprintf("%.3f") is slower than the rest of the head
+    static void milliseconds(uint64_t ns, std::pmr::string &out)
+    {
+        uint64_t us = ns / 1000;
+        char buf[24];
+        char *end = std::to_chars(buf, buf + sizeof(buf), us / 1000).ptr;
+        *end++ = '.';
+        *end++ = char('0' + (us / 100) % 10);
+        *end++ = char('0' + (us / 10) % 10);
+        *end++ = char('0' + us % 10);
+        out.append(buf, end - buf);
+    }
+
+    struct timespec m_start;
+    struct timespec m_last;
+    uint64_t m_ns[PHASES];
+};
+
+/**
+ *  Log of requests slower than a threshold with their phases
+ *
+ *  Written as JSON lines like the access log, but straight from the
+ *  worker with one O_APPEND write() per request, as slow requests are
+ *  few and the line must not be dropped when the access log ring is
+ *  full.
+ */
+class SlowLog
+{
+public:
+    SlowLog(const std::string &path, uint64_t threshold_us) : m_fd(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)), m_threshold_us(threshold_us)
+    {
+        if (m_fd < 0)
+            throw std::runtime_error("Cannot Open Slow Log: " + path);
+    }
+
+    ~SlowLog()
+    {
+        close(m_fd);
+    }
+
+    SlowLog(const SlowLog &) = delete;
+    SlowLog &operator=(const SlowLog &) = delete;
+
+    /**
+     *  Write the request out if it took longer than the threshold
+     *
+     *  Return true if it did.
+     */
+    bool record(const RequestRecord &record, const RequestTrace &trace, const char *client, std::string_view method, std::string_view path)
+    {
+        uint64_t duration_us = record.elapsed_us();
+        if (duration_us < m_threshold_us)
+            return false;
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        char time_buf[40];
+        struct tm tm;
+        gmtime_r(&now.tv_sec, &tm);
+        size_t len = strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(time_buf + len, sizeof(time_buf) - len, ".%03dZ", int(now.tv_nsec / 1000000));
+
+        std::string line = "{\"time\":\"";
+        line += time_buf;
+        line += "\",\"client\":\"";
+        line += client;
+        line += "\",\"method\":\"";
+        AccessLog::escape(method, line);
+        line += "\",\"path\":\"";
+        AccessLog::escape(path, line);
+        line += "\",\"status\":" + std::to_string(record.status);
+        line += ",\"bytes_in\":" + std::to_string(record.bytes_in);
+        line += ",\"bytes_out\":" + std::to_string(record.bytes_out);
+        line += ",\"duration_us\":" + std::to_string(duration_us);
+        line += ",\"phases_us\":{";
+        for (size_t i = 0; i < RequestTrace::PHASES; i++)
+        {
+            if (i > 0)
+                line += ",";
+            line += "\"";
+            line += RequestTrace::NAMES[i];
+            line += "\":" + std::to_string(trace.phase_ns(RequestTrace::PHASE(i)) / 1000);
+        }
+        line += "}}\n";
+
+        return ::write(m_fd, line.data(), line.size()) == ssize_t(line.size());
+    }
+
+private:
+    int m_fd;
+    uint64_t m_threshold_us;
+};
@@ -1,19 +1,29 @@
 #include <filesystem>
+#include <thread>
 #include <fcntl.h>
 #include <sys/xattr.h>
 
 #include <boost/url.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/join.hpp>
-#include <boost/compute/detail/sha1.hpp>
+#include <boost/uuid/detail/sha1.hpp>
 
 #include "HttpServer.hpp"
+#include "StorageRoots.hpp"
+#include "BucketStats.hpp"
+#include "KeyFilter.hpp"
+#include "ListCache.hpp"
+#include "DirScanner.hpp"
+#include "WarmUp.hpp"
+#include "Tiering.hpp"
+#include "Select.hpp"
+#include "Lifecycle.hpp"
 
 struct CustomMetadata
 {
 
     CustomMetadata() : prefix("x-amz-meta-") {}
-    bool operator()(const std::pair<std::string, std::string> &p)
+    bool operator()(const RequestHeaders::Field &p)
     {
         return (p.first.rfind(prefix, 0) == 0);
     }
@@ -24,36 +34,60 @@ public:
 
 struct PathDetails
 {
-    PathDetails(std::list<std::string> path_parts, std::filesystem::path object_root) : bucket(""), key(""), hash("")
+    PathDetails(const std::pmr::vector<std::string_view> &path_parts, const StorageRoots &roots) : bucket(), key(), hash()
     {
         if (path_parts.size() == 0)
         {
             type = PathDetails::TYPE::LIST_BUCKET;
         }
-        if (path_parts.size() == 1)
+        if (path_parts.size() >= 1)
         {
             this->bucket = path_parts.front();
-            this->bucket_path = object_root / std::filesystem::path{this->bucket};
+            join(this->bucket_path, roots.primary(), this->bucket);
             type = PathDetails::TYPE::BUCKET;
         }
         if (path_parts.size() > 1)
         {
-            this->bucket = path_parts.front();
-            this->bucket_path = object_root / std::filesystem::path{this->bucket};
-            path_parts.pop_front();
-            this->key = boost::algorithm::join(path_parts, "/");
-            boost::compute::detail::sha1 sha1{this->key};
-            this->hash = sha1;
-            this->object_path = this->bucket_path / this->hash;
+            for (size_t i = 1; i < path_parts.size(); i++)
+            {
+                if (i > 1)
+                    this->key.push_back('/');
+                this->key.append(path_parts[i]);
+            }
             type = PathDetails::TYPE::OBJECT;
         }
     }
 
-    std::string bucket;
-    std::string key;
-    std::string hash;
-    std::filesystem::path bucket_path;
-    std::filesystem::path object_path;
+    /**
+     *  Hash the key and find the object file
+     *
+     */
+    void resolve(const StorageRoots &roots)
+    {
+        if ((type != PathDetails::TYPE::OBJECT) || !this->hash.empty())
+            return;
+
+        boost::uuids::detail::sha1 sha1;
+        sha1.process_bytes(this->key.data(), this->key.size());
+        unsigned int digest[5];
+        sha1.get_digest(digest);
+
+        char hex[41];
+        for (int i = 0; i < 5; i++)
+            snprintf(hex + i * 8, 9, "%08x", digest[i]);
+        this->hash.assign(hex, 40);
+
+        join(this->object_path, roots.locate(this->hash), this->bucket);
+        this->object_path.append("/").append(this->hash);
+    }
+
+    std::pmr::string bucket;
+    std::pmr::string key;
+    std::pmr::string hash;
+    // the bucket directory on the primary root
+    std::pmr::string bucket_path;
+    // the object file on the root which owns it
+    std::pmr::string object_path;
 
     enum class TYPE
     {
@@ -67,16 +101,38 @@ struct PathDetails
     static constexpr const char *XATT_PREFIX = "user.S3.";
     static constexpr const char *XATT_MIME_TYPE = "user.S3.MimeType";
     static constexpr const char *XATT_KEY_NAME = "user.S3.Key";
+
+private:
+    /**
+     *  path = root / name, built as a string so it can live in the arena
+     *
+     */
+    static void join(std::pmr::string &path, const std::filesystem::path &root, std::string_view name)
+    {
+        path.assign(root.native());
+        if (!path.empty() && (path.back() != '/'))
+            path.push_back('/');
+        path.append(name);
+    }
 };
 
 class S3HttpServer : public HttpServer
 {
 public:
-    S3HttpServer(unsigned short port, const char *storage_root, const char *path) : HttpServer(port, storage_root), m_has_attributes(false)
+    S3HttpServer(unsigned short port, const char *storage_root, const char *path) : S3HttpServer(port, std::vector<std::string>{storage_root}, path)
+    {
+    }
+
+    /**
+     *  Objects are spread over all the storage roots,
+     *  the first root holds the bucket list.
+     *
+     */
+    S3HttpServer(unsigned short port, const std::vector<std::string> &storage_roots, const char *path) : HttpServer(port, storage_roots.front().c_str()), m_roots(storage_roots), m_key_filter(KEY_FILTER_SLOTS), m_variants(), m_list_cache(), m_hot_keys(), m_warm_trace(), m_warm_limit(WARM_UP_KEYS), m_fast_tier(), m_lifecycle(), m_has_attributes(false)
     {
         using namespace boost;
 
-        BOOST_LOG_TRIVIAL(debug) << "S3HttpServer Started";
+        LOG_DEBUG << "S3HttpServer Started";
 
         urls::url_view u = urls::parse_origin_form(path).value();
 
@@ -88,14 +144,139 @@ public:
         // test for extended fs attributes
         const char *name = "user.s3.chec_fs";
         const char *value = "supported";
-        if (setxattr(storage_root, name,  value, strlen(value), 0) == 0) {
-            if (removexattr(storage_root, name) == 0) {
-                m_has_attributes = true;
-                BOOST_LOG_TRIVIAL(debug) << "Supports Exten FS Attribues";
-            }
+        m_has_attributes = true;
+        for (auto &root : m_roots.roots())
+        {
+            if ((setxattr(root.c_str(), name, value, strlen(value), 0) != 0) || (removexattr(root.c_str(), name) != 0))
+                m_has_attributes = false;
+        }
+        if (m_has_attributes)
+            LOG_DEBUG << "Supports Exten FS Attribues";
+
+        // move objects if the set of roots has changed
+        m_roots.rebalance();
+
+        // the server draining after a restart still stores keys, the filter is loaded once it has gone
+        if (predecessorRunning())
+        {
+            BOOST_LOG_TRIVIAL(info) << "Key Filter Waiting For Old Server";
+            addBackgroundTask([this, loaded = false]() mutable
+                              {
+                                  if (!loaded && !predecessorRunning())
+                                  {
+                                      loadKeyFilter();
+                                      loaded = true;
+                                  }
+                              },
+                              KEY_FILTER_WAIT_INTERVAL);
         }
+        else
+            loadKeyFilter();
+
+        addBackgroundTask([this]() { verifyBucketStats(); }, STATS_VERIFY_INTERVAL);
+        addBackgroundTask([this]() { m_variants.build(); }, VARIANT_BUILD_INTERVAL);
+
+        // listings walk whole buckets, keep them from crowding out object reads
+        setInFlightLimit("LIST", LIST_IN_FLIGHT);
+        setInFlightLimit("WRITE", WRITE_IN_FLIGHT);
+        setInFlightLimit("SELECT", SELECT_IN_FLIGHT);
+    }
+
+    static constexpr std::chrono::seconds STATS_VERIFY_INTERVAL{300};
+    static constexpr std::chrono::seconds VARIANT_BUILD_INTERVAL{1};
+    static constexpr size_t KEY_FILTER_SLOTS = 1 << 22;
+    static constexpr std::chrono::seconds KEY_FILTER_WAIT_INTERVAL{1};
+    static constexpr unsigned int LIST_IN_FLIGHT = 32;
+    static constexpr unsigned int WRITE_IN_FLIGHT = 128;
+    static constexpr unsigned int SELECT_IN_FLIGHT = 16;
+    static constexpr size_t SELECT_BLOCK = 1 << 20;         // read at a time, grown for a longer line
+    static constexpr size_t SELECT_MAX_LINE = 64 << 20;     // a longer line fails the select
+    static constexpr size_t SELECT_FLUSH = 64 * 1024;       // matching lines sent at a time
+    static constexpr long MAX_SELECT_EXPRESSION = 16 * 1024;
+    static constexpr std::chrono::seconds HOT_KEYS_INTERVAL{60};
+    static constexpr size_t WARM_UP_KEYS = 1000;
+    static constexpr size_t WARM_UP_BYTES = size_t(1) << 30;  // page cache to fill at most
+    static constexpr size_t WARM_UP_OBJECT_BYTES = 8 << 20;   // read ahead of a large object
+    static constexpr const char *HOT_KEYS_FILE = ".hotkeys";
+    static constexpr std::chrono::seconds TIER_INTERVAL{10};
+    static constexpr std::chrono::seconds TIER_DEMOTE_AFTER{3600};
+    static constexpr std::chrono::seconds LIFECYCLE_INTERVAL{10};
+    static constexpr unsigned int LIFECYCLE_RATE = 100;  // objects expired a second
+    static constexpr long MAX_LIFECYCLE_CONFIGURATION = 256 * 1024;
+
+    /**
+     *  Keep copies of the most read objects, up to max_bytes, in a
+     *  fast tier directory, see FastTier
+     *
+     *  Copies not read for demote_after are removed.
+     *  Call before Accept()
+     */
+    void enableTiering(const std::string &fast_root, uint64_t max_bytes, std::chrono::seconds demote_after = TIER_DEMOTE_AFTER)
+    {
+        m_fast_tier = std::make_unique<FastTier>(fast_root, m_roots, max_bytes, demote_after.count(), TIER_INTERVAL.count());
+        addBackgroundTask([this]() { m_fast_tier->move(); }, TIER_INTERVAL);
     }
 
+    /**
+     *  Warm the caches with the most requested objects after a start
+     *
+     *  The paths come from the access log in trace if one is given,
+     *  otherwise from the list of hot keys saved by the last run. The
+     *  objects are read into the page cache in a background process,
+     *  so requests are served while it runs.
+     *  Call before Accept()
+     */
+    void enableWarmUp(const std::string &trace = "", size_t limit = WARM_UP_KEYS)
+    {
+        m_hot_keys = std::make_unique<HotKeys>();
+        m_warm_trace = trace;
+        m_warm_limit = limit;
+
+        // the first run warms up, later ones save the hot keys for the next start
+        addBackgroundTask([this, warmed = false]() mutable
+                          {
+                              if (!warmed)
+                              {
+                                  warmUp();
+                                  warmed = true;
+                                  return;
+                              }
+                              // an idle run keeps the list it started from
+                              std::vector<std::string> paths = m_hot_keys->top(m_warm_limit);
+                              if (!paths.empty() && !HotKeys::save((m_roots.primary() / HOT_KEYS_FILE).string(), paths))
+                                  BOOST_LOG_TRIVIAL(error) << "Cannot Save Hot Keys";
+                              m_hot_keys->decay();
+                          },
+                          HOT_KEYS_INTERVAL);
+    }
+
+    /**
+     *  Remove the objects and stalled uploads the lifecycle rules of
+     *  their buckets expire, at most rate objects a second
+     *
+     *  The sweeper runs in the idle I/O class.
+     *  Call before Accept()
+     */
+    void enableLifecycle(unsigned int rate = LIFECYCLE_RATE)
+    {
+        m_lifecycle = std::make_unique<Lifecycle>(m_roots, rate);
+        addBackgroundTask([this, started = false]() mutable
+                          {
+                              if (!started)
+                              {
+                                  if (!Lifecycle::idle())
+                                      BOOST_LOG_TRIVIAL(warning) << "Cannot Set Idle I/O Priority: " << strerror(errno);
+                                  started = true;
+                              }
+                              m_lifecycle->sweep([this](const std::string &bucket, std::string_view key, const std::string &path, time_t before)
+                                                 { return expireObject(bucket, key, path, before); });
+                          },
+                          LIFECYCLE_INTERVAL);
+    }
+
+    // listings are generated in the request arena
+    typedef std::basic_ostringstream<char, std::char_traits<char>, std::pmr::polymorphic_allocator<char>> ListingStream;
+
 protected:
     /**
      *   DELETE either a bucket or object
@@ -109,20 +290,23 @@ protected:
         {
         case PathDetails::TYPE::BUCKET:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
-            DELETE_BUCKET(request, client_socket, details);
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            if (request.params().count("lifecycle") > 0)
+                DELETE_LIFECYCLE(request, client_socket, details);
+            else
+                DELETE_BUCKET(request, client_socket, details);
             break;
         }
         case PathDetails::TYPE::OBJECT:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
-            BOOST_LOG_TRIVIAL(debug) << "KEY: " << details.key;
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            LOG_DEBUG << "KEY: " << details.key;
             DELETE_OBJECT(request, client_socket, details);
             break;
         }
         default:
         {
-            BOOST_LOG_TRIVIAL(debug) << "Invalid Path";
+            LOG_DEBUG << "Invalid Path";
             BadRequest(request, client_socket);
             break;
         }
@@ -131,26 +315,33 @@ protected:
 
     virtual void HEAD(Request &request, int client_socket)
     {
-        PathDetails details = getParts(request);
+        PathDetails details = getParts(request, false);
 
         switch (details.type)
         {
         case PathDetails::TYPE::BUCKET:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
+            LOG_DEBUG << "BUCKET: " << details.bucket;
             HEAD_BUCKET(request, client_socket, details);
             break;
         }
         case PathDetails::TYPE::OBJECT:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
-            BOOST_LOG_TRIVIAL(debug) << "KEY: " << details.key;
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            LOG_DEBUG << "KEY: " << details.key;
+            if (!mayContain(details.bucket, details.key))
+            {
+                NotFound(request, client_socket);
+                break;
+            }
+            details.resolve(m_roots);
+            trace().mark(RequestTrace::LOOKUP);
             HEAD_OBJECT(request, client_socket, details);
             break;
         }
         default:
         {
-            BOOST_LOG_TRIVIAL(debug) << "Invalid Path";
+            LOG_DEBUG << "Invalid Path";
             BadRequest(request, client_socket);
             break;
         }
@@ -159,7 +350,7 @@ protected:
 
     virtual void GET(Request &request, int client_socket)
     {
-        PathDetails details = getParts(request);
+        PathDetails details = getParts(request, false);
 
         switch (details.type)
         {
@@ -170,20 +361,30 @@ protected:
         }
         case PathDetails::TYPE::OBJECT:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
-            BOOST_LOG_TRIVIAL(debug) << "KEY: " << details.key;
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            LOG_DEBUG << "KEY: " << details.key;
+            if (!mayContain(details.bucket, details.key))
+            {
+                NotFound(request, client_socket);
+                break;
+            }
+            details.resolve(m_roots);
+            trace().mark(RequestTrace::LOOKUP);
             GET_OBJECT(request, client_socket, details);
             break;
         }
         case PathDetails::TYPE::BUCKET:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
-            LIST_OBJECT(request, client_socket, details);
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            if (request.params().count("lifecycle") > 0)
+                GET_LIFECYCLE(request, client_socket, details);
+            else
+                LIST_OBJECT(request, client_socket, details);
             break;
         }
         default:
         {
-            BOOST_LOG_TRIVIAL(debug) << "Invalid Path";
+            LOG_DEBUG << "Invalid Path";
             BadRequest(request, client_socket);
             break;
         }
@@ -198,21 +399,24 @@ protected:
         {
         case PathDetails::TYPE::OBJECT:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
-            BOOST_LOG_TRIVIAL(debug) << "KEY: " << details.key;
-            BOOST_LOG_TRIVIAL(debug) << "HASH: " << details.hash;
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            LOG_DEBUG << "KEY: " << details.key;
+            LOG_DEBUG << "HASH: " << details.hash;
             PUT_OBJECT(request, client_socket, details);
             break;
         }
         case PathDetails::TYPE::BUCKET:
         {
-            BOOST_LOG_TRIVIAL(debug) << "BUCKET: " << details.bucket;
-            PUT_BUCKET(request, client_socket, details);
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            if (request.params().count("lifecycle") > 0)
+                PUT_LIFECYCLE(request, client_socket, details);
+            else
+                PUT_BUCKET(request, client_socket, details);
             break;
         }
         default:
         {
-            BOOST_LOG_TRIVIAL(debug) << "Invalid Path";
+            LOG_DEBUG << "Invalid Path";
             BadRequest(request, client_socket);
             break;
         }
@@ -221,18 +425,180 @@ protected:
 
     virtual void POST(Request &request, int client_socket)
     {
+        PathDetails details = getParts(request, false);
+
+        if ((details.type == PathDetails::TYPE::OBJECT) && (request.params().count("select") > 0))
+        {
+            LOG_DEBUG << "BUCKET: " << details.bucket;
+            LOG_DEBUG << "KEY: " << details.key;
+            if (!mayContain(details.bucket, details.key))
+            {
+                NotFound(request, client_socket);
+                return;
+            }
+            details.resolve(m_roots);
+            trace().mark(RequestTrace::LOOKUP);
+            SELECT_OBJECT(request, client_socket, details);
+            return;
+        }
+
+        LOG_DEBUG << "Invalid Path";
+        BadRequest(request, client_socket);
+    }
+
+    /**
+     *  Requests are admitted as LIST, WRITE, SELECT or READ
+     *
+     */
+    virtual std::string_view admissionClass(Request &request)
+    {
+        switch (request.http_method)
+        {
+        case Request::METHOD::GET:
+            return (getParts(request, false).type == PathDetails::TYPE::OBJECT) ? "READ" : "LIST";
+        case Request::METHOD::POST:
+            // a select reads a whole object, however little it sends
+            if (request.params().count("select") > 0)
+                return "SELECT";
+            return "WRITE";
+        case Request::METHOD::PUT:
+        case Request::METHOD::DELETE:
+            return "WRITE";
+        default:
+            return "READ";
+        }
+    }
+
+    virtual void writeMetrics(std::ostream &out)
+    {
+        HttpServer::writeMetrics(out);
+
+        out << "# HELP s3_key_filter_lookups_total Object lookups checked against the key filter.\n";
+        out << "# TYPE s3_key_filter_lookups_total counter\n";
+        out << "s3_key_filter_lookups_total " << m_key_filter.lookups() << "\n";
+        out << "# HELP s3_key_filter_misses_total Lookups the key filter answered 404 without touching the disk.\n";
+        out << "# TYPE s3_key_filter_misses_total counter\n";
+        out << "s3_key_filter_misses_total " << m_key_filter.misses() << "\n";
+        out << "# HELP s3_key_filter_false_positives_total Lookups the key filter passed for objects which did not exist.\n";
+        out << "# TYPE s3_key_filter_false_positives_total counter\n";
+        out << "s3_key_filter_false_positives_total " << m_key_filter.falsePositives() << "\n";
+        out << "# HELP s3_key_filter_false_positive_rate Share of the key filter lookups which were false positives.\n";
+        out << "# TYPE s3_key_filter_false_positive_rate gauge\n";
+        out << "s3_key_filter_false_positive_rate " << m_key_filter.falsePositiveRate() << "\n";
+
+        m_variants.write(out);
+        m_list_cache.write(out);
+        if (m_fast_tier)
+            m_fast_tier->write(out);
+        if (m_lifecycle)
+            m_lifecycle->write(out);
+    }
+
+    /**
+     *  Read the file system attrubutes back into the response Object
+     *
+     */
+    static void getAttributes(const char *path, Headers &headers)
+    {
+        ssize_t sz = getxattr(path, PathDetails::XATT_MIME_TYPE, NULL, 0);
+        if (sz > 0)
+        {
+            char attr[sz + 1];
+            sz = getxattr(path, PathDetails::XATT_MIME_TYPE, attr, sz);
+            if (sz > 0)
+                headers["Content-Type"].assign(attr, sz);
+        }
+
+        ssize_t attr_len = listxattr(path, NULL, 0);
+        if (attr_len > 0)
+        {
+            char attr_buf[attr_len + 1];
+            attr_len = listxattr(path, attr_buf, attr_len);
+            attr_buf[attr_len] = '\0';
+            char *key = attr_buf;
+            size_t keylen = 0;
+            while (attr_len > 0)
+            {
+                // the server's own attributes, like the tier, are not metadata
+                std::string_view name{key};
+                ssize_t val_len = (name.rfind(PathDetails::XATT_PREFIX, 0) == 0) ? getxattr(path, key, NULL, 0) : -1;
+                if (val_len > 0)
+                {
+                    char attr_key_buf[val_len + 1];
+                    val_len = getxattr(path, key, attr_key_buf, val_len);
+                    std::pmr::string hkey{"x-amz-meta-"};
+                    hkey.append(name.substr(strlen(PathDetails::XATT_PREFIX)));
+                    headers.emplace(std::move(hkey), std::string_view(attr_key_buf, std::max(val_len, ssize_t(0))));
+                }
+                keylen = strlen(key) + 1;
+                key += keylen;
+                attr_len -= keylen;
+            }
+        }
+    }
+
+    /**
+     *  Write the Contents of one copy of a bucket directory
+     *
+     *  Only the key attribute and the fields in the listing are read,
+     *  relative to the directory. Returns false if it cannot be read.
+     */
+    static bool listContents(const char *bucket_path, std::ostream &mesg)
+    {
+        DirScanner scanner(bucket_path);
+        if (!scanner.opened())
+            return false;
+
+        DirScanner::Entry entry;
+        while (scanner.next(entry))
+        {
+            // gone since it was read, deleted while listing
+            struct statx details;
+            if ((entry.name[0] == '.') || !scanner.stat(entry.name, STATX_INO | STATX_SIZE | STATX_MTIME, details))
+                continue;
+
+            char key[PATH_MAX];
+            ssize_t key_size = scanner.attribute(entry.name, PathDetails::XATT_KEY_NAME, key, sizeof(key));
+
+            char last_mod[32];
+            mesg << "\t<Contents>\n";
+            mesg << "\t\t<Key>" << std::string_view(key, std::max<ssize_t>(key_size, 0)) << "</Key>\n";
+            mesg << "\t\t<LastModified>" << lastModified(details, last_mod) << "</LastModified>\n";
+            mesg << "\t\t<ETag>" << details.stx_ino << "-" << details.stx_size << "-" << details.stx_mtime.tv_sec << "</ETag>\n";
+            mesg << "\t\t<Size>" << details.stx_size << "</Size>\n";
+            mesg << "\t</Contents>\n";
+        }
+        return true;
+    }
+
+    /**
+     *  The modification time as ctime() writes it, without the newline
+     *
+     */
+    static const char *lastModified(const struct statx &details, char (&buf)[32])
+    {
+        time_t modified = details.stx_mtime.tv_sec;
+        if (ctime_r(&modified, buf) == nullptr)
+            buf[0] = '\0';
+        buf[strcspn(buf, "\n")] = '\0';
+        return buf;
     }
 
 private:
     void DELETE_OBJECT(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("DELETE_OBJECT");
+
         Response response{};
 
         std::ostringstream ss;
 
-        if (std::filesystem::exists(details.object_path))
+        BucketLock lock{details.bucket_path};
+
+        struct stat struct_stat;
+        if (stat(details.object_path.c_str(), &struct_stat) == 0)
         {
-            if (std::filesystem::remove(details.object_path))
+            if (removeObject(details, lock, struct_stat))
             {
                 ss << Response::NO_CONTENT << "\n";
             }
@@ -248,21 +614,24 @@ private:
 
         ss << response.headers_str();
         std::string response_buff(ss.str());
-        write(client_socket, response_buff.c_str(), response_buff.size());
+        send_buffer(client_socket, response_buff);
     }
 
     void PUT_OBJECT(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("PUT_OBJECT");
+
         Response response{};
         std::ostringstream ss_cont;
 
         // NoSuchBucket
         if (!std::filesystem::exists(details.bucket_path))
         {
-            BOOST_LOG_TRIVIAL(info) << "NoSuchBucket";
-            ss_cont << Response::NOT_FOUND << "\r\n\r\n";
+            LOG_DEBUG << "NoSuchBucket";
+            ss_cont << Response::NOT_FOUND << "\n";
+            ss_cont << response.headers_str();
             std::string response_cont(ss_cont.str());
-            write(client_socket, response_cont.c_str(), response_cont.size());
+            send_buffer(client_socket, response_cont);
             fsync(client_socket);
             return;
         }
@@ -270,118 +639,137 @@ private:
         // Send the 100 Contine message back to the client
         ss_cont << Response::CONTINUE << "\r\n\r\n";
         std::string response_cont(ss_cont.str());
-        write(client_socket, response_cont.c_str(), response_cont.size());
+        send_buffer(client_socket, response_cont);
         fsync(client_socket);
-        BOOST_LOG_TRIVIAL(info) << Response::CONTINUE;
+        LOG_DEBUG << Response::CONTINUE;
 
         // Get the expected message length
-        long int length = atol(request.getHeader("content-length").c_str());
+        long int length = request.contentLength();
 
-        BOOST_LOG_TRIVIAL(info) << "HEADER Length: " << length;
+        LOG_DEBUG << "HEADER Length: " << length;
 
-        // Check for a reponse from the client
-        char sock_buff[1024];
-        recv(client_socket, sock_buff, 128, MSG_PEEK);
+        // write to a hidden file and rename it over the object once complete
+        std::filesystem::path tmp_path = std::filesystem::path(details.object_path).parent_path() / ("." + std::string(details.hash) + "." + std::to_string(getpid()));
 
+        char sock_buff[16384];
         std::ofstream object_file;
-        object_file.open(details.object_path);
-        ssize_t nread = -1;
-        do
-        {
-            nread = recv(client_socket, sock_buff, 1024, MSG_DONTWAIT);
-            if (nread > 0)
-                object_file.write(sock_buff, nread);
-        } while (nread > 0);
+        object_file.open(tmp_path);
+        ssize_t nread;
+        while ((nread = recv_body(sock_buff, sizeof(sock_buff))) > 0)
+        {
+            object_file.write(sock_buff, nread);
+            record().bytes_in += nread;
+        }
         object_file.close();
 
-        setAttributes(details.object_path, details, response, request);
+        setAttributes(tmp_path, details, response, request);
 
         struct stat struct_stat;
-        stat(details.object_path.c_str(), &struct_stat);
+        stat(tmp_path.c_str(), &struct_stat);
 
-        BOOST_LOG_TRIVIAL(info) << "Object Size: " << struct_stat.st_size;
+        LOG_DEBUG << "Object Size: " << struct_stat.st_size;
 
         std::ostringstream ss_ok;
 
         if (struct_stat.st_size == length)
         {
-            ss_ok << Response::CREATED << "\n";
+            if (commitObject(tmp_path, details, struct_stat))
+                ss_ok << Response::CREATED << "\n";
+            else
+                ss_ok << Response::SERVER_ERROR << "\n";
         }
         else
         {
+            unlink(tmp_path.c_str());
             ss_ok << Response::BAD_REQUEST << "\n";
         }
 
         ss_ok << response.headers_str();
         std::string response_ok(ss_ok.str());
-        write(client_socket, response_ok.c_str(), response_ok.size());
+        send_buffer(client_socket, response_ok);
         fsync(client_socket);
     }
 
     void GET_OBJECT(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("GET_OBJECT");
+
         Response response{};
 
         // Check file can be read and exists
         if (access(details.object_path.c_str(), R_OK) != 0)
         {
-            std::ostringstream ss;
-            ss << Response::NOT_FOUND << "\n";
-            ss << response.headers_str();
-            std::string response_buff(ss.str());
-            write(client_socket, response_buff.c_str(), response_buff.size());
+            m_key_filter.falsePositive();
+            send_buffer(client_socket, response.str(Response::NOT_FOUND));
             return;
         }
 
+        if (m_hot_keys)
+            m_hot_keys->hit(request.path());
+
         struct stat file_details;
         if (stat(details.object_path.c_str(), &file_details) == 0)
         {
+            trace().mark(RequestTrace::STAT);
             response.addFileHeaders(&file_details, details.object_path);
+            getAttributes(details.object_path.c_str(), response.headers());
+            trace().mark(RequestTrace::ATTRIBUTES);
+
+            // a compressed variant has its own ETag, either matches the object
+            std::pmr::string etag = response.getHeader("Etag");
+            struct stat variant_details;
+            int variant_fd = openVariant(request, details, response, file_details, variant_details);
 
             // check for etag match
-            if (request.hasHeader("If-None-Match"))
+            if (request.hasHeader(HEADER::IF_NONE_MATCH))
             {
-                if (request.getHeader("If-None-Match") == response.getHeader("Etag"))
+                std::string_view match = request.getHeader(HEADER::IF_NONE_MATCH);
+                if ((match == response.getHeader("Etag")) || (match == etag))
                 {
-                    std::ostringstream ss;
-                    ss << Response::NOT_MODIFIED << "\n";
-                    ss << response.headers_str();
-                    std::string response_buff(ss.str());
-                    write(client_socket, response_buff.c_str(), response_buff.size());
+                    if (variant_fd >= 0)
+                        close(variant_fd);
+                    send_buffer(client_socket, response.str(Response::NOT_MODIFIED));
                     return;
                 }
             }
 
-            if (request.hasHeader("If-Match"))
+            if (request.hasHeader(HEADER::IF_MATCH))
             {
-                if (request.getHeader("If-Match") != response.getHeader("Etag"))
+                std::string_view match = request.getHeader(HEADER::IF_MATCH);
+                if ((match != response.getHeader("Etag")) && (match != etag))
                 {
-                    std::ostringstream ss;
-                    ss << Response::PRE_FAILED << "\n";
-                    ss << response.headers_str();
-                    std::string response_buff(ss.str());
-                    write(client_socket, response_buff.c_str(), response_buff.size());
+                    if (variant_fd >= 0)
+                        close(variant_fd);
+                    send_buffer(client_socket, response.str(Response::PRE_FAILED));
                     return;
                 }
             }
 
-            if (request.hasHeader("If-Modified-Since"))
+            if (request.hasHeader(HEADER::IF_MODIFIED_SINCE))
             {
                 // TODO
             }
 
-            getAttributes(details.object_path, response.headers());
+            if (variant_fd >= 0)
+            {
+                ssize_t sentbytes = send_file(client_socket, response.str(Response::OK), variant_fd, 0, variant_details.st_size);
+                close(variant_fd);
+
+                if (sentbytes != variant_details.st_size)
+                    BOOST_LOG_TRIVIAL(error) << "Error sending file contents";
+                return;
+            }
 
             // does request contain range request
-            if (request.hasHeader("Range"))
+            if (request.hasHeader(HEADER::RANGE))
             {
-                std::string range_request = request.getHeader("Range");
+                std::string range_request{request.getHeader(HEADER::RANGE)};
                 std::vector<std::string> parts;
                 boost::split(parts, range_request, boost::is_any_of("="));
                 if ((parts.size() == 2) && (parts[0] == "bytes"))
                 {
                     std::string range = parts[1];
-                    BOOST_LOG_TRIVIAL(info) << "ByteRange: " << range;
+                    LOG_DEBUG << "ByteRange: " << range;
 
                     std::vector<std::string> range_values;
                     boost::split(range_values, range, boost::is_any_of("-"));
@@ -395,16 +783,10 @@ private:
                         if (content_length > 0)
                         {
 
-                            std::ostringstream ss;
-                            ss << Response::PARTIAL << "\n";
                             response.setContentLength(content_length);
-                            ss << response.headers_str();
-                            std::string response_buff(ss.str());
-                            write(client_socket, response_buff.c_str(), response_buff.size());
 
-                            off_t offset = start_byte;
-                            int in_fd = open(details.object_path.c_str(), O_RDONLY);
-                            ssize_t sent = sendfile(client_socket, in_fd, &offset, content_length);
+                            int in_fd = openObject(details, etag);
+                            ssize_t sent = send_file(client_socket, response.str(Response::PARTIAL), in_fd, start_byte, content_length);
                             close(in_fd);
 
                             if (sent != content_length)
@@ -416,17 +798,9 @@ private:
                 }
             }
 
-            // send the full content
-            std::ostringstream ss;
-            ss << Response::OK << "\n";
-            ss << response.headers_str();
-            std::string response_buff(ss.str());
-            write(client_socket, response_buff.c_str(), response_buff.size());
-
-            // send content
-            off_t off = 0;
-            int in_fd = open(details.object_path.c_str(), O_RDONLY);
-            ssize_t sentbytes = sendfile(client_socket, in_fd, &off, file_details.st_size);
+            // send the head and the full content
+            int in_fd = openObject(details, etag);
+            ssize_t sentbytes = send_file(client_socket, response.str(Response::OK), in_fd, 0, file_details.st_size);
             close(in_fd);
 
             if (sentbytes != file_details.st_size)
@@ -434,99 +808,328 @@ private:
         }
         else
         {
-            std::ostringstream ss;
-            ss << Response::NOT_FOUND << "\n";
-            ss << response.headers_str();
-            std::string response_buff(ss.str());
-            write(client_socket, response_buff.c_str(), response_buff.size());
+            send_buffer(client_socket, response.str(Response::NOT_FOUND));
         }
     }
 
-    void LIST_OBJECT(Request &request, int client_socket, PathDetails &details)
+    /**
+     *  Send the lines of an object which match the predicates in the
+     *  request body, see RowFilter
+     *
+     *  ?select&format=csv|ndjson&delimiter=,&header=1, the format
+     *  follows the key's extension when not given and a header line
+     *  names the CSV columns and is always sent.
+     */
+    void SELECT_OBJECT(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("SELECT_OBJECT");
+
         Response response{};
 
-        std::ostringstream mesg;
-        mesg << "<ListBucketResult>\n";
-        mesg << "\t<Name>" << details.bucket << "</Name>\n";
-        mesg << "\t<IsTruncated>false</IsTruncated>\n";
+        long length = request.contentLength();
+        if ((length <= 0) || (length > MAX_SELECT_EXPRESSION))
+        {
+            BadRequest(request, client_socket);
+            return;
+        }
 
-        for (const auto &entry : std::filesystem::directory_iterator(details.bucket_path))
+        if (request.hasHeader(HEADER::EXPECT))
+            send_buffer(client_socket, std::string(Response::CONTINUE) + "\r\n\r\n");
+
+        std::pmr::string expression;
+        expression.resize(length);
+        size_t received = 0;
+        ssize_t nread;
+        while ((received < expression.size()) && ((nread = recv_body(expression.data() + received, expression.size() - received)) > 0))
+            received += nread;
+        record().bytes_in += received;
+        if (received != expression.size())
+            return;
+
+        // the format and columns
+        const QueryParams &params = request.params();
+        auto param = [&params](std::string_view name) -> std::string_view
         {
+            auto it = params.find(name);
+            return (it == params.end()) ? std::string_view() : std::string_view(it->second);
+        };
+        std::string_view format = param("format");
+        std::string_view key = details.key;
+        std::string_view extension = key.substr(std::min(key.rfind('.'), key.size()));
+        bool ndjson = (format == "ndjson") || (format.empty() && ((extension == ".json") || (extension == ".ndjson") || (extension == ".jsonl")));
+        std::string_view delimiter = param("delimiter");
+        char separator = (delimiter == "tab") ? '\t' : (delimiter.empty() ? ',' : delimiter.front());
+        bool has_header = !ndjson && ((param("header") == "1") || (param("header") == "true"));
+
+        RowFilter filter(ndjson ? RowFilter::FORMAT::NDJSON : RowFilter::FORMAT::CSV, separator);
+        std::string error;
+        if (!filter.parse(expression, error) || (!has_header && !filter.resolved(error)))
+        {
+            LOG_DEBUG << "Select: " << error;
+            BadRequest(request, client_socket);
+            return;
+        }
 
-            Headers attributes;
-            getAttributes(entry.path(), attributes);
+        struct stat file_details;
+        if ((access(details.object_path.c_str(), R_OK) != 0) || (stat(details.object_path.c_str(), &file_details) != 0))
+        {
+            m_key_filter.falsePositive();
+            NotFound(request, client_socket);
+            return;
+        }
+        trace().mark(RequestTrace::STAT);
 
-            struct stat struct_stat;
-            stat(entry.path().c_str(), &struct_stat);
-            std::string last_mod{std::ctime(&(struct_stat.st_mtim).tv_sec)};
-            last_mod.pop_back();
+        char etag_buf[64];
+        int in_fd = openObject(details, VariantCache::etag(file_details, etag_buf));
+        if (in_fd < 0)
+        {
+            NotFound(request, client_socket);
+            return;
+        }
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // a block and the start of a line carried over from the one before
+        std::pmr::string block;
+        block.resize(SELECT_BLOCK);
+        std::pmr::string out;
+        out.reserve(SELECT_FLUSH + SELECT_BLOCK);
+        size_t held = 0;
+        off_t offset = 0;
+        uint64_t scanned = 0;
+        bool first = true;
+        bool ok = true;
+        bool failed = false;
+
+        while (ok)
+        {
+            // a line longer than the block, which is grown rather than the line dropped
+            if (held == block.size())
+            {
+                if (block.size() >= SELECT_MAX_LINE)
+                {
+                    LOG_DEBUG << "Select: Line Longer Than " << SELECT_MAX_LINE;
+                    failed = true;
+                    break;
+                }
+                block.resize(std::min(block.size() * 2, SELECT_MAX_LINE));
+            }
 
+            ssize_t n = pread(in_fd, block.data() + held, block.size() - held, offset);
+            if (n < 0)
+            {
+                BOOST_LOG_TRIVIAL(error) << "Select: " << strerror(errno);
+                failed = true;
+                break;
+            }
+            offset += n;
+            scanned += n;
+            size_t size = held + n;
+            bool last = (n == 0);
+            std::string_view data(block.data(), size);
+
+            // the header is sent, and names the columns, before anything else
+            if (first)
+            {
+                const char *eol = static_cast<const char *>(memchr(data.data(), '\n', data.size()));
+                if ((eol == nullptr) && !last)
+                {
+                    held = size;
+                    continue;
+                }
+                first = false;
 
-            mesg << "\t<Contents>\n";
-            mesg << "\t\t<Key>" << attributes["x-amz-meta-Key"] << "</Key>\n";
-            mesg << "\t\t<LastModified>" << last_mod << "</LastModified>\n";
-            mesg << "\t\t<ETag>" << struct_stat.st_ino << "-" << struct_stat.st_size << "-" << struct_stat.st_mtim.tv_sec << "</ETag>\n";
-            mesg << "\t\t<Size>" << struct_stat.st_size << "</Size>\n";
-            mesg << "\t</Contents>\n";
+                std::string_view header;
+                if (has_header)
+                {
+                    header = data.substr(0, (eol != nullptr) ? eol + 1 - data.data() : data.size());
+                    data.remove_prefix(header.size());
+                    if (!filter.header(header.substr(0, header.find('\n')), error))
+                    {
+                        LOG_DEBUG << "Select: " << error;
+                        close(in_fd);
+                        BadRequest(request, client_socket);
+                        return;
+                    }
+                }
+
+                response.addHeader("Content-Type", ndjson ? "application/x-ndjson" : "text/csv");
+                ok = begin_chunks(request, client_socket, response, Response::OK);
+                out.append(header);
+            }
+
+            size_t used = filter.filter(data, last, out);
+            data.remove_prefix(used);
+
+            if ((out.size() >= SELECT_FLUSH) || (last && !out.empty()))
+            {
+                ok = ok && send_chunk(client_socket, out);
+                out.clear();
+            }
+            if (last)
+                break;
+
+            held = data.size();
+            memmove(block.data(), data.data(), held);
         }
+        close(in_fd);
 
-        mesg << "</ListBucketResult>\n";
+        // nothing is sent yet, the status can still say it failed
+        if (first)
+        {
+            send_buffer(client_socket, response.str(Response::SERVER_ERROR));
+            return;
+        }
+        if (ok && !failed)
+            end_chunks(client_socket);
+        else
+            abort_chunks();
 
-        std::string mesg_buff(mesg.str());
+        LOG_DEBUG << "Select: " << scanned << " Bytes Scanned, " << record().bytes_out << " Sent";
+    }
 
-        response.setContentLength(mesg_buff.length());
+    /**
+     *  Open the content of an object, from the fast tier if the version
+     *  with etag is promoted
+     *
+     */
+    int openObject(PathDetails &details, std::string_view etag)
+    {
+        if (m_fast_tier)
+        {
+            int fd = m_fast_tier->open(details.object_path.c_str(), details.bucket, details.hash, etag);
+            if (fd >= 0)
+                return fd;
+            m_fast_tier->hit(details.bucket, details.hash);
+        }
+        return open(details.object_path.c_str(), O_RDONLY);
+    }
+
+    void LIST_OBJECT(Request &request, int client_socket, PathDetails &details)
+    {
+        record().handler = metrics().handler("LIST_OBJECT");
+
+        Response response{};
         response.setContentType(".xml");
 
-        std::ostringstream ss;
-        ss << Response::OK << "\n";
-        ss << response.headers_str();
-        ss << mesg_buff;
-        std::string response_buff(ss.str());
+        // read before the scan, so a change during it makes the listing stale
+        std::pmr::string key = listKey(details.bucket, request);
+        uint64_t generation = m_list_cache.generation(details.bucket);
+
+        // a server still draining after a restart does not bump the generations
+        bool cached = !predecessorRunning();
 
-        write(client_socket, response_buff.data(), response_buff.size());
+        std::pmr::string listing;
+        if (!cached || !m_list_cache.find(key, generation, listing))
+        {
+            ListingStream mesg;
+            if (!listObjects(details, mesg))
+            {
+                NotFound(request, client_socket);
+                return;
+            }
+            listing = mesg.str();
+            if (cached)
+                m_list_cache.store(key, generation, listing);
+        }
+
+        std::pmr::string body;
+        std::ostream mesg(begin_body(request, response, body));
+        mesg.write(listing.data(), listing.size());
+
+        send_body(client_socket, response, Response::OK, body);
+    }
+
+    /**
+     *  Write the listing of a bucket, false if it does not exist
+     *
+     *  With several storage roots every copy of the bucket is scanned
+     *  in its own thread, the roots are usually separate disks.
+     */
+    bool listObjects(PathDetails &details, std::ostream &mesg)
+    {
+        std::vector<std::filesystem::path> bucket_paths = m_roots.bucketPaths(details.bucket);
+        std::vector<std::string> shards(bucket_paths.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < bucket_paths.size(); i++)
+            threads.emplace_back([&, i]()
+                                 {
+                                     std::ostringstream shard;
+                                     listContents(bucket_paths[i].c_str(), shard);
+                                     shards[i] = shard.str();
+                                 });
+
+        std::ostringstream primary;
+        bool found = listContents(details.bucket_path.c_str(), primary);
+        shards[0] = primary.str();
+        for (auto &thread : threads)
+            thread.join();
+        if (!found)
+            return false;
+
+        mesg << "<ListBucketResult>\n";
+        mesg << "\t<Name>" << details.bucket << "</Name>\n";
+        mesg << "\t<IsTruncated>false</IsTruncated>\n";
+        for (auto &shard : shards)
+            mesg << shard;
+        mesg << "</ListBucketResult>\n";
+        return true;
     }
 
     void LIST_BUCKET(Request &request, int client_socket, PathDetails &details)
     {
-        std::filesystem::path path = getRootPath();
+        record().handler = metrics().handler("LIST_BUCKET");
 
         Response response{};
+        response.setContentType(".xml");
+
+        std::pmr::string key = listKey("", request);
+        uint64_t generation = m_list_cache.generation("");
+        bool cached = !predecessorRunning();
+
+        std::pmr::string listing;
+        if (!cached || !m_list_cache.find(key, generation, listing))
+        {
+            ListingStream mesg;
+            listBuckets(mesg);
+            listing = mesg.str();
+            if (cached)
+                m_list_cache.store(key, generation, listing);
+        }
+
+        std::pmr::string body;
+        std::ostream mesg(begin_body(request, response, body));
+        mesg.write(listing.data(), listing.size());
+
+        send_body(client_socket, response, Response::OK, body);
+    }
+
+    void listBuckets(std::ostream &mesg)
+    {
+        DirScanner scanner(getRootPath().c_str());
 
-        std::ostringstream mesg;
         mesg << "<ListAllMyBucketsResult>\n";
         mesg << "\t<Buckets>\n";
-        for (const auto &entry : std::filesystem::directory_iterator(path))
+        DirScanner::Entry entry;
+        while (scanner.next(entry))
         {
-            mesg << "\t\t<Bucket>\n";
-
-            struct stat struct_stat;
-            stat(entry.path().c_str(), &struct_stat);
-            std::string last_mod{std::ctime(&(struct_stat.st_mtim).tv_sec)};
-            last_mod.pop_back();
+            struct statx details;
+            if ((entry.name[0] == '.') || !scanner.stat(entry.name, STATX_MTIME, details))
+                continue;
 
-            mesg << "\t\t\t<CreationDate>" << last_mod << "</CreationDate>\n";
-            mesg << "\t\t\t<Name>" << entry.path().filename().c_str() << "</Name>\n";
+            char last_mod[32];
+            mesg << "\t\t<Bucket>\n";
+            mesg << "\t\t\t<CreationDate>" << lastModified(details, last_mod) << "</CreationDate>\n";
+            mesg << "\t\t\t<Name>" << entry.name << "</Name>\n";
             mesg << "\t\t</Bucket>\n";
         }
         mesg << "\t</Buckets>\n";
         mesg << "</ListAllMyBucketsResult>\n";
-        std::string mesg_buff(mesg.str());
-
-        response.setContentLength(mesg_buff.length());
-        response.setContentType(".xml");
-
-        std::ostringstream ss;
-        ss << Response::OK << "\n";
-        ss << response.headers_str();
-        ss << mesg_buff;
-        std::string response_buff(ss.str());
-
-        write(client_socket, response_buff.data(), response_buff.size());
     }
 
     void PUT_BUCKET(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("PUT_BUCKET");
+
         Response response{};
 
         std::ostringstream ss;
@@ -539,6 +1142,12 @@ private:
         {
             if (std::filesystem::create_directory(details.bucket_path))
             {
+                for (auto &bucket_path : m_roots.bucketPaths(details.bucket))
+                    std::filesystem::create_directories(bucket_path);
+                BucketStats::reconcile(details.bucket_path, m_roots.bucketPaths(details.bucket));
+                m_list_cache.changed(details.bucket);
+                m_list_cache.changed("");
+
                 details.bucket.insert(0, 1, '/');
                 response.addHeader("Location", details.bucket);
                 ss << Response::OK << "\n";
@@ -552,34 +1161,75 @@ private:
 
         ss << response.headers_str();
         std::string response_buff(ss.str());
-        write(client_socket, response_buff.c_str(), response_buff.size());
+        send_buffer(client_socket, response_buff);
     }
 
     void DELETE_BUCKET(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("DELETE_BUCKET");
+
         Response response{};
 
         std::ostringstream ss;
 
         if (std::filesystem::exists(details.bucket_path))
         {
-            auto it = std::filesystem::directory_iterator(details.bucket_path);
-            if (std::distance(std::filesystem::begin(it), std::filesystem::end(it)) > 0)
+            // commits take the same lock, so nothing lands between the check and the removal
+            BucketLock lock{details.bucket_path};
+
+            // the counters can drift, only a scan of every root is sure the bucket is empty
+            std::vector<std::filesystem::path> bucket_paths = m_roots.bucketPaths(details.bucket);
+            BucketStats stats = BucketStats::scan(bucket_paths);
+            bool uploading = std::any_of(bucket_paths.begin(), bucket_paths.end(), uploadInProgress);
+
+            if ((stats.object_count > 0) || uploading)
             {
                 BOOST_LOG_TRIVIAL(error) << "Found File in Bucket";
                 ss << Response::CONFLICT << "\n";
                 ss << response.headers_str();
                 std::string response_buff(ss.str());
-                write(client_socket, response_buff.c_str(), response_buff.size());
+                send_buffer(client_socket, response_buff);
                 return;
             }
-            if (std::filesystem::remove(details.bucket_path))
+
+            for (auto &bucket_path : bucket_paths)
+                removeHiddenFiles(bucket_path);
+
+            // remove the primary last so a failure leaves the bucket listed
+            std::error_code ec;
+            std::vector<std::filesystem::path> removed;
+            for (auto &bucket_path : bucket_paths)
             {
+                if (bucket_path == details.bucket_path)
+                    continue;
+                if (!std::filesystem::remove(bucket_path, ec) && ec)
+                    break;
+                removed.push_back(bucket_path);
+            }
+            if (!ec)
+                std::filesystem::remove(details.bucket_path, ec);
+
+            if (!ec)
+            {
+                if (m_fast_tier)
+                    m_fast_tier->removeBucket(details.bucket);
+                m_list_cache.changed(details.bucket);
+                m_list_cache.changed("");
                 ss << Response::NO_CONTENT << "\n";
             }
             else
             {
-                ss << Response::SERVER_ERROR << "\n";
+                BOOST_LOG_TRIVIAL(error) << "Bucket Not Removed: " << ec.message();
+                // put back the copies already removed so later objects have a directory
+                std::error_code ignored;
+                for (auto &bucket_path : removed)
+                    std::filesystem::create_directory(bucket_path, ignored);
+
+                // an upload which started after the check
+                if (ec == std::errc::directory_not_empty)
+                    ss << Response::CONFLICT << "\n";
+                else
+                    ss << Response::SERVER_ERROR << "\n";
             }
         }
         else
@@ -589,38 +1239,176 @@ private:
 
         ss << response.headers_str();
         std::string response_buff(ss.str());
-        write(client_socket, response_buff.c_str(), response_buff.size());
+        send_buffer(client_socket, response_buff);
     }
 
-    void HEAD_OBJECT(Request &request, int client_socket, PathDetails &details)
+    /**
+     *  Remove the files the server keeps in an empty bucket directory,
+     *  so it can be removed
+     *
+     *  Compressed variants and their temporary files, the lifecycle
+     *  rules, and uploads whose PUT is no longer running.
+     */
+    static void removeHiddenFiles(const std::filesystem::path &bucket_path)
+    {
+        DirScanner scanner(bucket_path.c_str());
+        DirScanner::Entry entry;
+        while (scanner.next(entry))
+        {
+            std::string_view name = entry.name;
+            if (name.rfind(Lifecycle::RULES_FILE, 0) == 0)
+            {
+                unlinkat(scanner.fd(), entry.name, 0);
+                continue;
+            }
+            // .<hash>.gz and .<hash>.br with their temporary files, or .<hash>.<pid>
+            if (!objectFile(name) || liveUpload(name))
+                continue;
+            unlinkat(scanner.fd(), entry.name, 0);
+        }
+    }
+
+    /**
+     *  True if a worker which is still alive is uploading into the bucket directory
+     *
+     */
+    static bool uploadInProgress(const std::filesystem::path &bucket_path)
+    {
+        DirScanner scanner(bucket_path.c_str());
+        DirScanner::Entry entry;
+        while (scanner.next(entry))
+        {
+            if (objectFile(entry.name) && liveUpload(entry.name))
+                return true;
+        }
+        return false;
+    }
+
+    // a hidden file belonging to an object, .<hash>.<suffix>
+    static bool objectFile(std::string_view name)
+    {
+        return (name.size() >= 43) && (name[0] == '.') && (name.find_first_not_of("0123456789abcdef", 1) == 41) && (name[41] == '.');
+    }
+
+    // the .<hash>.<pid> temporary file of an upload whose worker is alive
+    static bool liveUpload(std::string_view name)
+    {
+        std::string_view rest = name.substr(42);
+        if (rest.find_first_not_of("0123456789") != std::string_view::npos)
+            return false;
+        pid_t pid = atoi(std::string(rest).c_str());
+        return (pid > 0) && (kill(pid, 0) == 0);
+    }
+
+    void PUT_LIFECYCLE(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("PUT_LIFECYCLE");
+
         Response response{};
 
-        std::ostringstream ss;
+        if (!std::filesystem::exists(details.bucket_path))
+        {
+            NotFound(request, client_socket);
+            return;
+        }
+
+        long length = request.contentLength();
+        if ((length <= 0) || (length > MAX_LIFECYCLE_CONFIGURATION))
+        {
+            BadRequest(request, client_socket);
+            return;
+        }
+
+        if (request.hasHeader(HEADER::EXPECT))
+            send_buffer(client_socket, std::string(Response::CONTINUE) + "\r\n\r\n");
+
+        std::string xml(length, '\0');
+        size_t received = 0;
+        ssize_t nread;
+        while ((received < xml.size()) && ((nread = recv_body(xml.data() + received, xml.size() - received)) > 0))
+            received += nread;
+        record().bytes_in += received;
+        if (received != xml.size())
+            return;
+
+        std::vector<LifecycleRule> rules;
+        std::string error;
+        if (!Lifecycle::parse(xml, rules, error))
+        {
+            LOG_DEBUG << "Lifecycle: " << error;
+            BadRequest(request, client_socket);
+            return;
+        }
+
+        BucketLock lock{details.bucket_path};
+        if (Lifecycle::save(details.bucket_path, xml))
+            send_buffer(client_socket, response.str(Response::OK));
+        else
+            send_buffer(client_socket, response.str(Response::SERVER_ERROR));
+    }
+
+    void GET_LIFECYCLE(Request &request, int client_socket, PathDetails &details)
+    {
+        record().handler = metrics().handler("GET_LIFECYCLE");
+
+        Response response{};
+        response.setContentType(".xml");
+
+        std::string xml;
+        if (!Lifecycle::read(details.bucket_path, xml))
+        {
+            NotFound(request, client_socket);
+            return;
+        }
+
+        std::pmr::string body;
+        std::ostream mesg(begin_body(request, response, body));
+        mesg.write(xml.data(), xml.size());
+
+        send_body(client_socket, response, Response::OK, body);
+    }
+
+    void DELETE_LIFECYCLE(Request &request, int client_socket, PathDetails &details)
+    {
+        record().handler = metrics().handler("DELETE_LIFECYCLE");
+
+        Response response{};
+
+        BucketLock lock{details.bucket_path};
+        if (Lifecycle::remove(details.bucket_path) || (errno == ENOENT && std::filesystem::exists(details.bucket_path)))
+            send_buffer(client_socket, response.str(Response::NO_CONTENT));
+        else
+            NotFound(request, client_socket);
+    }
+
+    void HEAD_OBJECT(Request &request, int client_socket, PathDetails &details)
+    {
+        record().handler = metrics().handler("HEAD_OBJECT");
+
+        Response response{};
+        std::string_view status = Response::OK;
 
         struct stat path_struct;
         if (stat(details.object_path.c_str(), &path_struct) == 0)
         {
-            if ((path_struct.st_mode & S_IFMT) == S_IFREG)
-            {
-                ss << Response::OK << "\n";
-                response.addHeader("Content-Length", std::to_string(path_struct.st_size));
-            }
-            else
+            if ((path_struct.st_mode & S_IFMT) != S_IFREG)
             {
                 BadRequest(request, client_socket);
+                return;
             }
+            response.setContentLength(path_struct.st_size);
         }
         else
         {
-            ss << Response::NOT_FOUND << "\n";
+            m_key_filter.falsePositive();
+            status = Response::NOT_FOUND;
         }
+        trace().mark(RequestTrace::STAT);
 
-        getAttributes(details.object_path, response.headers());
+        getAttributes(details.object_path.c_str(), response.headers());
+        trace().mark(RequestTrace::ATTRIBUTES);
 
-        ss << response.headers_str();
-        std::string response_buff(ss.str());
-        write(client_socket, response_buff.c_str(), response_buff.size());
+        send_buffer(client_socket, response.str(status));
     }
 
     /**
@@ -629,120 +1417,422 @@ private:
      */
     void HEAD_BUCKET(Request &request, int client_socket, PathDetails &details)
     {
+        record().handler = metrics().handler("HEAD_BUCKET");
+
         Response response{};
 
         std::ostringstream ss;
 
         if (std::filesystem::exists(details.bucket_path))
+        {
+            BucketStats stats;
+            if (BucketStats::read(details.bucket_path, stats))
+            {
+                response.addHeader("X-Bucket-Object-Count", std::to_string(stats.object_count));
+                response.addHeader("X-Bucket-Bytes-Used", std::to_string(stats.total_bytes));
+                if (stats.last_modified > 0)
+                {
+                    std::string last_mod{std::ctime(&stats.last_modified)};
+                    last_mod.pop_back();
+                    response.addHeader("Last-Modified", last_mod);
+                }
+            }
             ss << Response::OK << "\n";
+        }
         else
             ss << Response::NOT_FOUND << "\n";
 
         ss << response.headers_str();
         std::string response_buff(ss.str());
-        write(client_socket, response_buff.c_str(), response_buff.size());
+        send_buffer(client_socket, response_buff);
     }
 
 private:
-    void setAttributes(const std::filesystem::path &path, PathDetails &details, Response &response, Request &request)
+    /**
+     *  Move an uploaded file over the object
+     *  and update the bucket counters
+     *
+     */
+    bool commitObject(const std::filesystem::path &tmp_path, PathDetails &details, const struct stat &new_details)
     {
+        BucketLock lock{details.bucket_path};
+
+        struct stat old_details;
+        bool replaced = (stat(details.object_path.c_str(), &old_details) == 0);
 
-        std::string mime_type = response.mime_type(details.key);
-        if (setxattr(details.object_path.c_str(), PathDetails::XATT_MIME_TYPE, mime_type.c_str(), mime_type.size(), 0) < 0)
+        // visible in the filter before the object can be read
+        if (!replaced)
+            m_key_filter.add(details.bucket, details.key);
+
+        if (rename(tmp_path.c_str(), details.object_path.c_str()) != 0)
         {
-            perror(PathDetails::XATT_MIME_TYPE);
-            BOOST_LOG_TRIVIAL(error) << "FS Extended Attribute Not Set";
+            BOOST_LOG_TRIVIAL(error) << strerror(errno);
+            unlink(tmp_path.c_str());
+            if (!replaced)
+                m_key_filter.remove(details.bucket, details.key);
+            return false;
         }
+        m_list_cache.changed(details.bucket);
 
-        if (setxattr(details.object_path.c_str(), PathDetails::XATT_KEY_NAME, details.key.c_str(), details.key.size(), 0) < 0)
+        if (replaced)
         {
-            perror(PathDetails::XATT_KEY_NAME);
-            BOOST_LOG_TRIVIAL(error) << "FS Extended Attribute Not Set";
+            VariantCache::remove(details.object_path);
+            if (m_fast_tier)
+                m_fast_tier->remove(details.bucket, details.hash);
+            BucketStats::update(lock, 0, new_details.st_size - old_details.st_size, new_details.st_mtim.tv_sec);
         }
+        else
+            BucketStats::update(lock, 1, new_details.st_size, new_details.st_mtim.tv_sec);
 
-        CustomMetadata amzMetadata;
-        Headers custom = request.getCustomHeaders<CustomMetadata>(amzMetadata);
-        for (auto &h : custom)
+        return true;
+    }
+
+    /**
+     *  Remove an object and everything kept about it
+     *
+     *  Called with the bucket locked.
+     */
+    bool removeObject(PathDetails &details, const BucketLock &lock, const struct stat &details_stat)
+    {
+        if (unlink(details.object_path.c_str()) != 0)
+            return false;
+
+        VariantCache::remove(details.object_path);
+        if (m_fast_tier)
+            m_fast_tier->remove(details.bucket, details.hash);
+        m_key_filter.remove(details.bucket, details.key);
+        m_list_cache.changed(details.bucket);
+        BucketStats::update(lock, -1, -details_stat.st_size, 0);
+        return true;
+    }
+
+    /**
+     *  Remove an object found by the lifecycle sweeper at path
+     *
+     *  Looked at again with the bucket locked, so a version written
+     *  since the sweeper saw it is kept.
+     */
+    bool expireObject(const std::string &bucket, std::string_view key, const std::string &path, time_t before)
+    {
+        std::pmr::vector<std::string_view> parts{bucket, key};
+        PathDetails details(parts, m_roots);
+        details.resolve(m_roots);
+        if (std::string_view(details.object_path) != path)
+            return false;
+
+        BucketLock lock{details.bucket_path};
+        struct stat object_stat;
+        if ((stat(details.object_path.c_str(), &object_stat) != 0) || (object_stat.st_mtime > before))
+            return false;
+        if (!removeObject(details, lock, object_stat))
+            return false;
+
+        BOOST_LOG_TRIVIAL(info) << "Lifecycle Expired: " << bucket << "/" << key;
+        return true;
+    }
+
+    /**
+     *  Open a compressed variant of the object for a full GET
+     *
+     *  Picks the smallest coding the client accepts, brotli then gzip,
+     *  and sets its Content-Encoding, ETag and length on the response.
+     *  Without a current variant the object is queued to have them
+     *  built and -1 is returned so it is sent as it is.
+     */
+    int openVariant(Request &request, PathDetails &details, Response &response, const struct stat &file_details, struct stat &variant_details)
+    {
+        uint64_t size = file_details.st_size;
+        if ((size < ContentCoding::MIN_SIZE) || (size > VariantCache::MAX_SIZE) || !ContentCoding::compressible(response.getHeader("Content-Type")))
+            return -1;
+
+        // the same URL may be sent compressed or not
+        response.addHeader("Vary", "Accept-Encoding");
+
+        // ranges are of the uncompressed object
+        unsigned int accepted = ContentCoding::accepted(request.getHeader(HEADER::ACCEPT_ENCODING));
+        if (request.hasHeader(HEADER::RANGE) || (accepted == ContentCoding::bit(ContentCoding::CODING::IDENTITY)))
+            return -1;
+
+        std::string_view etag = response.getHeader("Etag");
+        bool built = false;
+        for (auto coding : {ContentCoding::CODING::BROTLI, ContentCoding::CODING::GZIP})
         {
-            std::string k = (h.first);
-            k.erase(0, amzMetadata.prefix.size());
-            std::string custom_name = std::string(PathDetails::XATT_PREFIX) + k;
-            setxattr(details.object_path.c_str(), custom_name.c_str(), h.second.c_str(), h.second.size(), 0);
+            if (!(accepted & ContentCoding::bit(coding)))
+                continue;
+
+            int fd = VariantCache::open(details.object_path, coding, etag, variant_details);
+            if (fd < 0)
+                continue;
+            built = true;
+
+            // not worth sending, the object did not compress
+            if (uint64_t(variant_details.st_size) >= size)
+                close(fd);
+            else
+            {
+                std::pmr::string variant_etag{etag};
+                variant_etag.append("-").append(ContentCoding::name(coding));
+                response.addHeader("Etag", variant_etag);
+                response.addHeader("Content-Encoding", ContentCoding::name(coding));
+                response.setContentLength(variant_details.st_size);
+                compression().sent(coding, Compression::SOURCE::VARIANT, size, variant_details.st_size);
+                return fd;
+            }
         }
+
+        if (!built)
+            m_variants.request(details.object_path, details.bucket_path);
+        return -1;
     }
 
     /**
-     *  Read the file system attrubutes back into the response Object
+     *  Add every stored key to the negative lookup filter
      *
+     *  The filter is only trusted if every object had its key in an
+     *  extended attribute and every bucket could be read.
      */
-    void getAttributes(const std::filesystem::path &path, Headers &headers)
+    void loadKeyFilter()
     {
-        ssize_t sz = getxattr(path.c_str(), PathDetails::XATT_MIME_TYPE, NULL, 0);
-        if (sz > 0)
+        if (!m_has_attributes)
         {
-            char attr[sz + 1];
-            sz = getxattr(path.c_str(), PathDetails::XATT_MIME_TYPE, attr, sz);
-            attr[sz] = '\0';
-            headers.emplace("Content-Type", std::string(attr));
+            BOOST_LOG_TRIVIAL(info) << "Key Filter Not Used: No Extended Attributes";
+            return;
         }
 
-        ssize_t attr_len = listxattr(path.c_str(), NULL, 0);
-        if (attr_len > 0)
+        size_t count = 0;
+        bool complete = true;
+        for (auto &root : m_roots.roots())
         {
-            char attr_buf[attr_len + 1];
-            attr_len = listxattr(path.c_str(), attr_buf, attr_len);
-            attr_buf[attr_len] = '\0';
-            char *key = attr_buf;
-            size_t keylen = 0;
-            while (attr_len > 0)
+            std::error_code ec;
+            for (const auto &bucket : std::filesystem::directory_iterator(root, ec))
             {
-                ssize_t val_len = getxattr(path.c_str(), key, NULL, 0);
-                if (val_len > 0)
+                if (!bucket.is_directory() || StorageRoots::isHidden(bucket.path()))
+                    continue;
+
+                std::string bucket_name = bucket.path().filename();
+                std::error_code bucket_ec;
+                for (const auto &entry : std::filesystem::directory_iterator(bucket.path(), bucket_ec))
                 {
-                    char attr_key_buf[val_len + 1];
-                    val_len = getxattr(path.c_str(), key, attr_key_buf, val_len);
-                    attr_key_buf[val_len] = 0;
-                    std::string hkey = "x-amz-meta-" + std::string(key).erase(0, strlen(PathDetails::XATT_PREFIX));
-                    headers.emplace(hkey, std::string(attr_key_buf));
-                    keylen = strlen(key) + 1;
-                    key += keylen;
-                    attr_len -= keylen;
+                    if (StorageRoots::isHidden(entry.path()))
+                        continue;
+
+                    char key[PATH_MAX];
+                    ssize_t sz = getxattr(entry.path().c_str(), PathDetails::XATT_KEY_NAME, key, sizeof(key));
+                    if (sz >= 0)
+                    {
+                        m_key_filter.add(bucket_name, std::string(key, sz));
+                        count++;
+                    }
+                    else
+                        complete = false;
                 }
+                if (bucket_ec)
+                    complete = false;
+            }
+            if (ec)
+                complete = false;
+        }
+
+        if (complete)
+        {
+            m_key_filter.setLoaded();
+            BOOST_LOG_TRIVIAL(info) << "Key Filter Loaded: " << count;
+        }
+        else
+            BOOST_LOG_TRIVIAL(warning) << "Key Filter Not Used: Objects Without Keys";
+    }
+
+    /**
+     *  False only if the object is certainly not stored
+     *
+     */
+    inline bool mayContain(std::string_view bucket, std::string_view key)
+    {
+        return !m_key_filter.loaded() || m_key_filter.mayContain(bucket, key);
+    }
+
+    /**
+     *  Read the hottest objects into the page cache
+     *
+     *  Looks each one up as a GET would, so its inode, attributes and
+     *  the key filter are warm too.
+     */
+    void warmUp()
+    {
+        std::vector<std::string> paths = HotKeys::read(m_warm_trace.empty() ? (m_roots.primary() / HOT_KEYS_FILE).string() : m_warm_trace, m_warm_limit);
+        if (paths.empty())
+            return;
+
+        auto start = std::chrono::steady_clock::now();
+        size_t objects = 0;
+        size_t bytes = 0;
+        size_t done = 0;
+        for (auto &path : paths)
+        {
+            if (stopping() || (bytes >= WARM_UP_BYTES))
+                break;
+            done++;
+            if (done * 10 / paths.size() != (done - 1) * 10 / paths.size())
+                LOG_DEBUG << "Warm Up: " << done << "/" << paths.size();
+
+            PathDetails details = getParts(path);
+            if ((details.type != PathDetails::TYPE::OBJECT) || !mayContain(details.bucket, details.key))
+                continue;
+            details.resolve(m_roots);
+
+            int fd = open(details.object_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+
+            struct stat file_details;
+            if ((fstat(fd, &file_details) == 0) && S_ISREG(file_details.st_mode))
+            {
+                size_t size = std::min<size_t>({size_t(file_details.st_size), WARM_UP_OBJECT_BYTES, WARM_UP_BYTES - bytes});
+                readahead(fd, 0, size);
+                bytes += size;
+                objects++;
+
+                Headers headers;
+                getAttributes(details.object_path.c_str(), headers);
             }
+            close(fd);
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        BOOST_LOG_TRIVIAL(info) << "Warm Up Done: " << objects << " Objects, " << (bytes >> 20) << " MB In " << elapsed.count() << " ms";
+    }
+
+    /**
+     *  Check the bucket counters against the bucket contents
+     *
+     */
+    void verifyBucketStats()
+    {
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(m_roots.primary(), ec))
+        {
+            if (!entry.is_directory() || StorageRoots::isHidden(entry.path()))
+                continue;
+
+            std::string bucket = entry.path().filename();
+            if (BucketStats::reconcile(entry.path(), m_roots.bucketPaths(bucket)))
+                BOOST_LOG_TRIVIAL(warning) << "Bucket Stats Reconciled: " << bucket;
+        }
+    }
+
+    void setAttributes(const std::filesystem::path &path, PathDetails &details, Response &response, Request &request)
+    {
+
+        std::string_view mime_type = Response::mime_type(details.key);
+        if (setxattr(path.c_str(), PathDetails::XATT_MIME_TYPE, mime_type.data(), mime_type.size(), 0) < 0)
+        {
+            perror(PathDetails::XATT_MIME_TYPE);
+            BOOST_LOG_TRIVIAL(error) << "FS Extended Attribute Not Set";
+        }
+
+        if (setxattr(path.c_str(), PathDetails::XATT_KEY_NAME, details.key.c_str(), details.key.size(), 0) < 0)
+        {
+            perror(PathDetails::XATT_KEY_NAME);
+            BOOST_LOG_TRIVIAL(error) << "FS Extended Attribute Not Set";
+        }
+
+        CustomMetadata amzMetadata;
+        Headers custom = request.getCustomHeaders<CustomMetadata>(amzMetadata);
+        for (auto &h : custom)
+        {
+            std::string custom_name = std::string(PathDetails::XATT_PREFIX) + std::string(h.first.substr(amzMetadata.prefix.size()));
+            setxattr(path.c_str(), custom_name.c_str(), h.second.c_str(), h.second.size(), 0);
         }
     }
 
+    /**
+     *  The cache key of a listing, its bucket and query
+     *
+     */
+    static std::pmr::string listKey(std::string_view bucket, const Request &request)
+    {
+        std::pmr::string key{bucket};
+        key.push_back('?');
+        for (auto &param : request.params())
+            key.append(param.first).append("=").append(param.second).append("&");
+        return key;
+    }
+
     /**
      *  Strip the fixed url parts from the full url
      *  to leave the bucket and key
      *
      *  Return object containing details of the request.
      */
-    PathDetails getParts(Request &request)
+    PathDetails getParts(Request &request, bool resolve = true)
     {
-        std::list<std::string> path_segments = request.segments();
-
-        path_segments.remove_if([this](std::string s)
-                                { return count(m_path_parts.begin(), m_path_parts.end(), s); });
+        std::pmr::vector<std::string_view> path_segments;
+        for (auto &segment : request.segments())
+        {
+            if (std::find(m_path_parts.begin(), m_path_parts.end(), std::string_view(segment)) == m_path_parts.end())
+                path_segments.push_back(segment);
+        }
 
-        PathDetails details(path_segments, getRootPath());
+        PathDetails details(path_segments, m_roots);
+        if (resolve)
+            details.resolve(m_roots);
+        trace().mark(RequestTrace::LOOKUP);
 
         return details;
     }
 
+    /**
+     *  The details of a decoded request path, not resolved
+     *
+     */
+    PathDetails getParts(std::string_view path)
+    {
+        std::pmr::vector<std::string_view> path_segments;
+        size_t start = 1;
+        while ((path.size() > 1) && (start <= path.size()))
+        {
+            size_t end = std::min(path.find('/', start), path.size());
+            std::string_view segment = path.substr(start, end - start);
+            if (std::find(m_path_parts.begin(), m_path_parts.end(), segment) == m_path_parts.end())
+                path_segments.push_back(segment);
+            start = end + 1;
+        }
+
+        return PathDetails(path_segments, m_roots);
+    }
+
+    /**
+     *  Return 404 NOT FOUND
+     *
+     */
+    void NotFound(Request &request, int client_socket)
+    {
+        Response response{};
+
+        send_buffer(client_socket, response.str(Response::NOT_FOUND));
+    }
+
     /**
      *  Return 400 BAD REQUEST
      *
      */
     void BadRequest(Request &request, int client_socket)
     {
-        std::ostringstream ss;
-        ss << Response::BAD_REQUEST << "\n";
-        std::string response_buff(ss.str());
-        write(client_socket, response_buff.c_str(), response_buff.size());
+        Response response{};
+
+        send_buffer(client_socket, response.str(Response::BAD_REQUEST));
     }
 
 private:
     std::vector<std::string> m_path_parts;
+    StorageRoots m_roots;
+    KeyFilter m_key_filter;
+    VariantCache m_variants;
+    ListCache m_list_cache;
+    std::unique_ptr<HotKeys> m_hot_keys;
+    std::string m_warm_trace;
+    size_t m_warm_limit;
+    std::unique_ptr<FastTier> m_fast_tier;
+    std::unique_ptr<Lifecycle> m_lifecycle;
     bool m_has_attributes;
 };
\ No newline at end of file
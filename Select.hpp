@@ -0,0 +1,448 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ *  Byte searches over a buffer, 16 bytes at a time with SSE2
+ *
+ *  Single bytes are left to memchr(), which glibc already vectorizes.
+ */
+struct ByteScan
+{
+    /**
+     *  The n-th occurrence of c, counting from 1, or nullptr
+     *
+     *  A whole block is skipped when it holds fewer than n, so a CSV
+     *  line is split without a call per field.
+     */
+    static const char *nth(const char *p, const char *end, char c, size_t n)
+    {
+        if (n == 0)
+            return p;
+
+#if defined(__SSE2__)
+        const __m128i match = _mm_set1_epi8(c);
+        for (; end - p >= 16; p += 16)
+        {
+            uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), match));
+            size_t count = __builtin_popcount(mask);
+            if (count < n)
+            {
+                n -= count;
+                continue;
+            }
+            while (--n > 0)
+                mask &= mask - 1;
+            return p + __builtin_ctz(mask);
+        }
+#endif
+        for (; p < end; p++)
+        {
+            if ((*p == c) && (--n == 0))
+                return p;
+        }
+        return nullptr;
+    }
+
+    /**
+     *  The first occurrence of needle, or nullptr
+     *
+     *  Compares the first and last bytes of the needle against 16
+     *  positions at once and only checks the rest where both match.
+     */
+    static const char *find(const char *p, const char *end, std::string_view needle)
+    {
+        size_t size = needle.size();
+        if ((size == 0) || (size_t(end - p) < size))
+            return (size == 0) ? p : nullptr;
+        if (size == 1)
+            return static_cast<const char *>(memchr(p, needle[0], end - p));
+
+#if defined(__SSE2__)
+        const __m128i first = _mm_set1_epi8(needle.front());
+        const __m128i last = _mm_set1_epi8(needle.back());
+        for (; end - p >= ptrdiff_t(size + 15); p += 16)
+        {
+            __m128i head = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), first);
+            __m128i tail = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + size - 1)), last);
+            uint32_t mask = _mm_movemask_epi8(_mm_and_si128(head, tail));
+            while (mask != 0)
+            {
+                const char *at = p + __builtin_ctz(mask);
+                if (memcmp(at + 1, needle.data() + 1, size - 2) == 0)
+                    return at;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        return static_cast<const char *>(memmem(p, end - p, needle.data(), size));
+    }
+};
+
+/**
+ *  Filters the lines of a CSV or NDJSON object by simple predicates
+ *
+ *  A predicate compares a CSV column, by number from 1 or by name from
+ *  the header line, or a field of a JSON line with a value using one
+ *  of = != < <= > >=. The comparison is numeric when both sides are
+ *  numbers. Every predicate must hold. When one compares for equality
+ *  with text, a block is searched for that text first and only the
+ *  lines holding it are split. CSV fields are not unquoted beyond a
+ *  pair of surrounding quotes, JSON values are compared as written
+ *  and found by the first use of their name on the line.
+ */
+class RowFilter
+{
+public:
+    static constexpr size_t MAX_PREDICATES = 16;
+
+    enum class FORMAT
+    {
+        CSV,
+        NDJSON
+    };
+
+    RowFilter(FORMAT format, char delimiter) : m_format(format), m_delimiter(delimiter), m_predicates(), m_needle() {}
+
+    /**
+     *  Read the predicates, one "column op value" per line
+     *
+     *  Returns false with error set if one cannot be read.
+     */
+    bool parse(std::string_view expression, std::string &error)
+    {
+        while (!expression.empty())
+        {
+            size_t eol = expression.find('\n');
+            std::string_view line = trim(expression.substr(0, eol));
+            expression = (eol == std::string_view::npos) ? std::string_view() : expression.substr(eol + 1);
+            if (line.empty())
+                continue;
+
+            size_t op_start = line.find_first_of("=!<>");
+            if ((op_start == 0) || (op_start == std::string_view::npos))
+            {
+                error = "Expected column op value: " + std::string(line);
+                return false;
+            }
+            size_t op_end = line.find_first_not_of("=!<>", op_start);
+            std::string_view op = line.substr(op_start, op_end - op_start);
+
+            Predicate predicate;
+            if (!operation(op, predicate.op))
+            {
+                error = "Unknown Operator: " + std::string(op);
+                return false;
+            }
+            predicate.column = trim(line.substr(0, op_start));
+            std::string_view value = trim(line.substr(std::min(op_end, line.size())));
+            if ((value.size() >= 2) && (value.front() == '"') && (value.back() == '"'))
+                value = value.substr(1, value.size() - 2);
+            predicate.value = value;
+            predicate.numeric = number(value, predicate.number);
+
+            // a column number, names are resolved by header()
+            predicate.index = -1;
+            size_t index = 0;
+            auto [end, ec] = std::from_chars(predicate.column.data(), predicate.column.data() + predicate.column.size(), index);
+            if ((m_format == FORMAT::CSV) && (ec == std::errc()) && (end == predicate.column.data() + predicate.column.size()) && (index > 0))
+                predicate.index = int(index - 1);
+
+            if (m_predicates.size() == MAX_PREDICATES)
+            {
+                error = "Too Many Predicates";
+                return false;
+            }
+            m_predicates.push_back(std::move(predicate));
+        }
+
+        if (m_predicates.empty())
+        {
+            error = "No Predicates";
+            return false;
+        }
+
+        // text which every matching line holds
+        for (auto &predicate : m_predicates)
+        {
+            if ((predicate.op == OP::EQ) && !predicate.numeric && (predicate.value.size() > m_needle.size()))
+                m_needle = predicate.value;
+        }
+        return true;
+    }
+
+    /**
+     *  Number the CSV columns named in the predicates from a header line
+     *
+     *  Returns false with error set if a name is not in it.
+     */
+    bool header(std::string_view line, std::string &error)
+    {
+        line = withoutCr(line);
+        for (auto &predicate : m_predicates)
+        {
+            if ((m_format != FORMAT::CSV) || (predicate.index >= 0))
+                continue;
+
+            const char *start = line.data();
+            const char *end = line.data() + line.size();
+            for (int index = 0; start <= end; index++)
+            {
+                const char *next = ByteScan::nth(start, end, m_delimiter, 1);
+                if (unquote(std::string_view(start, (next ? next : end) - start)) == predicate.column)
+                {
+                    predicate.index = index;
+                    break;
+                }
+                if (next == nullptr)
+                    break;
+                start = next + 1;
+            }
+        }
+        return resolved(error);
+    }
+
+    /**
+     *  Whether every CSV column has a number, without a header line
+     *
+     */
+    bool resolved(std::string &error) const
+    {
+        for (auto &predicate : m_predicates)
+        {
+            if ((m_format == FORMAT::CSV) && (predicate.index < 0))
+            {
+                error = "Unknown Column: " + predicate.column;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     *  Append the matching lines of block to out, newlines included
+     *
+     *  Only whole lines are read, unless last says the block ends the
+     *  object. Returns the bytes of block read.
+     */
+    template <class Out>
+    size_t filter(std::string_view block, bool last, Out &out) const
+    {
+        const char *begin = block.data();
+        const char *stop = static_cast<const char *>(memrchr(begin, '\n', block.size()));
+        stop = (stop != nullptr) ? stop + 1 : begin;
+        if (last)
+            stop = begin + block.size();
+
+        const char *p = begin;
+        while (p < stop)
+        {
+            // straight to the next line which can match
+            if (!m_needle.empty())
+            {
+                const char *hit = ByteScan::find(p, stop, m_needle);
+                if (hit == nullptr)
+                    break;
+                const char *start = static_cast<const char *>(memrchr(p, '\n', hit - p));
+                p = (start != nullptr) ? start + 1 : p;
+            }
+
+            const char *eol = static_cast<const char *>(memchr(p, '\n', stop - p));
+            const char *next = (eol != nullptr) ? eol + 1 : stop;
+            if (match(std::string_view(p, (eol != nullptr ? eol : stop) - p)))
+                out.append(p, next - p);
+            p = next;
+        }
+        return stop - begin;
+    }
+
+    /**
+     *  Whether a line, without its newline, holds for every predicate
+     *
+     */
+    bool match(std::string_view line) const
+    {
+        line = withoutCr(line);
+        if (line.empty())
+            return false;
+
+        for (auto &predicate : m_predicates)
+        {
+            std::string_view value;
+            if (!field(line, predicate, value) || !compare(value, predicate))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    enum class OP
+    {
+        EQ,
+        NE,
+        LT,
+        LE,
+        GT,
+        GE
+    };
+
+    struct Predicate
+    {
+        std::string column;
+        int index;  // CSV column from 0
+        OP op;
+        std::string value;
+        double number;
+        bool numeric;
+    };
+
+    static bool operation(std::string_view op, OP &result)
+    {
+        static constexpr std::pair<std::string_view, OP> ops[] = {
+            {"=", OP::EQ}, {"==", OP::EQ}, {"!=", OP::NE}, {"<>", OP::NE}, {"<", OP::LT}, {"<=", OP::LE}, {">", OP::GT}, {">=", OP::GE}};
+        for (auto &entry : ops)
+        {
+            if (entry.first == op)
+            {
+                result = entry.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool number(std::string_view text, double &value)
+    {
+        if (text.empty())
+            return false;
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return (ec == std::errc()) && (end == text.data() + text.size());
+    }
+
+    static std::string_view trim(std::string_view text)
+    {
+        size_t start = text.find_first_not_of(" \t\r");
+        if (start == std::string_view::npos)
+            return std::string_view();
+        return text.substr(start, text.find_last_not_of(" \t\r") - start + 1);
+    }
+
+    static inline std::string_view withoutCr(std::string_view line)
+    {
+        if (!line.empty() && (line.back() == '\r'))
+            line.remove_suffix(1);
+        return line;
+    }
+
+    static inline std::string_view unquote(std::string_view value)
+    {
+        if ((value.size() >= 2) && (value.front() == '"') && (value.back() == '"'))
+            return value.substr(1, value.size() - 2);
+        return value;
+    }
+
+    /**
+     *  The value a predicate compares on a line
+     *
+     */
+    bool field(std::string_view line, const Predicate &predicate, std::string_view &value) const
+    {
+        const char *begin = line.data();
+        const char *end = line.data() + line.size();
+
+        if (m_format == FORMAT::CSV)
+        {
+            const char *start = (predicate.index == 0) ? begin : ByteScan::nth(begin, end, m_delimiter, predicate.index);
+            if (start == nullptr)
+                return false;
+            if (predicate.index > 0)
+                start++;
+            const char *stop = ByteScan::nth(start, end, m_delimiter, 1);
+            value = unquote(trim(std::string_view(start, (stop ? stop : end) - start)));
+            return true;
+        }
+
+        // "name" then a colon, anything else was a value which holds the name
+        char quoted[258];
+        if (predicate.column.size() + 2 > sizeof(quoted))
+            return false;
+        quoted[0] = '"';
+        memcpy(quoted + 1, predicate.column.data(), predicate.column.size());
+        quoted[predicate.column.size() + 1] = '"';
+        std::string_view name(quoted, predicate.column.size() + 2);
+
+        for (const char *at = ByteScan::find(begin, end, name); at != nullptr; at = ByteScan::find(at + 1, end, name))
+        {
+            const char *p = at + name.size();
+            while ((p < end) && ((*p == ' ') || (*p == '\t')))
+                p++;
+            if ((p == end) || (*p != ':'))
+                continue;
+            p++;
+            while ((p < end) && ((*p == ' ') || (*p == '\t')))
+                p++;
+            if (p == end)
+                return false;
+
+            if (*p == '"')
+            {
+                const char *close = ++p;
+                while ((close < end) && (*close != '"'))
+                    close += (*close == '\\') ? 2 : 1;
+                value = std::string_view(p, std::min(close, end) - p);
+            }
+            else
+            {
+                const char *close = p;
+                while ((close < end) && (*close != ',') && (*close != '}') && (*close != ']'))
+                    close++;
+                value = trim(std::string_view(p, close - p));
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static bool compare(std::string_view value, const Predicate &predicate)
+    {
+        int order;
+        double number;
+        if (predicate.numeric && RowFilter::number(value, number))
+            order = (number < predicate.number) ? -1 : ((number > predicate.number) ? 1 : 0);
+        else if (predicate.numeric && (predicate.op != OP::EQ) && (predicate.op != OP::NE))
+            return false;  // a range of numbers holds no text
+        else
+            order = value.compare(predicate.value);
+
+        switch (predicate.op)
+        {
+        case OP::EQ:
+            return order == 0;
+        case OP::NE:
+            return order != 0;
+        case OP::LT:
+            return order < 0;
+        case OP::LE:
+            return order <= 0;
+        case OP::GT:
+            return order > 0;
+        case OP::GE:
+            return order >= 0;
+        }
+        return false;
+    }
+
+    FORMAT m_format;
+    char m_delimiter;
+    std::vector<Predicate> m_predicates;
+    std::string m_needle;
+};
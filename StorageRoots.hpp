@@ -0,0 +1,252 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+
+#include <boost/log/trivial.hpp>
+
+/**
+ *  A set of storage roots (JBOD)
+ *
+ *  Objects are placed on a root by consistent hashing of the
+ *  object hash, so adding a root only moves the objects which
+ *  now belong to it.
+ *  Bucket directories are mirrored on every root.
+ *
+ */
+class StorageRoots
+{
+public:
+    StorageRoots(const std::vector<std::string> &roots, unsigned int vnodes = 256) : m_roots(), m_ring()
+    {
+        if (roots.empty())
+            throw std::runtime_error("No Storage Roots");
+
+        for (auto &root : roots)
+            m_roots.emplace_back(root);
+
+        // each root owns a number of virtual points on the ring
+        for (size_t i = 0; i < m_roots.size(); i++)
+        {
+            for (unsigned int v = 0; v < vnodes; v++)
+            {
+                std::string point = m_roots[i].string() + "#" + std::to_string(v);
+                m_ring.emplace_back(mix(fnv1a(point)), i);
+            }
+        }
+        std::sort(m_ring.begin(), m_ring.end());
+    }
+
+    inline const std::filesystem::path &primary() const { return m_roots.front(); }
+    inline const std::vector<std::filesystem::path> &roots() const { return m_roots; }
+
+    /**
+     *  Return the root which owns the object hash
+     *
+     */
+    const std::filesystem::path &locate(std::string_view hash) const
+    {
+        uint64_t h = mix(fnv1a(hash));
+        auto it = std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(h, size_t(0)));
+        if (it == m_ring.end())
+            it = m_ring.begin();
+        return m_roots[it->second];
+    }
+
+    /**
+     *  The bucket directory on every root
+     *
+     */
+    std::vector<std::filesystem::path> bucketPaths(std::string_view bucket) const
+    {
+        std::vector<std::filesystem::path> paths;
+        for (auto &root : m_roots)
+            paths.push_back(root / bucket);
+        return paths;
+    }
+
+    /**
+     *  Mirror the buckets on every root and move any objects
+     *  which are not on the root that owns them.
+     *
+     *  Only needed after the set of roots changes.
+     *  Return the number of objects moved.
+     */
+    size_t rebalance() const
+    {
+        size_t moved = 0;
+
+        for (auto &root : m_roots)
+        {
+            for (const auto &bucket : std::filesystem::directory_iterator(root))
+            {
+                if (!bucket.is_directory() || isHidden(bucket.path()))
+                    continue;
+                for (auto &other : m_roots)
+                    std::filesystem::create_directories(other / bucket.path().filename());
+            }
+        }
+
+        for (auto &root : m_roots)
+        {
+            for (const auto &bucket : std::filesystem::directory_iterator(root))
+            {
+                if (!bucket.is_directory() || isHidden(bucket.path()))
+                    continue;
+
+                for (const auto &entry : std::filesystem::directory_iterator(bucket.path()))
+                {
+                    if (isHidden(entry.path()))
+                        continue;
+
+                    std::string hash = entry.path().filename();
+                    const std::filesystem::path &owner = locate(hash);
+                    if (owner == root)
+                        continue;
+
+                    std::filesystem::path target = owner / bucket.path().filename() / hash;
+                    if (moveObject(entry.path(), target))
+                        moved++;
+                    else
+                        BOOST_LOG_TRIVIAL(error) << "Cannot Move Object: " << entry.path();
+                }
+            }
+        }
+
+        if (moved > 0)
+            BOOST_LOG_TRIVIAL(info) << "Rebalanced Objects: " << moved;
+
+        return moved;
+    }
+
+    /**
+     *  Move an object file and its extended attributes.
+     *
+     *  Uses rename() on the same filesystem, otherwise copies the
+     *  object next to the target and renames it into place.
+     */
+    static bool moveObject(const std::filesystem::path &from, const std::filesystem::path &to)
+    {
+        if (rename(from.c_str(), to.c_str()) == 0)
+            return true;
+        if (errno != EXDEV)
+            return false;
+
+        std::filesystem::path tmp = to;
+        tmp += ".moving";
+
+        int in_fd = open(from.c_str(), O_RDONLY);
+        if (in_fd < 0)
+            return false;
+        int out_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0)
+        {
+            close(in_fd);
+            return false;
+        }
+
+        bool ok = copyContent(in_fd, out_fd) && copyAttributes(in_fd, out_fd);
+        close(in_fd);
+        ok = (fsync(out_fd) == 0) && ok;
+        close(out_fd);
+
+        if (ok && rename(tmp.c_str(), to.c_str()) == 0)
+            return unlink(from.c_str()) == 0;
+
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    /**
+     *  Dot entries in a root are server state, not buckets
+     *
+     */
+    static inline bool isHidden(const std::filesystem::path &path)
+    {
+        std::string name = path.filename();
+        return !name.empty() && name[0] == '.';
+    }
+
+    /**
+     *  Copy the whole content of one open file to another
+     *
+     */
+    static bool copyContent(int in_fd, int out_fd)
+    {
+        struct stat details;
+        if (fstat(in_fd, &details) != 0)
+            return false;
+
+        off_t off = 0;
+        while (off < details.st_size)
+        {
+            ssize_t sent = sendfile(out_fd, in_fd, &off, details.st_size - off);
+            if (sent <= 0)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // FNV-1a of the near identical point names and hashes clusters on
+    // the ring, the murmur3 finalizer spreads them out
+    static inline uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint64_t fnv1a(std::string_view value)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : value)
+        {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static bool copyAttributes(int in_fd, int out_fd)
+    {
+        ssize_t list_len = flistxattr(in_fd, NULL, 0);
+        if (list_len <= 0)
+            return list_len == 0 || errno == ENOTSUP;
+
+        std::vector<char> names(list_len);
+        list_len = flistxattr(in_fd, names.data(), names.size());
+        for (ssize_t pos = 0; pos < list_len; pos += strlen(&names[pos]) + 1)
+        {
+            const char *name = &names[pos];
+            ssize_t val_len = fgetxattr(in_fd, name, NULL, 0);
+            if (val_len < 0)
+                return false;
+            std::vector<char> value(val_len);
+            val_len = fgetxattr(in_fd, name, value.data(), value.size());
+            if (fsetxattr(out_fd, name, value.data(), val_len, 0) != 0)
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<std::filesystem::path> m_roots;
+    std::vector<std::pair<uint64_t, size_t>> m_ring;
+};
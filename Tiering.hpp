@@ -0,0 +1,382 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <memory_resource>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <new>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "StorageRoots.hpp"
+#include "DirScanner.hpp"
+#include "Compression.hpp"
+#include "WarmUp.hpp"
+
+/**
+ *  A fast storage tier holding copies of the most read objects
+ *
+ *  Every object stays on the capacity root which owns it. Promoting
+ *  one copies it to the same bucket and hash under the fast root and
+ *  then marks the capacity file with the ETag of the version copied,
+ *  so a GET learns the tier from the attributes of the file it has
+ *  already found and never looks in both places. A new version is a
+ *  new file without the mark. Demoting removes the mark before the
+ *  copy, so a reader always has either the copy or the object.
+ *
+ *  Reads from the capacity tier are counted in shared memory like the
+ *  hot keys, a background mover promotes the ones read most and
+ *  demotes copies whose last read, kept in an attribute on the copy,
+ *  is too long ago or which do not fit in the fast tier any more.
+ */
+class FastTier
+{
+public:
+    static constexpr const char *XATT_TIER = "user.Tier.Fast";       // on the capacity file, the ETag copied
+    static constexpr const char *XATT_SOURCE = "user.Tier.Source";   // on the copy, the ETag copied
+    static constexpr const char *XATT_ACCESSED = "user.Tier.Accessed";
+    static constexpr uint32_t PROMOTE_HITS = 4;   // reads in a mover interval, halved every interval
+    static constexpr size_t PROMOTE_BATCH = 64;
+    static constexpr time_t ACCESS_GRANULARITY = 60;  // the last read of a copy is written at most this often
+
+    FastTier(const std::string &root, const StorageRoots &roots, uint64_t max_bytes, time_t demote_after, time_t interval)
+        : m_root(root), m_roots(roots), m_max_bytes(max_bytes), m_demote_after(demote_after), m_interval(interval), m_hits(), m_shared(nullptr)
+    {
+        std::filesystem::create_directories(m_root);
+
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Fast Tier");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~FastTier()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    FastTier(const FastTier &) = delete;
+    FastTier &operator=(const FastTier &) = delete;
+
+    /**
+     *  Open the copy of the object at path if the version with etag is promoted
+     *
+     *  Returns -1 when it is read from the capacity tier.
+     */
+    int open(const char *path, std::string_view bucket, std::string_view hash, std::string_view etag)
+    {
+        char mark[64];
+        ssize_t sz = getxattr(path, XATT_TIER, mark, sizeof(mark));
+        if ((sz < 0) || (std::string_view(mark, sz) != etag))
+        {
+            m_shared->capacity_reads.fetch_add(1, std::memory_order_relaxed);
+            return -1;
+        }
+
+        // demoted since the mark was read
+        int fd = ::open(copyPath(bucket, hash).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            m_shared->capacity_reads.fetch_add(1, std::memory_order_relaxed);
+            return -1;
+        }
+
+        touch(fd);
+        m_shared->fast_reads.fetch_add(1, std::memory_order_relaxed);
+        return fd;
+    }
+
+    /**
+     *  Count a read of an object from the capacity tier
+     *
+     */
+    void hit(std::string_view bucket, std::string_view hash)
+    {
+        char key[HotKeys::PATH_LEN];
+        if (bucket.size() + hash.size() + 1 >= sizeof(key))
+            return;
+
+        memcpy(key, bucket.data(), bucket.size());
+        key[bucket.size()] = '/';
+        memcpy(key + bucket.size() + 1, hash.data(), hash.size());
+        m_hits.hit(std::string_view(key, bucket.size() + 1 + hash.size()));
+    }
+
+    /**
+     *  Remove the copy of an object which is deleted or replaced
+     *
+     */
+    void remove(std::string_view bucket, std::string_view hash)
+    {
+        unlink(copyPath(bucket, hash).c_str());
+    }
+
+    /**
+     *  Remove the copies of a deleted bucket
+     *
+     */
+    void removeBucket(std::string_view bucket)
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(m_root / bucket, ec);
+    }
+
+    /**
+     *  Demote the copies which have gone cold, then promote the objects
+     *  read most, run by a background task
+     *
+     */
+    void move()
+    {
+        time_t now = time(nullptr);
+        std::vector<Copy> copies;
+        uint64_t total = scan(now, copies);
+
+        // least recently read first, the first to make room
+        std::sort(copies.begin(), copies.end(), [](const Copy &a, const Copy &b) { return a.accessed < b.accessed; });
+        size_t next = 0;
+
+        for (auto &key : m_hits.top(PROMOTE_BATCH, PROMOTE_HITS))
+        {
+            size_t slash = key.find('/');
+            if (slash == std::string::npos)
+                continue;
+            std::string bucket = key.substr(0, slash);
+            std::string hash = key.substr(slash + 1);
+            std::filesystem::path path = m_roots.locate(hash) / bucket / hash;
+
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+
+            struct stat details;
+            char buf[64];
+            if ((fstat(fd, &details) != 0) || !S_ISREG(details.st_mode) || promoted(fd, VariantCache::etag(details, buf)) || (uint64_t(details.st_size) > m_max_bytes))
+            {
+                close(fd);
+                continue;
+            }
+
+            // only copies not read since the last run make room
+            while ((total + details.st_size > m_max_bytes) && (next < copies.size()) && (copies[next].accessed < now - m_interval))
+            {
+                if (demote(copies[next].bucket, copies[next].hash))
+                    total -= copies[next].size;
+                next++;
+            }
+
+            if ((total + details.st_size <= m_max_bytes) && promote(fd, details, bucket, hash))
+                total += details.st_size;
+            close(fd);
+        }
+
+        m_hits.decay();
+        m_shared->fast_bytes.store(total, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        out << "# HELP tier_reads_total Objects read by tier.\n";
+        out << "# TYPE tier_reads_total counter\n";
+        out << "tier_reads_total{tier=\"fast\"} " << m_shared->fast_reads.load(std::memory_order_relaxed) << "\n";
+        out << "tier_reads_total{tier=\"capacity\"} " << m_shared->capacity_reads.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP tier_promotions_total Objects copied to the fast tier.\n";
+        out << "# TYPE tier_promotions_total counter\n";
+        out << "tier_promotions_total " << m_shared->promotions.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP tier_demotions_total Copies removed from the fast tier.\n";
+        out << "# TYPE tier_demotions_total counter\n";
+        out << "tier_demotions_total " << m_shared->demotions.load(std::memory_order_relaxed) << "\n";
+        out << "# HELP tier_fast_bytes Bytes of the copies in the fast tier.\n";
+        out << "# TYPE tier_fast_bytes gauge\n";
+        out << "tier_fast_bytes " << m_shared->fast_bytes.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    struct Copy
+    {
+        std::string bucket;
+        std::string hash;
+        time_t accessed;
+        uint64_t size;
+    };
+
+    struct Shared
+    {
+        std::atomic<uint64_t> fast_reads{0};
+        std::atomic<uint64_t> capacity_reads{0};
+        std::atomic<uint64_t> promotions{0};
+        std::atomic<uint64_t> demotions{0};
+        std::atomic<uint64_t> fast_bytes{0};
+    };
+
+    std::pmr::string copyPath(std::string_view bucket, std::string_view hash) const
+    {
+        std::pmr::string path{m_root.native()};
+        path.append("/").append(bucket).append("/").append(hash);
+        return path;
+    }
+
+    static time_t accessed(const char *value, ssize_t size)
+    {
+        time_t time = 0;
+        if (size > 0)
+            std::from_chars(value, value + size, time);
+        return time;
+    }
+
+    // note a read of a copy, the attribute is only written once a minute
+    static void touch(int fd)
+    {
+        char value[24];
+        time_t now = time(nullptr);
+        if (now - accessed(value, fgetxattr(fd, XATT_ACCESSED, value, sizeof(value))) < ACCESS_GRANULARITY)
+            return;
+
+        char *end = std::to_chars(value, value + sizeof(value), now).ptr;
+        fsetxattr(fd, XATT_ACCESSED, value, end - value, 0);
+    }
+
+    static bool promoted(int fd, std::string_view etag)
+    {
+        char mark[64];
+        ssize_t sz = fgetxattr(fd, XATT_TIER, mark, sizeof(mark));
+        return (sz >= 0) && (std::string_view(mark, sz) == etag);
+    }
+
+    /**
+     *  Find every copy and its last read, demoting the cold ones and
+     *  removing those of objects which have changed
+     *
+     *  Return the bytes of the copies kept.
+     */
+    uint64_t scan(time_t now, std::vector<Copy> &copies)
+    {
+        uint64_t total = 0;
+        DirScanner root(m_root.c_str());
+        DirScanner::Entry bucket;
+        while (root.next(bucket))
+        {
+            if (bucket.name[0] == '.')
+                continue;
+
+            std::string bucket_name = bucket.name;
+            std::string bucket_path = (m_root / bucket_name).string();
+            DirScanner scanner(bucket_path.c_str());
+            DirScanner::Entry entry;
+            while (scanner.next(entry))
+            {
+                // a promotion cut short by a restart
+                if (entry.name[0] == '.')
+                {
+                    unlinkat(scanner.fd(), entry.name, 0);
+                    continue;
+                }
+
+                std::string hash = entry.name;
+                char source[64], mark[64], value[24];
+                ssize_t source_size = scanner.attribute(entry.name, XATT_SOURCE, source, sizeof(source));
+                ssize_t mark_size = getxattr((m_roots.locate(hash) / bucket_name / hash).c_str(), XATT_TIER, mark, sizeof(mark));
+                if ((source_size < 0) || (mark_size < 0) || (std::string_view(source, source_size) != std::string_view(mark, mark_size)))
+                {
+                    unlinkat(scanner.fd(), entry.name, 0);
+                    continue;
+                }
+
+                time_t last = accessed(value, scanner.attribute(entry.name, XATT_ACCESSED, value, sizeof(value)));
+                struct statx details;
+                if (!scanner.stat(entry.name, STATX_SIZE, details))
+                    continue;
+
+                if (now - last >= m_demote_after)
+                {
+                    demote(bucket_name, hash);
+                    continue;
+                }
+
+                copies.push_back({bucket_name, hash, last, details.stx_size});
+                total += details.stx_size;
+            }
+        }
+        return total;
+    }
+
+    /**
+     *  Copy an open object to the fast tier, then mark it as promoted
+     *
+     */
+    bool promote(int fd, const struct stat &details, const std::string &bucket, const std::string &hash)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(m_root / bucket, ec);
+
+        std::filesystem::path copy = m_root / bucket / hash;
+        std::filesystem::path tmp = m_root / bucket / ("." + hash + ".promoting");
+        int out_fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0)
+            return false;
+
+        char buf[64], now[24];
+        std::string_view etag = VariantCache::etag(details, buf);
+        char *end = std::to_chars(now, now + sizeof(now), time(nullptr)).ptr;
+
+        // on disk before the mark can point readers at it
+        bool ok = StorageRoots::copyContent(fd, out_fd) && (fsetxattr(out_fd, XATT_SOURCE, etag.data(), etag.size(), 0) == 0) &&
+                  (fsetxattr(out_fd, XATT_ACCESSED, now, end - now, 0) == 0) && (fsync(out_fd) == 0);
+        close(out_fd);
+
+        // the mark goes on the version copied, even if it was replaced meanwhile
+        if (!ok || (rename(tmp.c_str(), copy.c_str()) != 0) || (fsetxattr(fd, XATT_TIER, etag.data(), etag.size(), 0) != 0))
+        {
+            BOOST_LOG_TRIVIAL(error) << "Cannot Promote Object: " << bucket << "/" << hash;
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        m_shared->promotions.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     *  Unmark an object, then remove its copy
+     *
+     */
+    bool demote(const std::string &bucket, const std::string &hash)
+    {
+        std::filesystem::path path = m_roots.locate(hash) / bucket / hash;
+        if ((removexattr(path.c_str(), XATT_TIER) != 0) && (errno != ENODATA) && (errno != ENOENT))
+            return false;
+
+        remove(bucket, hash);
+        m_shared->demotions.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    std::filesystem::path m_root;
+    const StorageRoots &m_roots;
+    uint64_t m_max_bytes;
+    time_t m_demote_after;
+    time_t m_interval;
+    HotKeys m_hits;
+    Shared *m_shared;
+};
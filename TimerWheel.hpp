@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ *  A timer owned by the caller and linked into the wheel while armed
+ *
+ */
+struct Timer
+{
+    Timer() : next(this), prev(this), expires(0), id(0) {}
+
+    inline bool armed() const { return next != this; }
+
+    Timer *next;
+    Timer *prev;
+    uint64_t expires;
+    size_t id;
+};
+
+/**
+ *  Hierarchical timer wheel
+ *
+ *  4 levels of 64 slots, each level covering 64 times the range of
+ *  the one below. Arming and cancelling a timer are O(1), timers in
+ *  the upper levels cascade down as the wheel turns.
+ *  Times are in milliseconds, resolution is one tick.
+ */
+class TimerWheel
+{
+public:
+    static constexpr unsigned int LEVELS = 4;
+    static constexpr unsigned int SLOT_BITS = 6;
+    static constexpr unsigned int SLOTS = 1 << SLOT_BITS;
+
+    TimerWheel(uint64_t now_ms, uint64_t tick_ms = 10) : m_tick_ms(tick_ms), m_current(now_ms / tick_ms), m_armed(0)
+    {
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    void arm(Timer &timer, uint64_t expires_ms)
+    {
+        if (timer.armed())
+            unlink(timer);
+        else
+            m_armed++;
+
+        timer.expires = expires_ms / m_tick_ms;
+        insert(timer, m_current + 1);
+    }
+
+    void cancel(Timer &timer)
+    {
+        if (timer.armed())
+        {
+            unlink(timer);
+            m_armed--;
+        }
+    }
+
+    inline size_t armed() const { return m_armed; }
+    inline uint64_t tick_ms() const { return m_tick_ms; }
+
+    /**
+     *  Turn the wheel to now and call expired(timer) for every
+     *  timer which is due. The timer is disarmed before the call
+     *  and may be armed again from the callback.
+     */
+    template <typename F>
+    void advance(uint64_t now_ms, F expired)
+    {
+        uint64_t target = now_ms / m_tick_ms;
+
+        while (m_current < target)
+        {
+            if (m_armed == 0)
+            {
+                m_current = target;
+                break;
+            }
+
+            m_current++;
+
+            // move timers down from the level above when a level wraps
+            for (unsigned int level = 1; level < LEVELS; level++)
+            {
+                if ((m_current & mask(level - 1)) != 0)
+                    break;
+                cascade(level, (m_current >> (level * SLOT_BITS)) & (SLOTS - 1));
+            }
+
+            Timer &head = m_slots[0][m_current & (SLOTS - 1)];
+            while (head.next != &head)
+            {
+                Timer *timer = head.next;
+                unlink(*timer);
+                m_armed--;
+                expired(*timer);
+            }
+        }
+    }
+
+private:
+    static inline uint64_t mask(unsigned int level)
+    {
+        return (uint64_t(1) << ((level + 1) * SLOT_BITS)) - 1;
+    }
+
+    /**
+     *  Link a timer into the slot for its expiry, no earlier than the earliest tick
+     *
+     */
+    void insert(Timer &timer, uint64_t earliest)
+    {
+        uint64_t expires = timer.expires > earliest ? timer.expires : earliest;
+        uint64_t delta = expires - m_current;
+
+        unsigned int level = 0;
+        while ((level < LEVELS - 1) && (delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS))))
+            level++;
+
+        // beyond the range of the wheel, park in the furthest slot
+        if (delta >= (uint64_t(1) << (LEVELS * SLOT_BITS)))
+            expires = m_current + (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
+
+        link(m_slots[level][(expires >> (level * SLOT_BITS)) & (SLOTS - 1)], timer);
+    }
+
+    void cascade(unsigned int level, size_t slot)
+    {
+        Timer &head = m_slots[level][slot];
+        while (head.next != &head)
+        {
+            Timer *timer = head.next;
+            unlink(*timer);
+            insert(*timer, m_current);
+        }
+    }
+
+    static inline void link(Timer &head, Timer &timer)
+    {
+        timer.next = &head;
+        timer.prev = head.prev;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+
+    static inline void unlink(Timer &timer)
+    {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.next = &timer;
+        timer.prev = &timer;
+    }
+
+    uint64_t m_tick_ms;
+    uint64_t m_current;
+    size_t m_armed;
+    Timer m_slots[LEVELS][SLOTS];
+};
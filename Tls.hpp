@@ -0,0 +1,356 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <new>
+
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/**
+ *  TLS for the server socket
+ *
+ *  OpenSSL does the handshake and hands the session keys to kernel
+ *  TLS when it can, so the workers keep reading, writing and
+ *  sendfile()ing the socket as if it were plain text.
+ *  Created in the parent before it forks, the connection counters
+ *  live in a shared anonymous mapping like the Metrics.
+ */
+class TlsContext
+{
+public:
+    enum class MODE
+    {
+        KTLS,       // kernel encrypts and decrypts
+        KTLS_SEND,  // kernel encrypts, received records are decrypted by a relay
+        RELAY,      // no kernel TLS, a relay does both
+        COUNT
+    };
+
+    TlsContext(const std::string &cert_file, const std::string &key_file) : m_ctx(nullptr), m_shared(nullptr), m_http2(false)
+    {
+        m_ctx = SSL_CTX_new(TLS_server_method());
+        if (m_ctx == nullptr)
+            throw std::runtime_error("Cannot Create TLS Context");
+
+        SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+        SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+
+        if ((SSL_CTX_use_certificate_chain_file(m_ctx, cert_file.c_str()) != 1) ||
+            (SSL_CTX_use_PrivateKey_file(m_ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1) ||
+            (SSL_CTX_check_private_key(m_ctx) != 1))
+        {
+            SSL_CTX_free(m_ctx);
+            throw std::runtime_error("Cannot Load TLS Certificate");
+        }
+
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            SSL_CTX_free(m_ctx);
+            throw std::runtime_error("Cannot Map TLS Counters");
+        }
+        m_shared = new (mem) Shared();
+
+        SSL_CTX_set_alpn_select_cb(m_ctx, selectProtocol, this);
+    }
+
+    ~TlsContext()
+    {
+        munmap(m_shared, sizeof(Shared));
+        SSL_CTX_free(m_ctx);
+    }
+
+    TlsContext(const TlsContext &) = delete;
+    TlsContext &operator=(const TlsContext &) = delete;
+
+    inline SSL_CTX *ctx() { return m_ctx; }
+
+    /**
+     *  Offer h2 to clients which ask for it with ALPN
+     *
+     */
+    inline void enableHttp2() { m_http2 = true; }
+
+    inline void count(MODE mode)
+    {
+        m_shared->connections[size_t(mode)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void failed()
+    {
+        m_shared->failed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static inline const char *name(MODE mode)
+    {
+        switch (mode)
+        {
+        case MODE::KTLS:
+            return "ktls";
+        case MODE::KTLS_SEND:
+            return "ktls_send";
+        default:
+            return "relay";
+        }
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        out << "# HELP tls_connections_total TLS connections by how they are encrypted.\n";
+        out << "# TYPE tls_connections_total counter\n";
+        for (size_t i = 0; i < size_t(MODE::COUNT); i++)
+            out << "tls_connections_total{mode=\"" << name(MODE(i)) << "\"} " << m_shared->connections[i].load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP tls_handshake_failures_total TLS handshakes which failed or timed out.\n";
+        out << "# TYPE tls_handshake_failures_total counter\n";
+        out << "tls_handshake_failures_total " << m_shared->failed.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    static int selectProtocol(SSL *, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg)
+    {
+        static const unsigned char h2[] = "\x02h2\x08http/1.1";
+        static const unsigned char http1[] = "\x08http/1.1";
+
+        bool http2 = static_cast<TlsContext *>(arg)->m_http2;
+        const unsigned char *server = http2 ? h2 : http1;
+        unsigned int server_len = http2 ? sizeof(h2) - 1 : sizeof(http1) - 1;
+
+        // a client offering neither still gets HTTP/1.1
+        if (SSL_select_next_proto(const_cast<unsigned char **>(out), outlen, server, server_len, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+            return SSL_TLSEXT_ERR_NOACK;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    struct Shared
+    {
+        std::atomic<uint64_t> connections[size_t(MODE::COUNT)]{};
+        std::atomic<uint64_t> failed{0};
+    };
+
+    SSL_CTX *m_ctx;
+    Shared *m_shared;
+    bool m_http2;
+};
+
+/**
+ *  One TLS connection in a worker process
+ *
+ *  With kernel TLS both ways the socket is used directly. When the
+ *  kernel only encrypts, a relay thread decrypts what the client sends
+ *  into a socketpair the requests are read from and responses still
+ *  go straight to the socket. Without kernel TLS the relay carries
+ *  both directions and encrypts in user space.
+ */
+class TlsConnection
+{
+public:
+    TlsConnection(TlsContext &context, int socket) : m_context(context), m_socket(socket), m_ssl(nullptr), m_mode(TlsContext::MODE::RELAY), m_input(socket), m_output(socket), m_relay(-1), m_thread()
+    {
+    }
+
+    ~TlsConnection()
+    {
+        close();
+        if (m_ssl != nullptr)
+            SSL_free(m_ssl);
+    }
+
+    TlsConnection(const TlsConnection &) = delete;
+    TlsConnection &operator=(const TlsConnection &) = delete;
+
+    /**
+     *  Do the handshake and set up the connection
+     *
+     *  Returns false if it fails or timed_out is set while waiting.
+     */
+    bool accept(const volatile sig_atomic_t &timed_out)
+    {
+        m_ssl = SSL_new(m_context.ctx());
+        if ((m_ssl == nullptr) || (SSL_set_fd(m_ssl, m_socket) != 1))
+        {
+            m_context.failed();
+            return false;
+        }
+
+        int result;
+        while ((result = SSL_accept(m_ssl)) != 1)
+        {
+            int error = SSL_get_error(m_ssl, result);
+            if (((error != SSL_ERROR_WANT_READ) && (error != SSL_ERROR_WANT_WRITE)) || timed_out)
+            {
+                m_context.failed();
+                return false;
+            }
+        }
+
+        bool ktls_send = false;
+        bool ktls_recv = false;
+#ifndef OPENSSL_NO_KTLS
+        ktls_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+        ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl));
+#endif
+        if (ktls_send && ktls_recv)
+            m_mode = TlsContext::MODE::KTLS;
+        else if (ktls_send)
+            m_mode = TlsContext::MODE::KTLS_SEND;
+        else
+            m_mode = TlsContext::MODE::RELAY;
+        m_context.count(m_mode);
+
+        if (m_mode == TlsContext::MODE::KTLS)
+            return true;
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+            return false;
+
+        m_input = fds[0];
+        m_output = (m_mode == TlsContext::MODE::RELAY) ? fds[0] : m_socket;
+        m_relay = fds[1];
+
+        // timeouts must interrupt the worker, not the relay
+        sigset_t block, previous;
+        sigemptyset(&block);
+        sigaddset(&block, SIGALRM);
+        pthread_sigmask(SIG_BLOCK, &block, &previous);
+        m_thread = std::thread([this]() { relay(m_mode == TlsContext::MODE::RELAY); });
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+        return true;
+    }
+
+    /**
+     *  Read requests from input, write responses to output
+     *
+     */
+    inline int input() const { return m_input; }
+    inline int output() const { return m_output; }
+    inline TlsContext::MODE mode() const { return m_mode; }
+
+    /**
+     *  The protocol agreed with ALPN, empty if there was none
+     *
+     */
+    std::string_view alpn() const
+    {
+        const unsigned char *protocol = nullptr;
+        unsigned int length = 0;
+        SSL_get0_alpn_selected(m_ssl, &protocol, &length);
+        return std::string_view(reinterpret_cast<const char *>(protocol), length);
+    }
+
+    /**
+     *  Flush what the relay holds and send close_notify
+     *
+     */
+    void close()
+    {
+        if (m_thread.joinable())
+        {
+            // the relay sends what is left then sees the end of the pair
+            shutdown(m_input, SHUT_RDWR);
+            m_thread.join();
+            ::close(m_input);
+            ::close(m_relay);
+            m_input = m_output = m_socket;
+        }
+
+        if ((m_ssl != nullptr) && SSL_is_init_finished(m_ssl) && !(SSL_get_shutdown(m_ssl) & SSL_SENT_SHUTDOWN))
+            SSL_shutdown(m_ssl);
+    }
+
+private:
+    /**
+     *  Decrypt from the socket into the pair, and with outbound
+     *  encrypt from the pair to the socket, until either end closes
+     */
+    void relay(bool outbound)
+    {
+        char buffer[16384];
+        struct pollfd fds[2] = {{m_socket, POLLIN, 0}, {m_relay, short(outbound ? POLLIN : 0), 0}};
+
+        while (true)
+        {
+            // a record already read by OpenSSL will not show on the socket
+            int ready = poll(fds, 2, SSL_pending(m_ssl) > 0 ? 0 : -1);
+            if ((ready < 0) && (errno != EINTR))
+                break;
+
+            if ((fds[0].revents != 0) || (SSL_pending(m_ssl) > 0))
+            {
+                int nread = SSL_read(m_ssl, buffer, sizeof(buffer));
+                if (nread <= 0)
+                {
+                    int error = SSL_get_error(m_ssl, nread);
+                    if ((error != SSL_ERROR_WANT_READ) && (error != SSL_ERROR_WANT_WRITE))
+                    {
+                        // the client is done sending, responses may still be going out
+                        shutdown(m_relay, SHUT_WR);
+                        if (!outbound)
+                            break;
+                        fds[0].fd = -1;
+                    }
+                }
+                else if (!sendAll(m_relay, buffer, nread))
+                    break;
+            }
+
+            if (fds[1].revents != 0)
+            {
+                if (!outbound)
+                    break;
+
+                ssize_t nread = read(m_relay, buffer, sizeof(buffer));
+                if ((nread <= 0) || (SSL_write(m_ssl, buffer, nread) <= 0))
+                    break;
+            }
+        }
+
+        // the worker sees the connection close
+        shutdown(m_relay, SHUT_RDWR);
+    }
+
+    static bool sendAll(int fd, const char *buffer, size_t len)
+    {
+        size_t sent = 0;
+        while (sent < len)
+        {
+            ssize_t nsent = send(fd, buffer + sent, len - sent, MSG_NOSIGNAL);
+            if (nsent <= 0)
+            {
+                if ((nsent < 0) && (errno == EINTR))
+                    continue;
+                return false;
+            }
+            sent += nsent;
+        }
+        return true;
+    }
+
+    TlsContext &m_context;
+    int m_socket;
+    SSL *m_ssl;
+    TlsContext::MODE m_mode;
+    int m_input;
+    int m_output;
+    int m_relay;
+    std::thread m_thread;
+};
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include <new>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ *  The most requested objects, to warm the caches with after a restart
+ *
+ *  Workers count the paths of the objects they send in a shared
+ *  anonymous mapping created before the server forks. A slot held by
+ *  one path is worn down by hits on others which share it and taken
+ *  over at zero, so hot paths keep their slots, as in HeavyKeeper.
+ *  A background task saves the top paths and halves the counts, so
+ *  the list follows what is hot now.
+ */
+class HotKeys
+{
+public:
+    static constexpr size_t SLOTS = 4096;
+    static constexpr size_t PATH_LEN = 256;  // as in the access log
+    static constexpr size_t TRACE_BYTES = 64 << 20;  // read from the end of a long access log
+
+    HotKeys() : m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Hot Keys");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~HotKeys()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    HotKeys(const HotKeys &) = delete;
+    HotKeys &operator=(const HotKeys &) = delete;
+
+    /**
+     *  Count a request for the object at path
+     *
+     */
+    void hit(std::string_view path)
+    {
+        if (path.size() >= PATH_LEN)
+            return;
+
+        uint64_t h = hash(path);
+        Slot &slot = m_shared->slots[h % SLOTS];
+        if (slot.hash.load(std::memory_order_relaxed) == h)
+        {
+            slot.count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        uint32_t count = slot.count.load(std::memory_order_relaxed);
+        if (count > 0)
+        {
+            slot.count.compare_exchange_strong(count, count - 1, std::memory_order_relaxed);
+            return;
+        }
+
+        // skipped while another worker takes the slot
+        uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) || !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.length = path.size();
+        memcpy(slot.path, path.data(), path.size());
+        slot.hash.store(h, std::memory_order_relaxed);
+        slot.count.store(1, std::memory_order_relaxed);
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    /**
+     *  The paths with the most hits, at least min_count, hottest first
+     *
+     */
+    std::vector<std::string> top(size_t limit, uint32_t min_count = 1) const
+    {
+        std::vector<std::pair<uint32_t, std::string>> counted;
+        for (const Slot &slot : m_shared->slots)
+        {
+            uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+            uint32_t count = slot.count.load(std::memory_order_relaxed);
+            if ((sequence & 1) || (count == 0) || (count < min_count))
+                continue;
+
+            std::string path(slot.path, std::min<size_t>(slot.length, PATH_LEN));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+                counted.emplace_back(count, std::move(path));
+        }
+
+        std::sort(counted.begin(), counted.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < std::min(limit, counted.size()); i++)
+            paths.push_back(std::move(counted[i].second));
+        return paths;
+    }
+
+    /**
+     *  Halve every count, so old hits fade
+     *
+     */
+    void decay()
+    {
+        for (Slot &slot : m_shared->slots)
+            slot.count.store(slot.count.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Read the paths of a list written by save() or of an access log
+     *
+     *  An access log is read from the last TRACE_BYTES, its successful
+     *  GETs are counted and the most requested come first. A list is
+     *  one path per line, hottest first.
+     */
+    static std::vector<std::string> read(const std::string &file, size_t limit)
+    {
+        std::ifstream in(file, std::ios::binary | std::ios::ate);
+        if (!in)
+            return {};
+
+        // start on a whole line
+        std::streamoff size = in.tellg();
+        in.seekg(std::max<std::streamoff>(size - std::streamoff(TRACE_BYTES), 0));
+        std::string line;
+        if (size > std::streamoff(TRACE_BYTES))
+            std::getline(in, line);
+
+        std::unordered_map<std::string, std::pair<size_t, size_t>> counts;  // hits and first line
+        size_t lines = 0;
+        while (std::getline(in, line))
+        {
+            std::string path;
+            if (!line.empty() && (line[0] == '{'))
+            {
+                if ((field(line, "method") != "GET") || (status(line) / 100 != 2))
+                    continue;
+                path = unescape(field(line, "path"));
+            }
+            else
+                path = line;
+
+            if (path.empty() || (path[0] != '/'))
+                continue;
+            auto entry = counts.try_emplace(std::move(path), 0, lines++).first;
+            entry->second.first++;
+        }
+
+        std::vector<std::pair<std::string, std::pair<size_t, size_t>>> ranked(counts.begin(), counts.end());
+        std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b)
+                  { return (a.second.first != b.second.first) ? (a.second.first > b.second.first) : (a.second.second < b.second.second); });
+
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < std::min(limit, ranked.size()); i++)
+            paths.push_back(std::move(ranked[i].first));
+        return paths;
+    }
+
+    /**
+     *  Write a list of paths over file
+     *
+     */
+    static bool save(const std::string &file, const std::vector<std::string> &paths)
+    {
+        std::string tmp = file + "." + std::to_string(getpid());
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            for (auto &path : paths)
+                out << path << "\n";
+            if (!out.flush())
+            {
+                unlink(tmp.c_str());
+                return false;
+            }
+        }
+        return rename(tmp.c_str(), file.c_str()) == 0;
+    }
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<uint32_t> sequence{0};  // odd while the path is written
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint64_t> hash{0};
+        uint32_t length = 0;
+        char path[PATH_LEN];
+    };
+
+    struct Shared
+    {
+        Slot slots[SLOTS];
+    };
+
+    static uint64_t hash(std::string_view text)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : text)
+            h = (h ^ c) * 1099511628211ULL;
+        return h | 1;  // 0 is an empty slot
+    }
+
+    // a string value of the access log's JSON, still escaped
+    static std::string_view field(std::string_view line, std::string_view name)
+    {
+        std::string key = "\"" + std::string(name) + "\":\"";
+        size_t start = line.find(key);
+        if (start == std::string_view::npos)
+            return {};
+        start += key.size();
+
+        size_t end = start;
+        while ((end < line.size()) && (line[end] != '"'))
+            end += (line[end] == '\\') ? 2 : 1;
+        return line.substr(start, std::min(end, line.size()) - start);
+    }
+
+    static int status(std::string_view line)
+    {
+        size_t start = line.find("\"status\":");
+        return (start == std::string_view::npos) ? 0 : atoi(line.data() + start + 9);
+    }
+
+    static std::string unescape(std::string_view value)
+    {
+        std::string out;
+        for (size_t i = 0; i < value.size(); i++)
+        {
+            if ((value[i] == '\\') && (i + 1 < value.size()))
+                i++;
+            out += value[i];
+        }
+        return out;
+    }
+
+    Shared *m_shared;
+};
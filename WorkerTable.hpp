@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <stdexcept>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+/**
+ *  Connection timeouts in milliseconds
+ *
+ */
+struct Timeouts
+{
+    uint64_t header = 10000;   // receive the request headers
+    uint64_t body = 30000;     // between reads of the request body
+    uint64_t idle = 5000;      // keep-alive wait for the next request
+    uint64_t send = 30000;     // between writes of the response
+    uint64_t drain = 30000;    // in flight requests to finish on a restart or stop
+};
+
+/**
+ *  One slot per connection worker process
+ *
+ *  Lives in a shared anonymous mapping, the parent hands out the
+ *  slots and each worker publishes the phase it is in and the time
+ *  by which it must make progress. The parent kills workers which
+ *  miss their deadline.
+ */
+class WorkerTable
+{
+public:
+    enum class PHASE : uint8_t
+    {
+        FREE,
+        HEADER,
+        BODY,
+        HANDLER,
+        SEND,
+        IDLE
+    };
+
+    struct alignas(64) Slot
+    {
+        std::atomic<pid_t> pid{0};
+        std::atomic<PHASE> phase{PHASE::FREE};
+        std::atomic<uint64_t> deadline{0};
+        // admission held by the request in progress, given back if the worker dies
+        std::atomic<bool> admitted{false};
+        std::atomic<uint32_t> admission_class{0};
+        std::atomic<uint64_t> queued_bytes{0};
+        // the server is going away, close the connection after this request
+        std::atomic<bool> draining{false};
+    };
+
+    WorkerTable(size_t capacity) : m_capacity(capacity), m_slots(nullptr), m_free()
+    {
+        void *mem = mmap(NULL, m_capacity * sizeof(Slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Worker Table");
+
+        m_slots = static_cast<Slot *>(mem);
+        for (size_t i = 0; i < m_capacity; i++)
+            new (&m_slots[i]) Slot();
+
+        for (size_t i = m_capacity; i > 0; i--)
+            m_free.push_back(i - 1);
+    }
+
+    ~WorkerTable()
+    {
+        munmap(m_slots, m_capacity * sizeof(Slot));
+    }
+
+    WorkerTable(const WorkerTable &) = delete;
+    WorkerTable &operator=(const WorkerTable &) = delete;
+
+    /**
+     *  Milliseconds on the clock used for all deadlines
+     *
+     */
+    static inline uint64_t now_ms()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    /**
+     *  Take a free slot in the parent, false when all are in use
+     *
+     */
+    bool acquire(size_t &index, uint64_t deadline)
+    {
+        if (m_free.empty())
+            return false;
+
+        index = m_free.back();
+        m_free.pop_back();
+        m_slots[index].phase.store(PHASE::HEADER, std::memory_order_relaxed);
+        m_slots[index].deadline.store(deadline, std::memory_order_relaxed);
+        return true;
+    }
+
+    void release(size_t index)
+    {
+        m_slots[index].pid.store(0, std::memory_order_relaxed);
+        m_slots[index].phase.store(PHASE::FREE, std::memory_order_relaxed);
+        m_slots[index].admitted.store(false, std::memory_order_relaxed);
+        m_slots[index].draining.store(false, std::memory_order_relaxed);
+        m_free.push_back(index);
+    }
+
+    inline Slot &operator[](size_t index) { return m_slots[index]; }
+    inline size_t capacity() const { return m_capacity; }
+    inline size_t active() const { return m_capacity - m_free.size(); }
+
+    static inline const char *name(PHASE phase)
+    {
+        switch (phase)
+        {
+        case PHASE::HEADER:
+            return "header";
+        case PHASE::BODY:
+            return "body";
+        case PHASE::HANDLER:
+            return "handler";
+        case PHASE::SEND:
+            return "send";
+        case PHASE::IDLE:
+            return "idle";
+        default:
+            return "free";
+        }
+    }
+
+private:
+    size_t m_capacity;
+    Slot *m_slots;
+    // only used by the parent
+    std::vector<size_t> m_free;
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <new>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+/**
+ *  MSG_ZEROCOPY sends of large generated bodies
+ *
+ *  The kernel sends such a buffer from the pages it is in rather than
+ *  copying it, so the buffer may not be reused until the completion
+ *  for the send has been read from the socket's error queue, see
+ *  ZeroCopyConnection. Created in the parent before it forks, the
+ *  counters live in a shared anonymous mapping like the Metrics.
+ */
+class ZeroCopy
+{
+public:
+    static constexpr size_t MIN_SIZE = 64 * 1024;  // below this copying is cheaper
+
+    ZeroCopy() : m_threshold(0), m_shared(nullptr)
+    {
+        void *mem = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Cannot Map Zero Copy Counters");
+
+        m_shared = new (mem) Shared();
+    }
+
+    ~ZeroCopy()
+    {
+        munmap(m_shared, sizeof(Shared));
+    }
+
+    ZeroCopy(const ZeroCopy &) = delete;
+    ZeroCopy &operator=(const ZeroCopy &) = delete;
+
+    /**
+     *  Send buffers of at least threshold bytes with MSG_ZEROCOPY, 0 never
+     *
+     */
+    inline void setThreshold(size_t threshold) { m_threshold = threshold; }
+
+    inline bool enabled() const { return m_threshold > 0; }
+    inline bool use(size_t size) const { return (m_threshold > 0) && (size >= m_threshold); }
+
+    inline void sent(uint64_t bytes)
+    {
+        m_shared->sends.fetch_add(1, std::memory_order_relaxed);
+        m_shared->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    inline void copied()
+    {
+        m_shared->copied.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void waited(uint64_t elapsed_us)
+    {
+        m_shared->waits.fetch_add(1, std::memory_order_relaxed);
+        m_shared->wait_us.fetch_add(elapsed_us, std::memory_order_relaxed);
+    }
+
+    /**
+     *  Write the counters in Prometheus text format
+     *
+     */
+    void write(std::ostream &out) const
+    {
+        out << "# HELP http_zerocopy_sends_total Sends of response buffers with MSG_ZEROCOPY.\n";
+        out << "# TYPE http_zerocopy_sends_total counter\n";
+        out << "http_zerocopy_sends_total " << m_shared->sends.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_zerocopy_bytes_total Bytes sent with MSG_ZEROCOPY.\n";
+        out << "# TYPE http_zerocopy_bytes_total counter\n";
+        out << "http_zerocopy_bytes_total " << m_shared->bytes.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_zerocopy_copied_total Connections where the kernel copied zero copy sends anyway and they were turned off.\n";
+        out << "# TYPE http_zerocopy_copied_total counter\n";
+        out << "http_zerocopy_copied_total " << m_shared->copied.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_zerocopy_waits_total Times a connection waited for the kernel to release a buffer.\n";
+        out << "# TYPE http_zerocopy_waits_total counter\n";
+        out << "http_zerocopy_waits_total " << m_shared->waits.load(std::memory_order_relaxed) << "\n";
+
+        out << "# HELP http_zerocopy_wait_seconds_total Time spent waiting for the kernel to release buffers.\n";
+        out << "# TYPE http_zerocopy_wait_seconds_total counter\n";
+        out << "http_zerocopy_wait_seconds_total " << m_shared->wait_us.load(std::memory_order_relaxed) / 1e6 << "\n";
+    }
+
+private:
+    struct Shared
+    {
+        std::atomic<uint64_t> sends{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> copied{0};
+        std::atomic<uint64_t> waits{0};
+        std::atomic<uint64_t> wait_us{0};
+    };
+
+    size_t m_threshold;
+    Shared *m_shared;
+};
+
+/**
+ *  The zero copy sends of one connection in a worker process
+ *
+ *  Each successful MSG_ZEROCOPY send is numbered by the kernel, it
+ *  reports ranges of those numbers on the error queue as the pages
+ *  are released. When the kernel reports that it had to copy, as it
+ *  does over loopback, the connection stops asking.
+ */
+class ZeroCopyConnection
+{
+public:
+    ZeroCopyConnection() : m_socket(-1), m_enabled(false), m_sent(0), m_done(0)
+    {
+    }
+
+    ZeroCopyConnection(const ZeroCopyConnection &) = delete;
+    ZeroCopyConnection &operator=(const ZeroCopyConnection &) = delete;
+
+    /**
+     *  Start a connection, zero copy is only used if the socket allows it
+     *
+     */
+    void start(int socket, bool enable)
+    {
+        int one = 1;
+        m_socket = socket;
+        m_enabled = enable && (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0);
+        m_sent = m_done = 0;
+    }
+
+    inline bool enabled() const { return m_enabled; }
+    inline bool pending() const { return m_done != m_sent; }
+
+    /**
+     *  Count a send made with MSG_ZEROCOPY
+     *
+     */
+    inline void sent() { m_sent++; }
+
+    /**
+     *  Read the completions on the error queue, with wait until every
+     *  send has completed
+     *
+     *  Returns false if there was an error or timed_out is set while
+     *  waiting. Returns true on a copied completion once, with copied
+     *  set, after that the connection no longer uses zero copy.
+     */
+    bool reap(bool wait, const volatile sig_atomic_t &timed_out, bool &copied)
+    {
+        copied = false;
+        while (pending())
+        {
+            char control[128];
+            struct msghdr msg = {};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (recvmsg(m_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            {
+                if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                    return false;
+                if (!wait)
+                    return true;
+
+                // the error queue shows as POLLERR, the send timeout interrupts the wait
+                struct pollfd pfd = {m_socket, 0, 0};
+                if ((poll(&pfd, 1, -1) < 0) && ((errno != EINTR) || timed_out))
+                    return false;
+                if (timed_out)
+                    return false;
+                continue;
+            }
+
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (!(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+                      ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))))
+                    continue;
+
+                const struct sock_extended_err *err = reinterpret_cast<const struct sock_extended_err *>(CMSG_DATA(cmsg));
+                if ((err->ee_errno != 0) || (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+                    continue;
+
+                // sends ee_info to ee_data inclusive have completed
+                m_done += err->ee_data - err->ee_info + 1;
+                if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && m_enabled)
+                {
+                    m_enabled = false;
+                    copied = true;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    int m_socket;
+    bool m_enabled;
+    uint32_t m_sent;
+    uint32_t m_done;
+};
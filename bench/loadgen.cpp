@@ -0,0 +1,393 @@
+/**
+ *  HTTP load generator
+ *
+ *  Starts an S3HttpServer on a temporary storage root, loads it with
+ *  objects and runs a mix of GET/HEAD/PUT/LIST requests from several
+ *  threads, then reports throughput and latency percentiles.
+ *
+ *  Closed loop: each thread sends its next request when the last completes.
+ *  Open loop (--rate): requests are sent on a fixed schedule and latency
+ *  is measured from the scheduled time, so a slow server is not hidden
+ *  by the client backing off.
+ *
+ *  With --unix the server also listens on a Unix domain socket and the
+ *  requests go to it, run with and without to compare against loopback TCP.
+ *
+ *  ./loadgen [--threads N] [--duration S] [--rate R] [--objects N]
+ *            [--size BYTES] [--mix get,head,put,list] [--port P] [--unix PATH]
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include "../S3HttpServer.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+enum Op
+{
+    OP_GET,
+    OP_HEAD,
+    OP_PUT,
+    OP_LIST,
+    OP_COUNT
+};
+
+static const char *OP_NAMES[OP_COUNT] = {"GET", "HEAD", "PUT", "LIST"};
+
+struct Options
+{
+    unsigned short port = 9876;
+    std::string unix_path;
+    unsigned int threads = 4;
+    double duration = 10;
+    double rate = 0;
+    unsigned int objects = 100;
+    size_t size = 4096;
+    unsigned int mix[OP_COUNT] = {70, 10, 10, 10};
+};
+
+struct Results
+{
+    std::vector<uint64_t> latency_us[OP_COUNT];
+    uint64_t errors[OP_COUNT] = {};
+    uint64_t bytes = 0;
+};
+
+/**
+ *  Send one request on a new connection and read the response
+ *
+ *  Return the status code, or 0 on a connection error.
+ */
+static int exchange(const Options &options, const std::string &head, const std::string &body, size_t &received)
+{
+    int sock = socket(options.unix_path.empty() ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return 0;
+
+    int connected;
+    if (options.unix_path.empty())
+    {
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        connected = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    else
+    {
+        struct sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, options.unix_path.c_str(), sizeof(addr.sun_path) - 1);
+        connected = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    if (connected != 0)
+    {
+        close(sock);
+        return 0;
+    }
+
+    std::string response;
+    char buf[16384];
+
+    if (write(sock, head.data(), head.size()) != ssize_t(head.size()))
+    {
+        close(sock);
+        return 0;
+    }
+
+    if (!body.empty())
+    {
+        // wait for 100 Continue before sending the body
+        while (response.find("\r\n\r\n") == std::string::npos)
+        {
+            ssize_t n = read(sock, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            response.append(buf, n);
+        }
+        if (response.compare(0, 12, "HTTP/1.1 100") != 0)
+        {
+            close(sock);
+            return response.size() > 12 ? atoi(response.c_str() + 9) : 0;
+        }
+        response.clear();
+
+        if (write(sock, body.data(), body.size()) != ssize_t(body.size()))
+        {
+            close(sock);
+            return 0;
+        }
+    }
+
+    // Connection: close, the response ends when the server closes
+    ssize_t n;
+    while ((n = read(sock, buf, sizeof(buf))) > 0)
+        response.append(buf, n);
+    close(sock);
+
+    received = response.size();
+    if (response.size() < 12 || response.compare(0, 5, "HTTP/") != 0)
+        return 0;
+    return atoi(response.c_str() + 9);
+}
+
+static std::string request_head(const char *method, const std::string &path, size_t length)
+{
+    std::string head = std::string(method) + " " + path + " HTTP/1.1\r\n";
+    head += "Host: localhost\r\n";
+    head += "Connection: close\r\n";
+    if (length > 0)
+    {
+        head += "Content-Length: " + std::to_string(length) + "\r\n";
+        head += "Expect: 100-continue\r\n";
+    }
+    head += "\r\n";
+    return head;
+}
+
+static bool expected(Op op, int status)
+{
+    return (op == OP_PUT) ? (status == 201) : (status == 200);
+}
+
+static int run(Op op, const Options &options, std::mt19937 &rng, const std::string &body, size_t &received)
+{
+    std::string key = "/bench/object-" + std::to_string(rng() % options.objects);
+
+    switch (op)
+    {
+    case OP_GET:
+        return exchange(options, request_head("GET", key, 0), "", received);
+    case OP_HEAD:
+        return exchange(options, request_head("HEAD", key, 0), "", received);
+    case OP_PUT:
+        return exchange(options, request_head("PUT", key, body.size()), body, received);
+    case OP_LIST:
+    default:
+        return exchange(options, request_head("GET", "/bench", 0), "", received);
+    }
+}
+
+static void worker(const Options &options, unsigned int id, Clock::time_point start, Clock::time_point end, Results &results)
+{
+    std::mt19937 rng(id * 7919 + 1);
+    std::string body(options.size, 'x');
+
+    unsigned int total = 0;
+    for (unsigned int w : options.mix)
+        total += w;
+
+    std::chrono::duration<double> interval(options.rate > 0 ? options.threads / options.rate : 0);
+    Clock::time_point next = start + std::chrono::duration_cast<Clock::duration>(interval * (double(id) / options.threads));
+
+    while (true)
+    {
+        Clock::time_point sent;
+        if (options.rate > 0)
+        {
+            // open loop, latency counts from the scheduled send time
+            if (next >= end)
+                break;
+            std::this_thread::sleep_until(next);
+            sent = next;
+            next += std::chrono::duration_cast<Clock::duration>(interval);
+        }
+        else
+        {
+            sent = Clock::now();
+            if (sent >= end)
+                break;
+        }
+
+        unsigned int pick = rng() % total;
+        Op op = OP_GET;
+        for (int o = 0; o < OP_COUNT; o++)
+        {
+            if (pick < options.mix[o])
+            {
+                op = Op(o);
+                break;
+            }
+            pick -= options.mix[o];
+        }
+
+        size_t received = 0;
+        int status = run(op, options, rng, body, received);
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent).count();
+
+        if (expected(op, status))
+        {
+            results.latency_us[op].push_back(us);
+            results.bytes += received;
+        }
+        else
+        {
+            results.errors[op]++;
+        }
+    }
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+    return sorted[index];
+}
+
+static void report(const char *name, std::vector<uint64_t> &latency, uint64_t errors, double seconds)
+{
+    std::sort(latency.begin(), latency.end());
+    printf("%-6s %10zu %8lu %12.1f %10lu %10lu %10lu %10lu\n", name, latency.size(), (unsigned long)errors,
+           latency.size() / seconds,
+           (unsigned long)percentile(latency, 0.50), (unsigned long)percentile(latency, 0.99),
+           (unsigned long)percentile(latency, 0.999), (unsigned long)(latency.empty() ? 0 : latency.back()));
+}
+
+static bool parse(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        std::string value = argv[++i];
+
+        if (arg == "--threads")
+            options.threads = std::max(1, atoi(value.c_str()));
+        else if (arg == "--duration")
+            options.duration = atof(value.c_str());
+        else if (arg == "--rate")
+            options.rate = atof(value.c_str());
+        else if (arg == "--objects")
+            options.objects = std::max(1, atoi(value.c_str()));
+        else if (arg == "--size")
+            options.size = atol(value.c_str());
+        else if (arg == "--port")
+            options.port = atoi(value.c_str());
+        else if (arg == "--unix")
+            options.unix_path = value;
+        else if (arg == "--mix")
+        {
+            if (sscanf(value.c_str(), "%u,%u,%u,%u", &options.mix[OP_GET], &options.mix[OP_HEAD], &options.mix[OP_PUT], &options.mix[OP_LIST]) != 4)
+                return false;
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parse(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s [--threads N] [--duration S] [--rate R] [--objects N] [--size BYTES] [--mix get,head,put,list] [--port P] [--unix PATH]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    char root_template[] = "/tmp/s3load.XXXXXX";
+    std::string root = mkdtemp(root_template);
+
+    pid_t server = fork();
+    if (server == 0)
+    {
+        S3HttpServer s3(options.port, root.c_str(), "/");
+        if (!options.unix_path.empty())
+            s3.enableUnixSocket(options.unix_path);
+        s3.Accept();
+        _exit(0);
+    }
+
+    // wait for the server to listen, then create the bucket and objects
+    size_t received = 0;
+    int status = 0;
+    for (int attempt = 0; attempt < 50 && status == 0; attempt++)
+    {
+        usleep(100000);
+        status = exchange(options, request_head("PUT", "/bench", 0), "", received);
+    }
+    if (status != 200)
+    {
+        fprintf(stderr, "cannot create bucket on %s: %d\n", options.unix_path.empty() ? std::to_string(options.port).c_str() : options.unix_path.c_str(), status);
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        std::filesystem::remove_all(root);
+        return EXIT_FAILURE;
+    }
+
+    std::string body(options.size, 'x');
+    for (unsigned int i = 0; i < options.objects; i++)
+        exchange(options, request_head("PUT", "/bench/object-" + std::to_string(i), body.size()), body, received);
+
+    printf("%s, %s loop, %u threads, %.0fs, %u objects of %zu bytes, mix get/head/put/list %u/%u/%u/%u",
+           options.unix_path.empty() ? "tcp" : "unix", options.rate > 0 ? "open" : "closed", options.threads, options.duration, options.objects, options.size,
+           options.mix[OP_GET], options.mix[OP_HEAD], options.mix[OP_PUT], options.mix[OP_LIST]);
+    if (options.rate > 0)
+        printf(", %.0f req/s", options.rate);
+    printf("\n");
+
+    std::vector<Results> results(options.threads);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+
+    for (unsigned int t = 0; t < options.threads; t++)
+        threads.emplace_back(worker, std::cref(options), t, start, end, std::ref(results[t]));
+    for (auto &t : threads)
+        t.join();
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("%-6s %10s %8s %12s %10s %10s %10s %10s\n", "op", "requests", "errors", "req/s", "p50 us", "p99 us", "p999 us", "max us");
+
+    Results all;
+    for (int o = 0; o < OP_COUNT; o++)
+    {
+        std::vector<uint64_t> latency;
+        uint64_t errors = 0;
+        for (auto &r : results)
+        {
+            latency.insert(latency.end(), r.latency_us[o].begin(), r.latency_us[o].end());
+            errors += r.errors[o];
+        }
+        all.latency_us[0].insert(all.latency_us[0].end(), latency.begin(), latency.end());
+        all.errors[0] += errors;
+        if (!latency.empty() || errors > 0)
+            report(OP_NAMES[o], latency, errors, seconds);
+    }
+    report("all", all.latency_us[0], all.errors[0], seconds);
+
+    uint64_t bytes = 0;
+    for (auto &r : results)
+        bytes += r.bytes;
+    printf("received %.1f MB/s\n", bytes / seconds / 1e6);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    std::filesystem::remove_all(root);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,431 @@
+/**
+ *  Micro benchmarks of the per request code paths
+ *
+ *  Also checks that a steady state GET makes no heap allocations,
+ *  exits with failure if it does.
+ *
+ *  ./micro [iterations]
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <thread>
+
+#include <sys/socket.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include "../S3HttpServer.hpp"
+
+// every heap allocation in the process is counted
+static std::atomic<size_t> s_allocations{0};
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+template <typename T>
+inline void keep(T &&value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/**
+ *  Run fn iterations times after a short warm up
+ *  and print the mean time per call
+ *
+ */
+template <typename F>
+void bench(const char *name, size_t iterations, F fn)
+{
+    for (size_t i = 0; i < iterations / 10; i++)
+        fn();
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+        fn();
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    printf("%-32s %12.1f ns/op %14.0f op/s\n", name, ns, 1e9 / ns);
+}
+
+struct AttributeBench : public S3HttpServer
+{
+    using S3HttpServer::getAttributes;
+    using S3HttpServer::listContents;
+};
+
+/**
+ *  The bucket scan LIST_OBJECT made before DirScanner, by path
+ *
+ */
+static void listByPath(const std::filesystem::path &bucket_path, std::ostream &mesg)
+{
+    for (const auto &entry : std::filesystem::directory_iterator(bucket_path))
+    {
+        if (StorageRoots::isHidden(entry.path()))
+            continue;
+
+        Headers attributes;
+        AttributeBench::getAttributes(entry.path().c_str(), attributes);
+
+        struct stat struct_stat;
+        stat(entry.path().c_str(), &struct_stat);
+        std::string last_mod{std::ctime(&(struct_stat.st_mtim).tv_sec)};
+        last_mod.pop_back();
+
+        mesg << "\t<Contents>\n";
+        mesg << "\t\t<Key>" << attributes["x-amz-meta-Key"] << "</Key>\n";
+        mesg << "\t\t<LastModified>" << last_mod << "</LastModified>\n";
+        mesg << "\t\t<ETag>" << struct_stat.st_ino << "-" << struct_stat.st_size << "-" << struct_stat.st_mtim.tv_sec << "</ETag>\n";
+        mesg << "\t\t<Size>" << struct_stat.st_size << "</Size>\n";
+        mesg << "\t</Contents>\n";
+    }
+}
+
+/**
+ *  Drives requests through a server connection over a socketpair
+ *
+ */
+struct ConnectionBench : public S3HttpServer
+{
+    ConnectionBench(const std::string &root) : S3HttpServer(0, root.c_str(), "/") {}
+
+    using S3HttpServer::record;
+
+    /**
+     *  Serve the requests as one keep-alive connection,
+     *  return the heap allocations made while doing it
+     */
+    size_t run(const std::string &requests)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+            return 0;
+
+        std::thread writer([&]()
+                           {
+                               size_t sent = 0;
+                               while (sent < requests.size())
+                               {
+                                   ssize_t n = write(fds[1], requests.data() + sent, requests.size() - sent);
+                                   if (n <= 0)
+                                       break;
+                                   sent += n;
+                               }
+                               shutdown(fds[1], SHUT_WR);
+                           });
+        std::thread reader([&]()
+                           {
+                               char buf[65536];
+                               while (read(fds[1], buf, sizeof(buf)) > 0)
+                                   ;
+                           });
+
+        struct sockaddr_storage client{};
+        size_t before = s_allocations.load();
+        serve(fds[0], client, RequestRecord::now());
+        size_t allocations = s_allocations.load() - before;
+
+        shutdown(fds[0], SHUT_RDWR);
+        writer.join();
+        reader.join();
+        close(fds[0]);
+        close(fds[1]);
+        return allocations;
+    }
+};
+
+static std::string repeat(const std::string &request, size_t count)
+{
+    std::string requests;
+    for (size_t i = 0; i < count; i++)
+        requests += request;
+    return requests;
+}
+
+int main(int argc, char **argv)
+{
+    size_t iterations = argc > 1 ? atol(argv[1]) : 200000;
+
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    const std::string get_request =
+        "GET /bucket/photos/2024/holiday/image-0001.jpg HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "User-Agent: aws-sdk-cpp/1.11\r\n"
+        "Accept: */*\r\n"
+        "If-None-Match: 1234-5678-1700000000\r\n"
+        "Range: bytes=0-1023\r\n"
+        "x-amz-date: 20240101T000000Z\r\n"
+        "x-amz-content-sha256: UNSIGNED-PAYLOAD\r\n"
+        "\r\n";
+
+    const std::string list_request =
+        "GET /bucket?list-type=2&prefix=photos%2F&max-keys=1000 HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "\r\n";
+
+    bench("Request GET parse", iterations, [&]()
+          { Request request{get_request}; keep(request); });
+
+    bench("Request LIST parse", iterations, [&]()
+          { Request request{list_request}; keep(request); });
+
+    Arena arena;
+    std::pmr::memory_resource *heap = std::pmr::set_default_resource(arena.resource());
+    bench("Request GET parse (arena)", iterations, [&]()
+          {
+              {
+                  Request request{get_request};
+                  keep(request);
+              }
+              arena.reset();
+          });
+    std::pmr::set_default_resource(heap);
+
+    Response response{};
+    struct stat details;
+    stat("/", &details);
+    response.addFileHeaders(&details, "/index.html");
+    response.addHeader("x-amz-meta-Key", "photos/2024/holiday/image-0001.jpg");
+
+    bench("Response::headers_str", iterations, [&]()
+          { auto headers = response.headers_str(); keep(headers); });
+
+    bench("Response construct", iterations, [&]()
+          { Response r{}; keep(r); });
+
+    // the cost tracing adds to every request, a mark and a Server-Timing header
+    RequestTrace trace;
+    RequestTrace::s_enabled = true;
+    trace.start(RequestRecord::now());
+    bench("RequestTrace mark", iterations, [&]()
+          { trace.mark(RequestTrace::HANDLER); });
+    Response::s_trace = &trace;
+    bench("Response::headers_str (Server-Timing)", iterations, [&]()
+          { auto headers = response.headers_str(); keep(headers); });
+    Response::s_trace = nullptr;
+    RequestTrace::s_enabled = false;
+
+    // a 1000 key listing written through the per connection gzip writer
+    GzipWriter gzip;
+    size_t listing_size = 0, listing_gzipped = 0;
+    bench("LIST body 1000 keys (gzip)", iterations / 100, [&]()
+          {
+              std::pmr::string body;
+              std::ostream mesg(gzip.start(body, true));
+              mesg << "<ListBucketResult>\n";
+              for (int i = 0; i < 1000; i++)
+              {
+                  mesg << "\t<Contents>\n";
+                  mesg << "\t\t<Key>photos/2024/holiday/image-" << i << ".jpg</Key>\n";
+                  mesg << "\t\t<LastModified>Mon Jan  1 00:00:00 2024</LastModified>\n";
+                  mesg << "\t\t<ETag>" << 1000000 + i << "-" << 4096 * i << "-1704067200</ETag>\n";
+                  mesg << "\t\t<Size>" << 4096 * i << "</Size>\n";
+                  mesg << "\t</Contents>\n";
+              }
+              mesg << "</ListBucketResult>\n";
+              gzip.finish();
+              listing_size = gzip.rawSize();
+              listing_gzipped = body.size();
+          });
+    printf("%-32s %8zu -> %zu bytes\n", "LIST body gzip", listing_size, listing_gzipped);
+
+    // a 1MB CSV block, with and without a value to search lines for first
+    std::string rows = "id,city,amount\n";
+    for (int i = 0; rows.size() < (1 << 20); i++)
+        rows += std::to_string(i) + "," + ((i % 97) ? "Paris" : "Oslo") + "," + std::to_string(i % 1000) + "\n";
+    std::string_view rows_header(rows.data(), rows.find('\n'));
+    std::string_view rows_body = std::string_view(rows).substr(rows_header.size() + 1);
+    std::string select_error;
+    for (const char *expression : {"city = Oslo", "amount > 990"})
+    {
+        RowFilter filter(RowFilter::FORMAT::CSV, ',');
+        filter.parse(expression, select_error);
+        filter.header(rows_header, select_error);
+        std::string matched;
+        matched.reserve(rows.size());
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 100; i++)
+        {
+            matched.clear();
+            keep(filter.filter(rows_body, true, matched));
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%-32s %12.0f MB/s %14zu bytes\n", (std::string("RowFilter ") + expression).c_str(), 100 * rows_body.size() / seconds / 1e6, matched.size());
+    }
+
+    // share of 100k object hashes owned by each root
+    for (size_t count : {2, 4})
+    {
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < count; i++)
+        {
+            char ring_template[] = "/tmp/s3ring.XXXXXX";
+            paths.push_back(mkdtemp(ring_template));
+        }
+        StorageRoots ring(paths);
+        std::vector<size_t> owned(count, 0);
+        const size_t keys = 100000;
+        for (size_t i = 0; i < keys; i++)
+        {
+            std::string key = "photos/image-" + std::to_string(i) + ".jpg";
+            boost::uuids::detail::sha1 sha1;
+            sha1.process_bytes(key.data(), key.size());
+            unsigned int digest[5];
+            sha1.get_digest(digest);
+            char hash[41];
+            for (int d = 0; d < 5; d++)
+                snprintf(hash + d * 8, 9, "%08x", digest[d]);
+            const std::filesystem::path &owner = ring.locate(std::string_view(hash, 40));
+            owned[std::find(paths.begin(), paths.end(), owner.string()) - paths.begin()]++;
+        }
+        std::string shares;
+        for (size_t n : owned)
+            shares += " " + std::to_string(n * 100 / keys) + "%";
+        printf("%-32s %s\n", ("StorageRoots balance " + std::to_string(count) + " roots").c_str(), shares.c_str());
+        for (auto &path : paths)
+            std::filesystem::remove_all(path);
+    }
+
+    char root_template[] = "/tmp/s3bench.XXXXXX";
+    std::string root = mkdtemp(root_template);
+    StorageRoots roots(std::vector<std::string>{root});
+
+    Request request{get_request};
+
+    // the conditional and range headers GET_OBJECT looks at
+    bench("Request getHeader (well known)", iterations, [&]()
+          {
+              keep(request.getHeader(HEADER::IF_NONE_MATCH));
+              keep(request.getHeader(HEADER::IF_MATCH));
+              keep(request.getHeader(HEADER::IF_MODIFIED_SINCE));
+              keep(request.getHeader(HEADER::RANGE));
+          });
+
+    bench("Request getHeader (by name)", iterations, [&]()
+          {
+              keep(request.getHeader("If-None-Match"));
+              keep(request.getHeader("x-amz-meta-album"));
+          });
+
+    bench("PathDetails parse + hash", iterations, [&]()
+          {
+              std::pmr::vector<std::string_view> parts(request.segments().begin(), request.segments().end());
+              PathDetails details(parts, roots);
+              details.resolve(roots);
+              keep(details);
+          });
+
+    std::filesystem::path object = std::filesystem::path(root) / "object";
+    std::ofstream(object) << "content";
+
+    const char *mime = "image/jpeg";
+    const char *key = "photos/2024/holiday/image-0001.jpg";
+    const char *meta = "holiday";
+    if ((setxattr(object.c_str(), PathDetails::XATT_MIME_TYPE, mime, strlen(mime), 0) == 0) &&
+        (setxattr(object.c_str(), PathDetails::XATT_KEY_NAME, key, strlen(key), 0) == 0) &&
+        (setxattr(object.c_str(), "user.S3.album", meta, strlen(meta), 0) == 0))
+    {
+        bench("getAttributes (3 xattrs)", iterations / 10, [&]()
+              {
+                  Headers headers;
+                  AttributeBench::getAttributes(object.c_str(), headers);
+                  keep(headers);
+              });
+
+        // a bucket of objects with a key and a content type, as PUT_OBJECT leaves them
+        const int objects = 2000;
+        std::filesystem::path bucket = std::filesystem::path(root) / "bucket";
+        std::filesystem::create_directory(bucket);
+        for (int i = 0; i < objects; i++)
+        {
+            std::filesystem::path file = bucket / std::to_string(1000000 + i);
+            std::ofstream(file) << "content";
+            std::string name = "photos/2024/holiday/image-" + std::to_string(i) + ".jpg";
+            setxattr(file.c_str(), PathDetails::XATT_MIME_TYPE, mime, strlen(mime), 0);
+            setxattr(file.c_str(), PathDetails::XATT_KEY_NAME, name.c_str(), name.size(), 0);
+        }
+
+        std::string by_path, by_scanner;
+        auto scan = [&](const char *name, std::string &listing, auto list)
+        {
+            size_t scans = std::max<size_t>(iterations / 20000, 1);
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < scans; i++)
+            {
+                std::ostringstream mesg;
+                list(mesg);
+                listing = mesg.str();
+            }
+            auto end = std::chrono::steady_clock::now();
+            double ns = std::chrono::duration<double, std::nano>(end - start).count() / (scans * objects);
+            printf("%-32s %12.1f ns/entry %11.0f entries/s\n", name, ns, 1e9 / ns);
+        };
+        scan("LIST scan (path stat, xattrs)", by_path, [&](std::ostream &mesg) { listByPath(bucket, mesg); });
+        scan("LIST scan (getdents, statx)", by_scanner, [&](std::ostream &mesg) { AttributeBench::listContents(bucket.c_str(), mesg); });
+        if (by_path != by_scanner)
+            printf("%-32s listings differ\n", "LIST scan");
+    }
+    else
+    {
+        printf("%-32s skipped, no extended attributes on %s\n", "getAttributes", root.c_str());
+    }
+
+    std::filesystem::remove_all(root);
+
+    // steady state GETs on a keep-alive connection, the difference
+    // between two runs leaves out the cost of the connection itself
+    char server_template[] = "/tmp/s3bench.XXXXXX";
+    root = mkdtemp(server_template);
+    ConnectionBench server(root);
+    const std::string body(1024, 'x');
+    server.run("PUT /bucket HTTP/1.1\r\n\r\n"
+               "PUT /bucket/photos/image-0001.jpg HTTP/1.1\r\nContent-Length: 1024\r\n\r\n" + body);
+
+    const std::string get_object = "GET /bucket/photos/image-0001.jpg HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n";
+    const size_t gets = 1000;
+    std::string few = repeat(get_object, gets);
+    std::string many = repeat(get_object, 2 * gets);
+    server.run(few);
+
+    size_t few_allocations = server.run(few);
+    auto start = std::chrono::steady_clock::now();
+    size_t many_allocations = server.run(many);
+    auto end = std::chrono::steady_clock::now();
+
+    // the 1KB body goes out with the head in one write
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / (2 * gets);
+    printf("%-32s %12.1f ns/op %14.0f op/s\n", "GET 1KB keep-alive", ns, 1e9 / ns);
+
+    double per_get = (double(many_allocations) - double(few_allocations)) / gets;
+    printf("%-32s %12.2f allocations/op\n", "GET heap allocations", per_get);
+
+    std::filesystem::remove_all(root);
+
+    if (server.record().status != 200)
+    {
+        fprintf(stderr, "GET failed with status %d\n", server.record().status);
+        return EXIT_FAILURE;
+    }
+
+    if (per_get > 0)
+    {
+        fprintf(stderr, "steady state GET allocates from the heap\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}